@@ -0,0 +1,234 @@
+//************** MIDIcloro **************
+//
+// Trace analyzer: reads the trace dumps written by a MIDIcloro built
+// with tracing (make trace) and puts the records of each message back
+// together, to show where the time between input and output went.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-analyze [-n slowest messages to list] trace.bin ...
+//
+//***************************************
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "trace.h"
+#include "histogram.h"
+
+using namespace std;
+
+// The stages of one message, times are 0 where there's no record
+struct TracedEvent {
+  TracedEvent() : receive(0), pop(0), handle(0), firstOutput(0), lastOutput(0), nOutputs(0),
+                  port(TRACE_NO_PORT), branch(-1), status(0), dropped(false) {}
+  long long receive;
+  long long pop;
+  long long handle;
+  long long firstOutput;
+  long long lastOutput;
+  int nOutputs;
+  int port;
+  int branch;
+  int status;
+  bool dropped;
+};
+
+// Stage to stage latencies
+enum Span { SPAN_QUEUE, SPAN_DISPATCH, SPAN_ENGINE, SPAN_FIRST_OUTPUT, SPAN_LAST_OUTPUT, SPANS };
+const char *SPAN_NAMES[SPANS] = {
+  "receive to pop", "pop to handle", "handle to first output", "receive to first output", "receive to last output"
+};
+
+int nSlowest = 10;
+
+void usage(void);
+bool analyzeFile(const string &path);
+void printHistogram(const string &name, const Histogram &histogram);
+long long span(const TracedEvent &event, int s);
+
+int main(int argc, char *argv[]) {
+  vector<string> files;
+  for (int i=1; i<argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i+1 < argc)
+      nSlowest = atoi(argv[++i]);
+    else if (arg[0] == '-')
+      usage();
+    else
+      files.push_back(arg);
+  }
+  if (files.empty() || nSlowest < 0)
+    usage();
+
+  int failed = 0;
+  for (unsigned int i=0; i<files.size(); i++)
+    if (!analyzeFile(files[i]))
+      failed++;
+  return failed > 0 ? 1 : 0;
+}
+
+void usage(void) {
+  cout << "Usage: ./midicloro-analyze [-n slowest messages to list] trace.bin ..." << endl;
+  exit(0);
+}
+
+long long span(const TracedEvent &event, int s) {
+  long long from = 0, to = 0;
+  switch (s) {
+    case SPAN_QUEUE: from = event.receive; to = event.pop; break;
+    case SPAN_DISPATCH: from = event.pop; to = event.handle; break;
+    case SPAN_ENGINE: from = event.handle; to = event.firstOutput; break;
+    case SPAN_FIRST_OUTPUT: from = event.receive; to = event.firstOutput; break;
+    case SPAN_LAST_OUTPUT: from = event.receive; to = event.lastOutput; break;
+  }
+  return from != 0 && to != 0 ? to - from : -1;
+}
+
+void printHistogram(const string &name, const Histogram &histogram) {
+  if (histogram.getCount() == 0)
+    return;
+  cout << "  " << left << setw(26) << name << right << setw(8) << histogram.getCount()
+       << setw(10) << histogram.percentile(0.5)/1000.0 << setw(10) << histogram.percentile(0.99)/1000.0
+       << setw(10) << histogram.percentile(0.999)/1000.0 << setw(10) << histogram.getMax()/1000.0 << endl;
+}
+
+bool analyzeFile(const string &path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    cerr << "Couldn't open " << path << endl;
+    return false;
+  }
+  TraceFileHeader header;
+  char names[TRACE_MAX_THREADS][TRACE_THREAD_NAME_SIZE];
+  vector<TraceRecord> records;
+  bool ok = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0 &&
+            header.nThreads <= (unsigned int)TRACE_MAX_THREADS &&
+            fread(names, TRACE_THREAD_NAME_SIZE, header.nThreads, f) == header.nThreads;
+  if (ok) {
+    records.resize(header.nRecords);
+    ok = records.empty() || fread(&records[0], sizeof(TraceRecord), records.size(), f) == records.size();
+  }
+  fclose(f);
+  if (!ok) {
+    cerr << "Not a MIDIcloro trace: " << path << endl;
+    return false;
+  }
+
+  cout << path << ": " << records.size() << " records";
+  if (!records.empty())
+    cout << " over " << (records.back().time - records.front().time)/1000000.0 << " ms";
+  if (header.threshold > 0)
+    cout << ", written after a message took over " << header.threshold/1000 << " us";
+  else
+    cout << ", written on request";
+  cout << endl << "Threads:";
+  for (unsigned int t=0; t<header.nThreads; t++)
+    cout << " " << t << "=" << string(names[t], strnlen(names[t], TRACE_THREAD_NAME_SIZE));
+  cout << endl;
+
+  // Put the records of each message together, and follow how much the output held back
+  map<long long, TracedEvent> events;
+  unsigned long drops = 0;
+  int maxHeld = 0;
+  long long maxHeldTime = 0;
+  for (unsigned int i=0; i<records.size(); i++) {
+    const TraceRecord &r = records[i];
+    if (r.stage == TRACE_FLUSH) {
+      if (r.detail > maxHeld) {
+        maxHeld = r.detail;
+        maxHeldTime = r.time;
+      }
+      continue;
+    }
+    if (r.eventId == 0 || r.stage >= TRACE_STAGES)
+      continue;
+    TracedEvent &event = events[r.eventId];
+    if (r.port != TRACE_NO_PORT)
+      event.port = r.port;
+    switch (r.stage) {
+      case TRACE_RECEIVE:
+        event.receive = r.time;
+        event.status = r.detail;
+        break;
+      case TRACE_DROP:
+        event.dropped = true;
+        drops++;
+        break;
+      case TRACE_POP:
+        event.pop = r.time;
+        event.status = r.detail;
+        break;
+      case TRACE_HANDLE:
+        event.handle = r.time;
+        event.branch = r.detail;
+        break;
+      case TRACE_OUTPUT:
+        if (event.firstOutput == 0)
+          event.firstOutput = r.time;
+        event.lastOutput = r.time;
+        event.nOutputs++;
+        break;
+    }
+  }
+  cout << events.size() << " messages, " << drops << " dropped at a full input queue";
+  if (maxHeld > 0)
+    cout << ", up to " << maxHeld << " messages held back by the output "
+         << (maxHeldTime - records.front().time)/1000000.0 << " ms into the trace";
+  cout << endl << endl;
+
+  // Latency of each span, over all messages and by engine branch
+  Histogram spans[SPANS];
+  Histogram branchLatency[TRACE_BRANCHES];
+  vector<pair<long long, long long> > slowest;
+  for (map<long long, TracedEvent>::iterator it = events.begin(); it != events.end(); ++it) {
+    const TracedEvent &event = it->second;
+    for (int s=0; s<SPANS; s++) {
+      long long latency = span(event, s);
+      if (latency >= 0)
+        spans[s].record(latency);
+    }
+    long long total = span(event, SPAN_LAST_OUTPUT);
+    if (total >= 0 && event.branch >= 0 && event.branch < TRACE_BRANCHES)
+      branchLatency[event.branch].record(total);
+    if (total >= 0)
+      slowest.push_back(make_pair(total, it->first));
+  }
+  cout << "  " << left << setw(26) << "us" << right << setw(8) << "count" << setw(10) << "p50"
+       << setw(10) << "p99" << setw(10) << "p99.9" << setw(10) << "max" << endl;
+  for (int s=0; s<SPANS; s++)
+    printHistogram(SPAN_NAMES[s], spans[s]);
+  cout << endl << "  Receive to last output by branch:" << endl;
+  for (int b=0; b<TRACE_BRANCHES; b++)
+    printHistogram(TRACE_BRANCH_NAMES[b], branchLatency[b]);
+
+  // The slowest messages stage by stage, in us from being received
+  sort(slowest.rbegin(), slowest.rend());
+  if (slowest.size() > (size_t)nSlowest)
+    slowest.resize(nSlowest);
+  if (!slowest.empty())
+    cout << endl << "  Slowest messages (us after receive):" << endl;
+  for (unsigned int i=0; i<slowest.size(); i++) {
+    const TracedEvent &event = events[slowest[i].second];
+    cout << "  at " << fixed << setprecision(3) << (event.receive - records.front().time)/1000000.0 << " ms, input "
+         << (event.port == TRACE_NO_PORT ? 0 : event.port + 1) << ", status " << hex << event.status << dec
+         << ", " << (event.branch >= 0 && event.branch < TRACE_BRANCHES ? TRACE_BRANCH_NAMES[event.branch] : "no branch") << ": pop "
+         << setprecision(1) << span(event, SPAN_QUEUE)/1000.0 << ", handle "
+         << (event.handle ? (event.handle - event.receive)/1000.0 : -1.0) << ", output "
+         << span(event, SPAN_FIRST_OUTPUT)/1000.0;
+    if (event.nOutputs > 1)
+      cout << " to " << span(event, SPAN_LAST_OUTPUT)/1000.0 << " (" << event.nOutputs << " messages)";
+    cout << endl;
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+  }
+  cout << endl;
+  return true;
+}
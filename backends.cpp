@@ -0,0 +1,521 @@
+//************** MIDIcloro **************
+//
+// Backend comparison: sends the same stream of messages through each
+// MIDI I/O path MIDIcloro could use and back into the process, and
+// measures latency, jitter and CPU time per event for each of them:
+// RtMidi over the ALSA sequencer, raw ALSA sequencer events, ALSA
+// rawmidi through snd-virmidi, and RtMidi over JACK when built with
+// JACK support. Writes a JSON report for comparing machines and setups.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-backends [-n messages] [-r messages per second] [-b backends] [-o report.json]
+//
+//***************************************
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+#include "rtmidi/RtMidi.h"
+#include "timeutil.h"
+
+using namespace std;
+
+// The messages are CCs carrying a 14 bit sequence number, so the send time of each one is known
+const int SEQUENCE_SIZE = 16384;
+// Time for the last messages to come back
+const long DRAIN_TIME = 500000000;
+
+// One way of getting MIDI out of the process and back in
+class Backend {
+ public:
+  virtual ~Backend() {}
+  virtual const char *getName() const = 0;
+  // Set up the loopback. Returns false, after saying why, when the backend isn't usable here.
+  virtual bool open() = 0;
+  virtual void send(const unsigned char *bytes, size_t nBytes) = 0;
+  // Stop receiving, after this no more messages arrive
+  virtual void close() = 0;
+};
+
+struct BackendResult {
+  string name;
+  bool available;
+  unsigned long sent;
+  unsigned long received;
+  vector<long long> latencies; // ns
+  double cpuPerEvent; // ns of process CPU time
+};
+
+long long sendTimes[SEQUENCE_SIZE];
+BackendResult *current = 0;
+long nMessages = 10000;
+int rate = 1000;
+
+// Called by the backends for every message that comes back, from their receiving thread
+void onReceive(const unsigned char *bytes, size_t nBytes) {
+  long long now = monotonicNanos();
+  if (nBytes < 3 || (bytes[0] & 0xF0) != 0xB0)
+    return;
+  int sequence = (bytes[1] << 7) | bytes[2];
+  current->latencies.push_back(now - sendTimes[sequence]);
+  current->received++;
+}
+
+// RtMidi, with a virtual input port and an output connected to it
+class RtMidiBackend : public Backend {
+ public:
+  RtMidiBackend(RtMidi::Api api, const char *name) : api(api), name(name), in(0), out(0) {}
+  ~RtMidiBackend() { close(); delete out; }
+  const char *getName() const { return name; }
+
+  bool open() {
+    // RtMidi falls back to another API when asked for one that isn't compiled in
+    vector<RtMidi::Api> apis;
+    RtMidi::getCompiledApi(apis);
+    if (find(apis.begin(), apis.end(), api) == apis.end()) {
+      cout << name << ": not built in" << endl;
+      return false;
+    }
+    try {
+      in = new RtMidiIn(api, "MIDIcloro backends in", 4096);
+      in->setCallback(&onMessage);
+      in->openVirtualPort("loop");
+      out = new RtMidiOut(api, "MIDIcloro backends out");
+      for (unsigned int i=0; i<out->getPortCount(); i++) {
+        if (out->getPortName(i).find("MIDIcloro backends in") != string::npos) {
+          out->openPort(i);
+          return true;
+        }
+      }
+      cout << name << ": loopback port not found" << endl;
+    }
+    catch (RtMidiError &error) {
+      cout << name << ": " << error.getMessage() << endl;
+    }
+    return false;
+  }
+
+  void send(const unsigned char *bytes, size_t nBytes) {
+    message.assign(bytes, bytes + nBytes);
+    out->sendMessage(&message);
+  }
+
+  void close() {
+    delete in;
+    in = 0;
+  }
+
+ private:
+  static void onMessage(double /*deltaTime*/, vector<unsigned char> *message, void * /*userData*/) {
+    if (!message->empty())
+      onReceive(&(*message)[0], message->size());
+  }
+
+  RtMidi::Api api;
+  const char *name;
+  RtMidiIn *in;
+  RtMidiOut *out;
+  vector<unsigned char> message;
+};
+
+// Sequencer events written and read directly, without RtMidi's encoding and queueing
+class AlsaSeqBackend : public Backend {
+ public:
+  AlsaSeqBackend() : seqOut(0), seqIn(0), outPort(-1), inPort(-1), running(false) {}
+  ~AlsaSeqBackend() {
+    close();
+    if (seqIn)
+      snd_seq_close(seqIn);
+    if (seqOut)
+      snd_seq_close(seqOut);
+  }
+  const char *getName() const { return "alsa-seq"; }
+
+  bool open() {
+    if (snd_seq_open(&seqOut, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0 ||
+        snd_seq_open(&seqIn, "default", SND_SEQ_OPEN_INPUT, 0) < 0) {
+      cout << "alsa-seq: couldn't open the ALSA sequencer" << endl;
+      return false;
+    }
+    snd_seq_set_client_name(seqOut, "MIDIcloro backends out");
+    snd_seq_set_client_name(seqIn, "MIDIcloro backends in");
+    outPort = snd_seq_create_simple_port(seqOut, "loop", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                         SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    inPort = snd_seq_create_simple_port(seqIn, "loop", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (outPort < 0 || inPort < 0 || snd_seq_connect_to(seqOut, outPort, snd_seq_client_id(seqIn), inPort) < 0) {
+      cout << "alsa-seq: couldn't connect the sequencer ports" << endl;
+      return false;
+    }
+    running = true;
+    if (pthread_create(&thread, 0, receiveThread, this) != 0) {
+      running = false;
+      cout << "alsa-seq: couldn't start the receive thread" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  void send(const unsigned char *bytes, size_t /*nBytes*/) {
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, outPort);
+    snd_seq_ev_set_subs(&ev);
+    snd_seq_ev_set_direct(&ev);
+    snd_seq_ev_set_controller(&ev, bytes[0] & 0x0F, bytes[1], bytes[2]);
+    snd_seq_event_output_direct(seqOut, &ev);
+  }
+
+  void close() {
+    if (!running)
+      return;
+    // Wake the receive thread with an event of its own
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    ev.type = SND_SEQ_EVENT_USR0;
+    snd_seq_ev_set_source(&ev, outPort);
+    snd_seq_ev_set_subs(&ev);
+    snd_seq_ev_set_direct(&ev);
+    snd_seq_event_output_direct(seqOut, &ev);
+    pthread_join(thread, 0);
+    running = false;
+    snd_seq_close(seqIn);
+    seqIn = 0;
+  }
+
+ private:
+  static void *receiveThread(void *backend) {
+    AlsaSeqBackend *self = (AlsaSeqBackend *)backend;
+    snd_seq_event_t *ev;
+    while (snd_seq_event_input(self->seqIn, &ev) >= 0) {
+      if (ev->type == SND_SEQ_EVENT_USR0)
+        break;
+      if (ev->type == SND_SEQ_EVENT_CONTROLLER) {
+        unsigned char bytes[3] = {(unsigned char)(0xB0 | ev->data.control.channel),
+                                  (unsigned char)ev->data.control.param, (unsigned char)ev->data.control.value};
+        onReceive(bytes, sizeof(bytes));
+      }
+    }
+    return 0;
+  }
+
+  snd_seq_t *seqOut;
+  snd_seq_t *seqIn;
+  int outPort;
+  int inPort;
+  bool running;
+  pthread_t thread;
+};
+
+// Raw MIDI bytes through two snd-virmidi devices, their sequencer ports connected to each other
+class RawMidiBackend : public Backend {
+ public:
+  RawMidiBackend() : out(0), in(0), seq(0), running(false) {}
+  ~RawMidiBackend() {
+    close();
+    if (out)
+      snd_rawmidi_close(out);
+    if (seq)
+      snd_seq_close(seq);
+  }
+  const char *getName() const { return "rawmidi-virmidi"; }
+
+  bool open() {
+    int card = findVirmidiCard();
+    if (card < 0) {
+      cout << "rawmidi-virmidi: no snd-virmidi card, load it with: modprobe snd-virmidi" << endl;
+      return false;
+    }
+    ostringstream outName, inName;
+    outName << "hw:" << card << ",0";
+    inName << "hw:" << card << ",1";
+    if (snd_rawmidi_open(0, &out, outName.str().c_str(), 0) < 0 ||
+        snd_rawmidi_open(&in, 0, inName.str().c_str(), SND_RAWMIDI_NONBLOCK) < 0) {
+      cout << "rawmidi-virmidi: couldn't open " << outName.str() << " and " << inName.str() << endl;
+      return false;
+    }
+
+    // What's written to the first device comes out of its sequencer port, route it to the second one
+    snd_seq_addr_t sender, dest;
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0 ||
+        !findVirmidiPort(card, 0, &sender) || !findVirmidiPort(card, 1, &dest)) {
+      cout << "rawmidi-virmidi: couldn't find the virmidi sequencer ports" << endl;
+      return false;
+    }
+    snd_seq_port_subscribe_t *subscription;
+    snd_seq_port_subscribe_alloca(&subscription);
+    snd_seq_port_subscribe_set_sender(subscription, &sender);
+    snd_seq_port_subscribe_set_dest(subscription, &dest);
+    if (snd_seq_subscribe_port(seq, subscription) < 0) {
+      cout << "rawmidi-virmidi: couldn't connect the virmidi ports" << endl;
+      return false;
+    }
+
+    running = true;
+    if (pthread_create(&thread, 0, receiveThread, this) != 0) {
+      running = false;
+      cout << "rawmidi-virmidi: couldn't start the receive thread" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  void send(const unsigned char *bytes, size_t nBytes) {
+    snd_rawmidi_write(out, bytes, nBytes);
+  }
+
+  void close() {
+    if (!running)
+      return;
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+    snd_rawmidi_close(in);
+    in = 0;
+  }
+
+ private:
+  static int findVirmidiCard() {
+    int card = -1;
+    snd_ctl_card_info_t *info;
+    snd_ctl_card_info_alloca(&info);
+    while (snd_card_next(&card) >= 0 && card >= 0) {
+      snd_ctl_t *ctl;
+      ostringstream name;
+      name << "hw:" << card;
+      if (snd_ctl_open(&ctl, name.str().c_str(), 0) < 0)
+        continue;
+      bool found = snd_ctl_card_info(ctl, info) >= 0 && string(snd_ctl_card_info_get_driver(info)) == "VirMIDI";
+      snd_ctl_close(ctl);
+      if (found)
+        return card;
+    }
+    return -1;
+  }
+
+  // The kernel names the virmidi clients "Virtual Raw MIDI card-device"
+  bool findVirmidiPort(int card, int device, snd_seq_addr_t *addr) {
+    ostringstream name;
+    name << "Virtual Raw MIDI " << card << "-" << device;
+    snd_seq_client_info_t *info;
+    snd_seq_client_info_alloca(&info);
+    snd_seq_client_info_set_client(info, -1);
+    while (snd_seq_query_next_client(seq, info) >= 0) {
+      if (name.str() == snd_seq_client_info_get_name(info)) {
+        addr->client = snd_seq_client_info_get_client(info);
+        addr->port = 0;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void *receiveThread(void *backend) {
+    RawMidiBackend *self = (RawMidiBackend *)backend;
+    struct pollfd fds[4];
+    int nFds = snd_rawmidi_poll_descriptors(self->in, fds, 4);
+    unsigned char buffer[256];
+    unsigned char message[3];
+    int length = 0;
+    while (__atomic_load_n(&self->running, __ATOMIC_ACQUIRE)) {
+      if (poll(fds, nFds, 100) <= 0)
+        continue;
+      ssize_t n = snd_rawmidi_read(self->in, buffer, sizeof(buffer));
+      // Only the three byte CCs that are sent are parsed, with running status
+      for (ssize_t i=0; i<n; i++) {
+        if (buffer[i] & 0x80) {
+          message[0] = buffer[i];
+          length = 1;
+        }
+        else if (length > 0) {
+          message[length++] = buffer[i];
+          if (length == 3) {
+            onReceive(message, 3);
+            length = 1;
+          }
+        }
+      }
+    }
+    return 0;
+  }
+
+  snd_rawmidi_t *out;
+  snd_rawmidi_t *in;
+  snd_seq_t *seq;
+  bool running;
+  pthread_t thread;
+};
+
+void usage(void);
+vector<Backend *> makeBackends(const string &list);
+void runBackend(Backend *backend, BackendResult *result);
+void printResult(const BackendResult &result);
+void writeReport(const string &path, const vector<BackendResult> &results);
+
+int main(int argc, char *argv[]) {
+  string backendList = "rtmidi-alsa,alsa-seq,rawmidi-virmidi,rtmidi-jack";
+  string reportFile;
+  for (int i=1; i<argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i+1 < argc)
+      nMessages = atol(argv[++i]);
+    else if (arg == "-r" && i+1 < argc)
+      rate = atoi(argv[++i]);
+    else if (arg == "-b" && i+1 < argc)
+      backendList = argv[++i];
+    else if (arg == "-o" && i+1 < argc)
+      reportFile = argv[++i];
+    else
+      usage();
+  }
+  if (nMessages < 1 || rate < 1)
+    usage();
+
+  vector<Backend *> backends = makeBackends(backendList);
+  vector<BackendResult> results(backends.size());
+  cout << left << setw(18) << "backend" << right << setw(10) << "received" << setw(10) << "p50 us"
+       << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(10) << "max us" << setw(12) << "jitter us"
+       << setw(12) << "cpu us/ev" << endl;
+  for (unsigned int i=0; i<backends.size(); i++) {
+    runBackend(backends[i], &results[i]);
+    printResult(results[i]);
+    delete backends[i];
+  }
+  if (!reportFile.empty())
+    writeReport(reportFile, results);
+  return 0;
+}
+
+void usage(void) {
+  cout << "Usage: ./midicloro-backends [-n messages] [-r messages per second] [-b backends] [-o report.json]" << endl;
+  cout << "Backends: comma separated list of rtmidi-alsa, alsa-seq, rawmidi-virmidi and rtmidi-jack (default all)" << endl;
+  exit(0);
+}
+
+vector<Backend *> makeBackends(const string &list) {
+  vector<Backend *> backends;
+  stringstream stream(list);
+  string name;
+  while (getline(stream, name, ',')) {
+    if (name == "rtmidi-alsa")
+      backends.push_back(new RtMidiBackend(RtMidi::LINUX_ALSA, "rtmidi-alsa"));
+    else if (name == "alsa-seq")
+      backends.push_back(new AlsaSeqBackend());
+    else if (name == "rawmidi-virmidi")
+      backends.push_back(new RawMidiBackend());
+    else if (name == "rtmidi-jack")
+      backends.push_back(new RtMidiBackend(RtMidi::UNIX_JACK, "rtmidi-jack"));
+    else
+      usage();
+  }
+  return backends;
+}
+
+void runBackend(Backend *backend, BackendResult *result) {
+  result->name = backend->getName();
+  result->available = false;
+  result->sent = result->received = 0;
+  result->cpuPerEvent = 0;
+  if (!backend->open()) {
+    backend->close();
+    return;
+  }
+  result->available = true;
+  result->latencies.reserve(nMessages);
+  current = result;
+
+  struct timespec cpuStart, cpuEnd;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuStart);
+  long long period = 1000000000LL/rate;
+  long long start = monotonicNanos();
+  unsigned char message[3];
+  for (long i=0; i<nMessages; i++) {
+    long long dueTime = start + i*period;
+    struct timespec due = {(time_t)(dueTime/1000000000LL), (long)(dueTime%1000000000LL)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0);
+    int sequence = i % SEQUENCE_SIZE;
+    message[0] = 0xB0;
+    message[1] = sequence >> 7;
+    message[2] = sequence & 0x7F;
+    sendTimes[sequence] = monotonicNanos();
+    backend->send(message, sizeof(message));
+    result->sent++;
+  }
+  struct timespec drain = {0, DRAIN_TIME};
+  nanosleep(&drain, 0);
+  backend->close();
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuEnd);
+  current = 0;
+  result->cpuPerEvent = (double)(toNanos(cpuEnd) - toNanos(cpuStart))/max(result->sent, 1UL);
+  sort(result->latencies.begin(), result->latencies.end());
+}
+
+long long percentile(const vector<long long> &sorted, double fraction) {
+  if (sorted.empty())
+    return 0;
+  return sorted[min((size_t)(fraction*sorted.size()), sorted.size() - 1)];
+}
+
+// Standard deviation of the latency
+double jitter(const vector<long long> &values) {
+  if (values.empty())
+    return 0;
+  double sum = 0, sumSquares = 0;
+  for (unsigned int i=0; i<values.size(); i++) {
+    sum += values[i];
+    sumSquares += (double)values[i]*values[i];
+  }
+  double mean = sum/values.size();
+  return sqrt(max(sumSquares/values.size() - mean*mean, 0.0));
+}
+
+void printResult(const BackendResult &result) {
+  cout << left << setw(18) << result.name << right;
+  if (!result.available) {
+    cout << "  not available" << endl;
+    return;
+  }
+  const vector<long long> &l = result.latencies;
+  cout << setw(10) << result.received << fixed << setprecision(1)
+       << setw(10) << percentile(l, 0.5)/1000.0 << setw(10) << percentile(l, 0.99)/1000.0
+       << setw(10) << percentile(l, 0.999)/1000.0 << setw(10) << (l.empty() ? 0 : l.back())/1000.0
+       << setw(12) << jitter(l)/1000.0 << setw(12) << result.cpuPerEvent/1000.0 << endl;
+  cout.unsetf(ios::floatfield);
+}
+
+void writeReport(const string &path, const vector<BackendResult> &results) {
+  ofstream file(path.c_str());
+  file << "{" << endl;
+  file << "  \"messages\": " << nMessages << "," << endl;
+  file << "  \"rate\": " << rate << "," << endl;
+  file << "  \"backends\": [" << endl;
+  for (unsigned int i=0; i<results.size(); i++) {
+    const BackendResult &r = results[i];
+    const vector<long long> &l = r.latencies;
+    file << "    {\"name\": \"" << r.name << "\", \"available\": " << (r.available ? "true" : "false");
+    if (r.available) {
+      file << ", \"sent\": " << r.sent << ", \"received\": " << r.received
+           << ", \"latency_ns\": {\"min\": " << (l.empty() ? 0 : l.front()) << ", \"p50\": " << percentile(l, 0.5)
+           << ", \"p99\": " << percentile(l, 0.99) << ", \"p999\": " << percentile(l, 0.999)
+           << ", \"max\": " << (l.empty() ? 0 : l.back()) << "}"
+           << ", \"jitter_ns\": " << (long long)jitter(l)
+           << ", \"cpu_ns_per_event\": " << (long long)r.cpuPerEvent;
+    }
+    file << "}" << (i+1 < results.size() ? "," : "") << endl;
+  }
+  file << "  ]" << endl;
+  file << "}" << endl;
+  if (!file)
+    cerr << "Couldn't write report: " << path << endl;
+}
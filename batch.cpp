@@ -0,0 +1,205 @@
+//************** MIDIcloro **************
+//
+// Batch processing: runs MIDI files through the MIDIcloro engine with
+// the settings in midicloro.cfg, as fast as possible and spread over
+// all cores, without any MIDI device. Writes the transformed files and
+// reports the engine throughput.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-batch [-j threads] [-o output directory] [-i input 1-4] [-r repeats] file.mid ...
+//
+//***************************************
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+#include <boost/program_options.hpp>
+#include "engine.h"
+#include "smf.h"
+#include "timeutil.h"
+
+using namespace std;
+
+namespace po = boost::program_options;
+
+// Time follows the file, so tap-tempo works on the tapped CCs in it
+class FileTime : public MidiTime {
+ public:
+  FileTime() : time(0) {}
+  long long now() { return time; }
+  long long time;
+};
+
+// Collects the engine output at the tick of the event being handled
+class FileSink : public MidiSink {
+ public:
+  FileSink(SmfWriter *writer) : writer(writer), track(0), tick(0), nEvents(0) {}
+  void send(vector<unsigned char> *message) {
+    nEvents++;
+    if (writer)
+      writer->addMessage(track, tick, &(*message)[0], message->size());
+  }
+  SmfWriter *writer;
+  int track;
+  unsigned long tick;
+  unsigned long nEvents;
+};
+
+struct FileResult {
+  bool ok;
+  unsigned long eventsIn;
+  unsigned long eventsOut;
+  long long time; // ns spent on the file
+};
+
+EngineConfig engineConfig;
+int source = 0;
+int repeats = 1;
+string outputDir;
+vector<string> files;
+vector<FileResult> results;
+unsigned int nextFile = 0;
+
+void usage(void);
+void *worker(void *);
+FileResult processFile(const string &path);
+
+int main(int argc, char *argv[]) {
+  int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i=1; i<argc; i++) {
+    string arg = argv[i];
+    if (arg == "-j" && i+1 < argc)
+      nThreads = atoi(argv[++i]);
+    else if (arg == "-o" && i+1 < argc)
+      outputDir = argv[++i];
+    else if (arg == "-i" && i+1 < argc)
+      source = atoi(argv[++i]) - 1;
+    else if (arg == "-r" && i+1 < argc)
+      repeats = atoi(argv[++i]);
+    else if (arg[0] == '-')
+      usage();
+    else
+      files.push_back(arg);
+  }
+  if (files.empty() || nThreads < 1 || source < 0 || source > 3 || repeats < 1)
+    usage();
+
+  // Same settings as the live engine, other settings in the file are skipped
+  try {
+    po::options_description desc("Options");
+    addEngineOptions(&desc, &engineConfig);
+    po::variables_map vm;
+    ifstream file("midicloro.cfg");
+    po::store(po::parse_config_file(file, desc, true), vm);
+    po::notify(vm);
+  }
+  catch (exception& e) {
+    cout << "Error occurred while reading configuration: " << e.what() << endl;
+    return 1;
+  }
+
+  results.resize(files.size());
+  nThreads = min(nThreads, (int)files.size());
+  vector<pthread_t> threads(nThreads);
+  long long start = monotonicNanos();
+  for (int i=0; i<nThreads; i++) {
+    if (pthread_create(&threads[i], 0, worker, 0) != 0) {
+      cerr << "Couldn't start worker thread" << endl;
+      return 1;
+    }
+  }
+  for (int i=0; i<nThreads; i++)
+    pthread_join(threads[i], 0);
+  long long elapsed = max(monotonicNanos() - start, 1LL);
+
+  unsigned long eventsIn = 0, eventsOut = 0;
+  int failed = 0;
+  for (unsigned int i=0; i<files.size(); i++) {
+    if (!results[i].ok) {
+      failed++;
+      continue;
+    }
+    cout << files[i] << ": " << results[i].eventsIn << " events in, " << results[i].eventsOut << " out, "
+         << results[i].time/1000000.0 << " ms" << endl;
+    eventsIn += results[i].eventsIn*repeats;
+    eventsOut += results[i].eventsOut*repeats;
+  }
+  cout << "Processed " << files.size() - failed << " files (" << failed << " failed) with " << nThreads
+       << " threads in " << elapsed/1000000.0 << " ms" << endl;
+  cout << "Engine throughput: " << (long long)(eventsIn*1000000000.0/elapsed) << " events/s in, "
+       << (long long)(eventsOut*1000000000.0/elapsed) << " events/s out" << endl;
+  return failed > 0 ? 1 : 0;
+}
+
+void usage(void) {
+  cout << "Usage: ./midicloro-batch [-j threads] [-o output directory] [-i input 1-4] [-r repeats] file.mid ..." << endl;
+  exit(0);
+}
+
+void *worker(void *) {
+  while (true) {
+    unsigned int i = __atomic_fetch_add(&nextFile, 1, __ATOMIC_RELAXED);
+    if (i >= files.size())
+      break;
+    results[i] = processFile(files[i]);
+  }
+  return 0;
+}
+
+FileResult processFile(const string &path) {
+  FileResult result = {false, 0, 0, 0};
+  SmfReader reader;
+  if (!reader.open(path))
+    return result;
+  long long start = monotonicNanos();
+
+  SmfWriter writer(reader.getDivision());
+  SmfEvent event;
+  vector<unsigned char> message;
+  for (int r=0; r<repeats; r++) {
+    // Only the first pass is written, the others are for timing
+    FileSink sink(r == 0 && !outputDir.empty() ? &writer : 0);
+    FileTime time;
+    MidiEngine engine(engineConfig, &sink, &time);
+    double nsPerTick = 500000000.0/reader.getDivision();
+    unsigned long lastTick = 0;
+    result.eventsIn = 0;
+    reader.rewind();
+    while (reader.next(&event)) {
+      time.time += (long long)((event.tick - lastTick)*nsPerTick);
+      lastTick = event.tick;
+      sink.track = event.track;
+      sink.tick = event.tick;
+      if (event.isMeta) {
+        // Tempo changes move the file time, the other meta events are kept as they are
+        if (event.metaType == 0x51 && event.bytes.size() == 3)
+          nsPerTick = ((event.bytes[0] << 16) | (event.bytes[1] << 8) | event.bytes[2])*1000.0/reader.getDivision();
+        if (sink.writer)
+          writer.addMeta(event.track, event.tick, event.metaType, event.bytes.empty() ? 0 : &event.bytes[0], event.bytes.size());
+        continue;
+      }
+      if (event.bytes.empty())
+        continue;
+      message.assign(event.bytes.begin(), event.bytes.end());
+      engine.handleMessage(&message, source);
+      result.eventsIn++;
+    }
+    result.eventsOut = sink.nEvents;
+  }
+  result.time = monotonicNanos() - start;
+
+  if (!outputDir.empty()) {
+    string name = path.substr(path.find_last_of('/') + 1);
+    if (!writer.save(outputDir + "/" + name))
+      return result;
+  }
+  result.ok = true;
+  return result;
+}
@@ -0,0 +1,399 @@
+//************** MIDIcloro **************
+//
+// Microbenchmarks: times the MIDIcloro engine per message class and
+// chord mode, alone and in the full input -> engine -> output path
+// over RtMidi's in-memory ports, and counts the memory allocations
+// per event. Results can be saved and later runs compared against
+// them to catch regressions.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-bench [-n events] [-r runs] [-o results file] [-b baseline file] [-t tolerance %]
+//
+//***************************************
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "rtmidi/RtMidi.h"
+#include "engine.h"
+#include "timeutil.h"
+
+using namespace std;
+
+// Every allocation in the process goes through here, the benchmark is single-threaded
+unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *p) throw() {
+  free(p);
+}
+
+void operator delete[](void *p) throw() {
+  free(p);
+}
+
+void operator delete(void *p, size_t) throw() {
+  free(p);
+}
+
+void operator delete[](void *p, size_t) throw() {
+  free(p);
+}
+
+// Time moves on by a fixed step for every event, so tap-tempo sees steady taps
+class BenchTime : public MidiTime {
+ public:
+  BenchTime(long long step) : time(0), step(step) {}
+  long long now() { return time; }
+  void advance() { time += step; }
+ private:
+  long long time;
+  long long step;
+};
+
+// Sends the engine output to a port, or only counts it
+class BenchSink : public MidiSink {
+ public:
+  BenchSink(RtMidiOut *out) : out(out), nEvents(0) {}
+  void send(vector<unsigned char> *message) {
+    nEvents++;
+    if (out)
+      out->sendMessage(message);
+  }
+  RtMidiOut *out;
+  unsigned long nEvents;
+};
+
+struct BenchCase {
+  string name;
+  bool mono;
+  long long timeStep;
+  vector<vector<unsigned char> > setup; // Sent once before timing
+  vector<vector<unsigned char> > pattern; // Sent over and over
+};
+
+struct BenchResult {
+  double engineNs;
+  double engineAllocs;
+  double pipelineNs;
+  double pipelineAllocs;
+  double eventsOut;
+};
+
+// Messages for both paths are taken from the input in batches like the main loop does
+const unsigned int BATCH_SIZE = 64;
+// Room for a batch of output in chord mode, up to 5 notes per message
+const unsigned int QUEUE_SIZE = 1024;
+
+EngineConfig engineConfig;
+unsigned long nEvents = 200000;
+int nRuns = 5;
+
+void usage(void);
+vector<unsigned char> makeMessage(int b0, int b1, int b2);
+vector<BenchCase> makeCases();
+BenchResult runCase(const BenchCase &benchCase);
+void runEngine(const BenchCase &benchCase, double *ns, double *allocs, double *eventsOut);
+void runPipeline(const BenchCase &benchCase, double *ns, double *allocs);
+bool readResults(const string &path, map<string, BenchResult> *results);
+
+int main(int argc, char *argv[]) {
+  string outputFile, baselineFile;
+  double tolerance = 20;
+  for (int i=1; i<argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i+1 < argc)
+      nEvents = atol(argv[++i]);
+    else if (arg == "-r" && i+1 < argc)
+      nRuns = atoi(argv[++i]);
+    else if (arg == "-o" && i+1 < argc)
+      outputFile = argv[++i];
+    else if (arg == "-b" && i+1 < argc)
+      baselineFile = argv[++i];
+    else if (arg == "-t" && i+1 < argc)
+      tolerance = atof(argv[++i]);
+    else
+      usage();
+  }
+  if (nEvents < BATCH_SIZE || nRuns < 1)
+    usage();
+  // Whole batches, so each pass leaves the queues empty
+  nEvents -= nEvents % BATCH_SIZE;
+
+  map<string, BenchResult> baseline;
+  if (!baselineFile.empty() && !readResults(baselineFile, &baseline)) {
+    cerr << "Couldn't read baseline: " << baselineFile << endl;
+    return 1;
+  }
+
+  // Fixed settings so runs on different machines and configs compare
+  engineConfig.velocityMultiDeviceCtrl = false;
+  engineConfig.randomSeed = 1;
+
+  vector<BenchCase> cases = makeCases();
+  ostringstream results;
+  int regressions = 0;
+  cout << left << setw(18) << "case" << right << setw(12) << "engine ns" << setw(10) << "allocs"
+       << setw(12) << "path ns" << setw(10) << "allocs" << setw(8) << "out" << endl;
+  for (unsigned int i=0; i<cases.size(); i++) {
+    BenchResult result;
+    try {
+      result = runCase(cases[i]);
+    }
+    catch (RtMidiError &error) {
+      error.printMessage();
+      return 1;
+    }
+    cout << left << setw(18) << cases[i].name << right << fixed
+         << setprecision(1) << setw(12) << result.engineNs << setprecision(3) << setw(10) << result.engineAllocs
+         << setprecision(1) << setw(12) << result.pipelineNs << setprecision(3) << setw(10) << result.pipelineAllocs
+         << setprecision(2) << setw(8) << result.eventsOut;
+    results << cases[i].name << " " << result.engineNs << " " << result.engineAllocs << " "
+            << result.pipelineNs << " " << result.pipelineAllocs << " " << result.eventsOut << endl;
+
+    // Any new allocation is a regression, time only beyond the tolerance
+    map<string, BenchResult>::iterator base = baseline.find(cases[i].name);
+    if (base != baseline.end()) {
+      const BenchResult &b = base->second;
+      bool slower = result.engineNs > b.engineNs*(1 + tolerance/100) || result.pipelineNs > b.pipelineNs*(1 + tolerance/100);
+      bool allocating = result.engineAllocs > b.engineAllocs + 0.001 || result.pipelineAllocs > b.pipelineAllocs + 0.001;
+      if (slower || allocating) {
+        cout << "  REGRESSION" << (slower ? " (time)" : "") << (allocating ? " (allocations)" : "");
+        regressions++;
+      }
+    }
+    cout << endl;
+  }
+
+  if (!outputFile.empty()) {
+    ofstream file(outputFile.c_str());
+    file << results.str();
+    if (!file) {
+      cerr << "Couldn't write results: " << outputFile << endl;
+      return 1;
+    }
+  }
+  if (!baseline.empty())
+    cout << regressions << " regressions against " << baselineFile << endl;
+  return regressions > 0 ? 1 : 0;
+}
+
+void usage(void) {
+  cout << "Usage: ./midicloro-bench [-n events] [-r runs] [-o results file] [-b baseline file] [-t tolerance %]" << endl;
+  exit(0);
+}
+
+vector<unsigned char> makeMessage(int b0, int b1, int b2) {
+  vector<unsigned char> message;
+  message.push_back(b0);
+  if (b1 >= 0)
+    message.push_back(b1);
+  if (b2 >= 0)
+    message.push_back(b2);
+  return message;
+}
+
+vector<BenchCase> makeCases() {
+  // An octave of note on/off pairs on channel 1
+  vector<vector<unsigned char> > notes;
+  for (int i=0; i<12; i++) {
+    notes.push_back(makeMessage(0x90, 60+i, 100));
+    notes.push_back(makeMessage(0x80, 60+i, 0));
+  }
+  vector<BenchCase> cases;
+  BenchCase c;
+  c.mono = false;
+  c.timeStep = 1000000;
+
+  // Chord mode 0 plays single notes
+  for (int mode=0; mode<16; mode++) {
+    ostringstream name;
+    name << "chord-" << mode;
+    c.name = name.str();
+    c.setup.assign(1, makeMessage(0xB0, engineConfig.chordMidiCC, mode*8));
+    c.pattern = notes;
+    cases.push_back(c);
+  }
+  c.setup.clear();
+
+  c.name = "velocity-fixed";
+  c.setup.assign(1, makeMessage(0xB0, engineConfig.velocityMidiCC, 100));
+  c.pattern = notes;
+  cases.push_back(c);
+  c.name = "velocity-random";
+  c.setup.assign(1, makeMessage(0xB0, engineConfig.velocityMidiCC, 127));
+  cases.push_back(c);
+  c.setup.clear();
+
+  c.name = "mono";
+  c.mono = true;
+  cases.push_back(c);
+  c.mono = false;
+
+  c.name = "tap-tempo";
+  c.timeStep = 500000000;
+  c.pattern.assign(1, makeMessage(0xB0, engineConfig.tempoMidiCC, 64));
+  cases.push_back(c);
+  c.timeStep = 1000000;
+
+  c.name = "route-cc";
+  c.pattern.clear();
+  for (int i=0; i<16; i++)
+    c.pattern.push_back(makeMessage(0xB0 + i, engineConfig.routeMidiCC, i));
+  cases.push_back(c);
+
+  c.name = "control-cc";
+  c.pattern.clear();
+  for (int i=0; i<128; i++)
+    c.pattern.push_back(makeMessage(0xB0, 1, i));
+  cases.push_back(c);
+
+  c.name = "pitch-bend";
+  c.pattern.clear();
+  for (int i=0; i<128; i++)
+    c.pattern.push_back(makeMessage(0xE0, 0, i));
+  cases.push_back(c);
+
+  c.name = "sysex";
+  vector<unsigned char> sysex(32, 0x42);
+  sysex.front() = 0xF0;
+  sysex.back() = 0xF7;
+  c.pattern.assign(1, sysex);
+  cases.push_back(c);
+  return cases;
+}
+
+BenchResult runCase(const BenchCase &benchCase) {
+  // Best of the runs, the others were disturbed by something else
+  BenchResult result = {0, 0, 0, 0, 0};
+  for (int r=0; r<nRuns; r++) {
+    double engineNs, engineAllocs, eventsOut, pipelineNs, pipelineAllocs;
+    runEngine(benchCase, &engineNs, &engineAllocs, &eventsOut);
+    runPipeline(benchCase, &pipelineNs, &pipelineAllocs);
+    if (r == 0 || engineNs < result.engineNs)
+      result.engineNs = engineNs;
+    if (r == 0 || pipelineNs < result.pipelineNs)
+      result.pipelineNs = pipelineNs;
+    result.engineAllocs = max(result.engineAllocs, engineAllocs);
+    result.pipelineAllocs = max(result.pipelineAllocs, pipelineAllocs);
+    result.eventsOut = eventsOut;
+  }
+  return result;
+}
+
+// The engine alone, messages copied in from the pattern
+void runEngine(const BenchCase &benchCase, double *ns, double *allocs, double *eventsOut) {
+  EngineConfig config = engineConfig;
+  config.mono[0] = benchCase.mono;
+  BenchSink sink(0);
+  BenchTime time(benchCase.timeStep);
+  MidiEngine engine(config, &sink, &time);
+  vector<unsigned char> message;
+  for (unsigned int i=0; i<benchCase.setup.size(); i++) {
+    message = benchCase.setup[i];
+    engine.handleMessage(&message, 0);
+  }
+
+  // The first pass warms up caches and grows the buffers
+  for (int pass=0; pass<2; pass++) {
+    unsigned long startAllocs = allocations;
+    unsigned long startEvents = sink.nEvents;
+    long long start = monotonicNanos();
+    for (unsigned long i=0; i<nEvents; i++) {
+      const vector<unsigned char> &source = benchCase.pattern[i % benchCase.pattern.size()];
+      message.assign(source.begin(), source.end());
+      time.advance();
+      engine.handleMessage(&message, 0);
+    }
+    long long elapsed = monotonicNanos() - start;
+    *ns = (double)elapsed/nEvents;
+    *allocs = (double)(allocations - startAllocs)/nEvents;
+    *eventsOut = (double)(sink.nEvents - startEvents)/nEvents;
+  }
+}
+
+// The full path: injected into an input port, polled, run through the
+// engine, sent to an output port and drained from a capturing input
+void runPipeline(const BenchCase &benchCase, double *ns, double *allocs) {
+  RtMidiIn input(RtMidi::RTMIDI_DUMMY, "MIDIcloro bench", QUEUE_SIZE);
+  input.ignoreTypes(false, false, false);
+  input.openVirtualPort("midicloro in");
+  RtMidiOut injector(RtMidi::RTMIDI_DUMMY, "MIDIcloro bench");
+  injector.openPort(injector.getPortCount() - 1);
+
+  RtMidiIn capture(RtMidi::RTMIDI_DUMMY, "MIDIcloro bench", QUEUE_SIZE);
+  capture.ignoreTypes(false, false, false);
+  capture.openVirtualPort("capture");
+  RtMidiOut output(RtMidi::RTMIDI_DUMMY, "MIDIcloro bench");
+  output.openPort(output.getPortCount() - 1);
+
+  EngineConfig config = engineConfig;
+  config.mono[0] = benchCase.mono;
+  BenchSink sink(&output);
+  BenchTime time(benchCase.timeStep);
+  MidiEngine engine(config, &sink, &time);
+  vector<unsigned char> message;
+  for (unsigned int i=0; i<benchCase.setup.size(); i++) {
+    message = benchCase.setup[i];
+    engine.handleMessage(&message, 0);
+  }
+
+  vector<RtMidiMessage> messages;
+  vector<RtMidiMessage> captured;
+  capture.getMessages(&captured);
+  unsigned long nSent = sink.nEvents;
+  unsigned long nCaptured = 0;
+  for (int pass=0; pass<2; pass++) {
+    unsigned long startAllocs = allocations;
+    long long start = monotonicNanos();
+    for (unsigned long i=0; i<nEvents; i++) {
+      const vector<unsigned char> &source = benchCase.pattern[i % benchCase.pattern.size()];
+      message.assign(source.begin(), source.end());
+      injector.sendMessage(&message);
+      if ((i+1) % BATCH_SIZE != 0)
+        continue;
+      unsigned int nMessages = input.getMessages(&messages);
+      for (unsigned int j=0; j<nMessages; j++) {
+        time.advance();
+        engine.handleMessage(&messages[j].bytes, 0);
+      }
+      nCaptured += capture.getMessages(&captured);
+    }
+    long long elapsed = monotonicNanos() - start;
+    *ns = (double)elapsed/nEvents;
+    *allocs = (double)(allocations - startAllocs)/nEvents;
+  }
+  if (nCaptured != sink.nEvents - nSent)
+    cerr << benchCase.name << ": captured " << nCaptured << " of " << sink.nEvents - nSent << " messages" << endl;
+}
+
+bool readResults(const string &path, map<string, BenchResult> *results) {
+  ifstream file(path.c_str());
+  if (!file)
+    return false;
+  string name;
+  BenchResult result;
+  while (file >> name >> result.engineNs >> result.engineAllocs >> result.pipelineNs >> result.pipelineAllocs >> result.eventsOut)
+    (*results)[name] = result;
+  return !results->empty();
+}
@@ -0,0 +1,204 @@
+//************** MIDIcloro **************
+//
+// Clock generator
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <algorithm>
+#include "clock.h"
+
+using namespace std;
+
+ClockGenerator::ClockGenerator()
+  : lastSubTick(0), lastTime(0), nextSubTick(0), restarted(true),
+    glideFrom(0), glideTo(0), glideStart(0), glideLength(0), glideTicks(0) {
+  for (int o=0; o<MAX_OUTPUTS; o++)
+    ppqn[o] = 24;
+}
+
+bool ClockGenerator::setPpqn(int output, int pulses) {
+  if (output < 0 || output >= MAX_OUTPUTS || pulses < 0 || pulses > SUB_TICKS_PER_QUARTER ||
+      (pulses > 0 && SUB_TICKS_PER_QUARTER % pulses != 0))
+    return false;
+  ppqn[output] = pulses;
+  return true;
+}
+
+void ClockGenerator::restart(long long time) {
+  lastSubTick = 0;
+  nextSubTick = 0;
+  lastTime = time;
+  restarted = true;
+  // The new grid starts at the tempo the glide was heading for
+  glideFrom = glideTo;
+  glideStart = 0;
+  glideLength = 0;
+}
+
+long long ClockGenerator::nextDue() const {
+  return lastTime + (nextSubTick - lastSubTick)*intervalAt(lastSubTick)/SUB_TICKS_PER_CLOCK;
+}
+
+bool ClockGenerator::due(long long now, long long clockInterval, ClockBatch *batch) {
+  if (clockInterval != glideTo) {
+    // From the tempo the grid is at, whether or not an earlier glide had ended
+    glideFrom = glideTo != 0 ? intervalAt(lastSubTick) : clockInterval;
+    glideTo = clockInterval;
+    glideStart = lastSubTick;
+    glideLength = glideTicks;
+  }
+  long long deadline = nextDue();
+  if (now < deadline)
+    return false;
+  batch->subTick = nextSubTick;
+  batch->time = deadline;
+  batch->period = restarted ? 0 : deadline - lastTime;
+  batch->outputs = outputsAt(nextSubTick);
+  batch->masterTick = nextSubTick % SUB_TICKS_PER_CLOCK == 0;
+  // A batch more than a clock interval late starts the grid again from now, the
+  // devices following the clock would rather slip once than get a burst of ticks
+  lastTime = now - deadline > intervalAt(lastSubTick) ? now : deadline;
+  lastSubTick = nextSubTick;
+  nextSubTick = following(nextSubTick);
+  restarted = false;
+  return true;
+}
+
+long long ClockGenerator::following(long long subTick) const {
+  // The 24 PPQN ticks are always there, for the MIDI file player, the looper and the recording
+  long long next = (subTick/SUB_TICKS_PER_CLOCK + 1)*SUB_TICKS_PER_CLOCK;
+  for (int o=0; o<MAX_OUTPUTS; o++) {
+    if (ppqn[o] == 0)
+      continue;
+    int step = SUB_TICKS_PER_QUARTER/ppqn[o];
+    long long candidate = (subTick/step + 1)*step;
+    if (candidate < next)
+      next = candidate;
+  }
+  return next;
+}
+
+long long ClockGenerator::intervalAt(long long subTick) const {
+  if (glideLength == 0 || subTick >= glideStart + glideLength)
+    return glideTo;
+  return glideFrom + (glideTo - glideFrom)*(subTick - glideStart)/glideLength;
+}
+
+unsigned int ClockGenerator::outputsAt(long long subTick) const {
+  unsigned int outputs = 0;
+  for (int o=0; o<MAX_OUTPUTS; o++)
+    if (ppqn[o] != 0 && subTick % (SUB_TICKS_PER_QUARTER/ppqn[o]) == 0)
+      outputs |= 1 << o;
+  return outputs;
+}
+
+int SongPosition::getSixteenths() const {
+  return (int)min(__atomic_load_n(&clocks, __ATOMIC_RELAXED)/6, 0x3FFFLL);
+}
+
+void SongPosition::getBarBeatSixteenth(int *bar, int *beat, int *sixteenth) const {
+  long long sixteenths = __atomic_load_n(&clocks, __ATOMIC_RELAXED)/6;
+  *bar = (int)(sixteenths/16) + 1;
+  *beat = (int)(sixteenths/4%4) + 1;
+  *sixteenth = (int)(sixteenths%4) + 1;
+}
+
+void SongPosition::songPositionMessage(vector<unsigned char> *message) const {
+  int sixteenths = getSixteenths();
+  message->resize(3);
+  (*message)[0] = 0xF2;
+  (*message)[1] = sixteenths & 0x7F;
+  (*message)[2] = (sixteenths >> 7) & 0x7F;
+}
+
+TimecodeGenerator::TimecodeGenerator()
+  : rate(FPS_25), framesPerSecond(25), rateNum(25), rateDen(1), running(false),
+    quarterFrame(0), anchorQuarterFrame(0), anchorTime(0) {
+  prepareCycle();
+}
+
+bool TimecodeGenerator::setRate(const string &name) {
+  if (name == "24") { rate = FPS_24; framesPerSecond = 24; rateNum = 24; rateDen = 1; }
+  else if (name == "25") { rate = FPS_25; framesPerSecond = 25; rateNum = 25; rateDen = 1; }
+  else if (name == "29.97") { rate = FPS_29_97_DROP; framesPerSecond = 30; rateNum = 30000; rateDen = 1001; }
+  else if (name == "30") { rate = FPS_30; framesPerSecond = 30; rateNum = 30; rateDen = 1; }
+  else
+    return false;
+  prepareCycle();
+  return true;
+}
+
+void TimecodeGenerator::start(long long time) {
+  quarterFrame = 0;
+  resume(time);
+}
+
+void TimecodeGenerator::resume(long long time) {
+  // Quarter frames go in cycles of 8 over 2 frames, a receiver locks on at the start of one
+  quarterFrame = (quarterFrame + 7)/8*8;
+  anchorQuarterFrame = quarterFrame;
+  anchorTime = time;
+  prepareCycle();
+  running = true;
+}
+
+bool TimecodeGenerator::due(long long now, unsigned char *data) {
+  if (!running)
+    return false;
+  long long deadline = dueAt(quarterFrame);
+  if (now < deadline)
+    return false;
+  // More than a frame late: skip to the cycle due next rather than send a burst,
+  // a receiver relocks on it and the time stays right
+  if (now - deadline > dueAt(quarterFrame + 4) - deadline) {
+    long long behind = (long long)((now - anchorTime)*4.0*rateNum/(1000000000.0*rateDen));
+    quarterFrame = (anchorQuarterFrame + behind + 7)/8*8;
+    prepareCycle();
+    return false;
+  }
+  *data = pieces[quarterFrame % 8];
+  quarterFrame++;
+  if (quarterFrame % 8 == 0)
+    prepareCycle();
+  return true;
+}
+
+void TimecodeGenerator::fullFrameMessage(vector<unsigned char> *message) const {
+  int hours, minutes, seconds, frames;
+  toTimecode(quarterFrame/4, &hours, &minutes, &seconds, &frames);
+  const unsigned char fullFrame[] = {0xF0, 0x7F, 0x7F, 0x01, 0x01,
+    (unsigned char)((rate << 5) | hours), (unsigned char)minutes, (unsigned char)seconds, (unsigned char)frames, 0xF7};
+  message->assign(fullFrame, fullFrame + sizeof(fullFrame));
+}
+
+long long TimecodeGenerator::dueAt(long long quarter) const {
+  // Whole periods of rateDen seconds plus the rest, exact and without overflow on long runs
+  long long perPeriod = 4*rateNum; // Quarter frames in rateDen seconds
+  long long elapsed = quarter - anchorQuarterFrame;
+  return anchorTime + elapsed/perPeriod*1000000000LL*rateDen + elapsed%perPeriod*1000000000LL*rateDen/perPeriod;
+}
+
+void TimecodeGenerator::toTimecode(long long frame, int *hours, int *minutes, int *seconds, int *frames) const {
+  if (rate == FPS_29_97_DROP) {
+    // Frame numbers 0 and 1 are left out of each minute but every tenth
+    long long tenMinutes = frame/17982, rest = frame%17982;
+    frame += 18*tenMinutes + 2*((rest - 2)/1798);
+  }
+  *frames = (int)(frame % framesPerSecond);
+  frame /= framesPerSecond;
+  *seconds = (int)(frame % 60);
+  *minutes = (int)(frame/60 % 60);
+  *hours = (int)(frame/3600 % 24);
+}
+
+void TimecodeGenerator::prepareCycle() {
+  // The time of the first frame of the cycle, a nibble per piece
+  int hours, minutes, seconds, frames;
+  toTimecode(quarterFrame/8*2, &hours, &minutes, &seconds, &frames);
+  int values[8] = {frames & 0x0F, frames >> 4, seconds & 0x0F, seconds >> 4,
+                   minutes & 0x0F, minutes >> 4, hours & 0x0F, (hours >> 4) | (rate << 1)};
+  for (int i=0; i<8; i++)
+    pieces[i] = (unsigned char)((i << 4) | values[i]);
+}
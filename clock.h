@@ -0,0 +1,141 @@
+//************** MIDIcloro **************
+//
+// Clock generator: one master phase in sub-ticks of 1/96 quarter note,
+// from which every output gets MIDI clock at its own rate (any divisor
+// of 96 PPQN: 24 as standard, 12 for half time, 48 or 96 for double or
+// quadruple time, 4 for one pulse per 16th step). There is a single
+// deadline for all outputs, and the outputs ticking at the same sub-tick
+// are given out as one batch. Tempo changes glide over a set number of
+// beats, carrying on from the phase the clock is at. Along with it the song position, counted
+// in clock ticks, and MIDI Time Code quarter frames, timed like the
+// clock ticks.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_CLOCK_H
+#define MIDICLORO_CLOCK_H
+
+#include <string>
+#include <vector>
+
+// Ticks due at one instant
+struct ClockBatch {
+  long long subTick; // Phase since the last restart
+  long long time; // When it was due, CLOCK_MONOTONIC ns
+  long long period; // Time since the previous batch was due, 0 after a restart
+  unsigned int outputs; // Bit mask of the outputs that tick
+  bool masterTick; // A 24 PPQN tick falls on it, for everything timed by the standard clock
+};
+
+class ClockGenerator {
+ public:
+  static const int SUB_TICKS_PER_QUARTER = 96;
+  static const int SUB_TICKS_PER_CLOCK = SUB_TICKS_PER_QUARTER/24;
+  static const int MAX_OUTPUTS = 4;
+
+  ClockGenerator();
+  // Clock rate of an output in pulses per quarter note, 0 for no clock.
+  // False if it isn't a divisor of SUB_TICKS_PER_QUARTER.
+  bool setPpqn(int output, int ppqn);
+  int getPpqn(int output) const { return ppqn[output]; }
+  // Beats a tempo change takes to glide from the old tempo to the new one, 0 to change at once
+  void setGlide(int beats) { glideTicks = beats > 0 ? beats*SUB_TICKS_PER_QUARTER : 0; }
+  // Start the phase from 0: every output ticks in a batch due at time. A glide
+  // under way ends at its tempo.
+  void restart(long long time);
+  // When the next batch is due
+  long long nextDue() const;
+  // Take the next batch if it's due at now, with clockInterval ns per 24 PPQN tick.
+  // A new clockInterval glides in from the last batch on, so the phase carries on
+  // without a jump.
+  bool due(long long now, long long clockInterval, ClockBatch *batch);
+  // Clock interval the grid runs at now, in ns per 24 PPQN tick
+  long long getInterval() const { return intervalAt(lastSubTick); }
+  // Phase of the last batch
+  long long getSubTick() const { return lastSubTick; }
+  // The first sub-tick from the next batch on that's a multiple of step
+  long long nextBoundary(long long step) const { return (nextSubTick + step - 1)/step*step; }
+
+ private:
+  long long following(long long subTick) const;
+  long long intervalAt(long long subTick) const;
+  unsigned int outputsAt(long long subTick) const;
+
+  int ppqn[MAX_OUTPUTS];
+  long long lastSubTick;
+  long long lastTime;
+  long long nextSubTick;
+  bool restarted;
+  long long glideFrom, glideTo; // Clock intervals
+  long long glideStart; // Sub-tick the glide started at
+  long long glideLength; // In sub-ticks, of the glide under way
+  long long glideTicks; // Length of the next glide
+};
+
+// Where the song is, in 24 PPQN ticks counted while the transport runs.
+// The count can be read from any thread.
+class SongPosition {
+ public:
+  SongPosition() : clocks(0), running(false) {}
+  void start() { __atomic_store_n(&clocks, 0, __ATOMIC_RELAXED); running = true; }
+  void resume() { running = true; }
+  void stop() { running = false; }
+  bool isRunning() const { return running; }
+  // Clock ticks played since the start
+  long long getClocks() const { return __atomic_load_n(&clocks, __ATOMIC_RELAXED); }
+  // Move to a Song Position Pointer value, in 16ths
+  void locate(int sixteenths) { __atomic_store_n(&clocks, sixteenths*6LL, __ATOMIC_RELAXED); }
+  void clockTick() { if (running) __atomic_store_n(&clocks, clocks + 1, __ATOMIC_RELAXED); }
+  // Ticks to go until the position is a multiple of ticks, where the next tick begins a new bar or beat
+  long long ticksToBoundary(int ticks) const { return (ticks - clocks%ticks)%ticks; }
+  // 16ths played, the Song Position Pointer value (as far as its 14 bits go)
+  int getSixteenths() const;
+  // Bar, beat and 16th from 1, in 4/4
+  void getBarBeatSixteenth(int *bar, int *beat, int *sixteenth) const;
+  // Song Position Pointer message of the position
+  void songPositionMessage(std::vector<unsigned char> *message) const;
+
+ private:
+  long long clocks;
+  bool running;
+};
+
+// MIDI Time Code: the time the transport has run, sent as quarter frames
+// (four per frame) while it runs, and as a full frame message on start
+class TimecodeGenerator {
+ public:
+  // The rate bits of the MTC hours
+  enum Rate { FPS_24, FPS_25, FPS_29_97_DROP, FPS_30 };
+
+  TimecodeGenerator();
+  // "24", "25", "29.97" (drop frame) or "30", false for anything else
+  bool setRate(const std::string &rate);
+  // Run from 00:00:00:00, the first quarter frame is due at time
+  void start(long long time);
+  // Run on from where it stopped
+  void resume(long long time);
+  void stop() { running = false; }
+  bool isRunning() const { return running; }
+  // Take the next quarter frame data byte (after 0xF1) if it's due at now
+  bool due(long long now, unsigned char *data);
+  // Full frame sysex of the time of the next quarter frame
+  void fullFrameMessage(std::vector<unsigned char> *message) const;
+
+ private:
+  long long dueAt(long long quarter) const;
+  void toTimecode(long long frame, int *hours, int *minutes, int *seconds, int *frames) const;
+  void prepareCycle();
+
+  Rate rate;
+  int framesPerSecond; // Nominal, 30 for 29.97
+  long long rateNum, rateDen; // Frames per second as a fraction
+  bool running;
+  long long quarterFrame; // The next one to send, from 0 at start
+  long long anchorQuarterFrame; // Quarter frame due at anchorTime
+  long long anchorTime;
+  unsigned char pieces[8]; // The quarter frame data bytes of the current 2 frame cycle
+};
+
+#endif
@@ -0,0 +1,100 @@
+//************** MIDIcloro **************
+//
+// Clock generator checks: the grid, the batches of outputs at
+// different rates and tempo glides, including the tempo changes and
+// restarts that the main loop puts it through. Exits with 1 if any
+// check fails.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-clocktest
+//
+//***************************************
+
+#include <iostream>
+#include "clock.h"
+
+using namespace std;
+
+const long long INTERVAL = 20000000LL; // ns per 24 PPQN tick, 125 BPM
+int failures = 0;
+
+void check(bool ok, const char *what) {
+  cout << (ok ? "ok   " : "FAIL ") << what << endl;
+  if (!ok)
+    failures++;
+}
+
+// Take the batches as the main loop would, polling every 1/8 tick from start to end at
+// clockInterval. Returns the number taken.
+int run(ClockGenerator *clock, long long start, long long end, long long clockInterval, ClockBatch *last) {
+  int batches = 0;
+  for (long long now=start; now<=end; now+=INTERVAL/8)
+    while (clock->due(now, clockInterval, last))
+      batches++;
+  return batches;
+}
+
+void checkGrid() {
+  ClockGenerator clock;
+  clock.restart(0);
+  ClockBatch batch;
+  int batches = run(&clock, 0, 24*INTERVAL, INTERVAL, &batch);
+  check(batches == 25, "24 PPQN ticks a beat on the grid from the restart");
+  check(batch.time == 24*INTERVAL && batch.period == INTERVAL, "ticks due on the grid, not when taken");
+}
+
+void checkRates() {
+  ClockGenerator clock;
+  clock.setPpqn(1, 12);
+  clock.setPpqn(2, 96);
+  clock.setPpqn(3, 0);
+  check(!clock.setPpqn(0, 7), "a rate that doesn't divide 96 is refused");
+  clock.restart(0);
+  ClockBatch batch;
+  int ticks[4] = {0, 0, 0, 0};
+  for (long long now=0; now<24*INTERVAL; now+=INTERVAL/8)
+    while (clock.due(now, INTERVAL, &batch))
+      for (int o=0; o<4; o++)
+        if (batch.outputs & (1 << o))
+          ticks[o]++;
+  check(ticks[0] == 24 && ticks[1] == 12 && ticks[2] == 96 && ticks[3] == 0, "each output ticks at its rate over a beat");
+}
+
+void checkGlide() {
+  ClockGenerator clock;
+  clock.setGlide(1);
+  clock.restart(0);
+  ClockBatch batch;
+  run(&clock, 0, 10*INTERVAL, INTERVAL, &batch);
+  run(&clock, 10*INTERVAL, 100*INTERVAL, INTERVAL/2, &batch);
+  check(clock.getInterval() == INTERVAL/2, "a glide ends at the new tempo");
+  long long due = clock.nextDue();
+  check(due > batch.time && due - batch.time <= INTERVAL/2, "the grid carries on from the last batch");
+}
+
+void checkRestart(int glideBeats, const char *what) {
+  ClockGenerator clock;
+  clock.setGlide(glideBeats);
+  clock.restart(0);
+  ClockBatch batch;
+  // A tempo change a few beats in, then a restart before the next batch, as on a start
+  run(&clock, 0, 100*INTERVAL, INTERVAL, &batch);
+  run(&clock, 100*INTERVAL, 101*INTERVAL, INTERVAL*2, &batch);
+  long long restartAt = 101*INTERVAL + 1;
+  clock.restart(restartAt);
+  check(clock.nextDue() == restartAt, what);
+  run(&clock, restartAt, restartAt, INTERVAL*2, &batch);
+  check(clock.nextDue() - restartAt == INTERVAL*2, "after the restart the grid runs at the new tempo");
+}
+
+int main() {
+  checkGrid();
+  checkRates();
+  checkGlide();
+  checkRestart(0, "tempo change and restart without a glide");
+  checkRestart(1, "tempo change and restart during a glide");
+  cout << (failures == 0 ? "All passed" : "Some failed") << endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,524 @@
+//************** MIDIcloro **************
+//
+// MIDI engine
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <algorithm>
+#include <cmath>
+#include <boost/utility/binary.hpp>
+#include "engine.h"
+#include "probes.h"
+#include "trace.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+enum Chord {
+  CHORD_OFF = 0,
+  MINOR3,
+  MAJOR3,
+  MINOR3_LO,
+  MAJOR3_LO,
+  MINOR2,
+  MAJOR2,
+  M7,
+  MAJ7,
+  M9,
+  MAJ9,
+  SUS4,
+  POWER2,
+  POWER3,
+  OCTAVE2,
+  OCTAVE3
+};
+
+enum Velo {
+  VEL_OFF,
+  VEL_ON,
+  VEL_RDM
+};
+
+EngineConfig::EngineConfig()
+  : enableClock(true), ignoreProgramChanges(false), initialBpm(142), tapTempoMinBpm(80), tapTempoMaxBpm(200),
+    tapTempoHistory(8), tapTempoEstimator("median"), tapTempoTolerance(20),
+    bpmOffsetForMidiCC(70), velocityRandomOffset(-40), velocityMultiDeviceCtrl(true), velocityMidiCC(7),
+    tempoMidiCC(10), chordMidiCC(11), routeMidiCC(12), startMidiCC(13), stopMidiCC(14), loopMidiCC(15),
+    randomSeed(0) {
+  for (int i=0; i<4; i++)
+    mono[i] = false;
+}
+
+static void checkTapTempoEstimator(const string &estimator) {
+  if (estimator != "median" && estimator != "leastsquares")
+    throw po::validation_error(po::validation_error::invalid_option_value, "tapTempoEstimator", estimator);
+}
+
+void addEngineOptions(po::options_description *desc, EngineConfig *config) {
+  desc->add_options()
+    ("input1mono", po::value<bool>(&config->mono[0])->default_value(false), "input1mono")
+    ("input2mono", po::value<bool>(&config->mono[1])->default_value(false), "input2mono")
+    ("input3mono", po::value<bool>(&config->mono[2])->default_value(false), "input3mono")
+    ("input4mono", po::value<bool>(&config->mono[3])->default_value(false), "input4mono")
+    ("enableClock", po::value<bool>(&config->enableClock)->default_value(true), "enableClock")
+    ("startMidiCC", po::value<int>(&config->startMidiCC)->default_value(13), "startMidiCC")
+    ("stopMidiCC", po::value<int>(&config->stopMidiCC)->default_value(14), "stopMidiCC")
+    ("ignoreProgramChanges", po::value<bool>(&config->ignoreProgramChanges)->default_value(false), "ignoreProgramChanges")
+    ("initialBpm", po::value<int>(&config->initialBpm)->default_value(142), "initialBpm")
+    ("tapTempoMinBpm", po::value<int>(&config->tapTempoMinBpm)->default_value(80), "tapTempoMinBpm")
+    ("tapTempoMaxBpm", po::value<int>(&config->tapTempoMaxBpm)->default_value(200), "tapTempoMaxBpm")
+    ("tapTempoHistory", po::value<int>(&config->tapTempoHistory)->default_value(8), "tapTempoHistory")
+    ("tapTempoEstimator", po::value<string>(&config->tapTempoEstimator)->default_value("median")->notifier(checkTapTempoEstimator), "tapTempoEstimator")
+    ("tapTempoTolerance", po::value<int>(&config->tapTempoTolerance)->default_value(20), "tapTempoTolerance")
+    ("bpmOffsetForMidiCC", po::value<int>(&config->bpmOffsetForMidiCC)->default_value(70), "bpmOffsetForMidiCC")
+    ("velocityRandomOffset", po::value<int>(&config->velocityRandomOffset)->default_value(-40), "velocityRandomOffset")
+    ("velocityMultiDeviceCtrl", po::value<bool>(&config->velocityMultiDeviceCtrl)->default_value(true), "velocityMultiDeviceCtrl")
+    ("velocityMidiCC", po::value<int>(&config->velocityMidiCC)->default_value(7), "velocityMidiCC")
+    ("tempoMidiCC", po::value<int>(&config->tempoMidiCC)->default_value(10), "tempoMidiCC")
+    ("chordMidiCC", po::value<int>(&config->chordMidiCC)->default_value(11), "chordMidiCC")
+    ("routeMidiCC", po::value<int>(&config->routeMidiCC)->default_value(12), "routeMidiCC")
+    ("loopMidiCC", po::value<int>(&config->loopMidiCC)->default_value(15), "loopMidiCC");
+}
+
+MidiEngine::MidiEngine(const EngineConfig &config, MidiSink *sink, MidiTime *time)
+  : config(config), sink(sink), time(time), random(boost::mt19937(config.randomSeed)),
+    chordNotes(0), tapTempoEvents(0), tapJitter(0), tapDeviation(0), tapTempoTimes(max(config.tapTempoHistory, 2)),
+    noteOffMessage(3), clockStartMessage(1), clockStopMessage(1) {
+  clockInterval = 60000000000/(config.initialBpm*24);
+  tapTempoMaxInterval = 60000000000/config.tapTempoMinBpm;
+  tapTempoMinInterval = 60000000000/config.tapTempoMaxBpm;
+  tapTempoTimes.push_front(time->now());
+  // Room for the whole history, so tapping doesn't allocate
+  tapIntervals.reserve(tapTempoTimes.capacity());
+  tapBeats.reserve(tapTempoTimes.capacity());
+  tapTimes.reserve(tapTempoTimes.capacity());
+
+  // Note off message
+  noteOffMessage[0] = BOOST_BINARY(10000000);
+  noteOffMessage[1] = 42;
+  noteOffMessage[2] = 100;
+  // Midi clock start
+  clockStartMessage[0] = BOOST_BINARY(11111010);
+  // Midi clock stop
+  clockStopMessage[0] = BOOST_BINARY(11111100);
+
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<16; j++) {
+      lastNote[i][j] = -1;
+      channelRouting[i][j] = j;
+      chordModes[i][j] = CHORD_OFF;
+      velocityModes[i][j] = VEL_OFF;
+      velocity[i][j] = 100;
+      monoLegato[i][j] = false;
+    }
+  }
+}
+
+double MidiEngine::random01() {
+  return random();
+}
+
+bool MidiEngine::ignoreMessage(unsigned char msgByte) {
+  if ((config.enableClock && (msgByte == BOOST_BINARY(11111000))) || // MIDI clock
+      (config.ignoreProgramChanges && ((msgByte & BOOST_BINARY(11110000)) == BOOST_BINARY(11000000)))) // Program change
+    return true;
+  return false;
+}
+
+void MidiEngine::transposeAndSend(vector<unsigned char> *message, int semiNotes) {
+  // Verify that the note will end up withing the permitted range
+  int note = (int)(*message)[1] + semiNotes;
+  if (note >= 0 && note <= 127){
+    // This changes the message - keep in mind for the next note in the chord
+    (*message)[1] = note;
+    sink->send(message);
+    __atomic_store_n(&chordNotes, chordNotes + 1, __ATOMIC_RELAXED);
+  }
+}
+
+void MidiEngine::sendNoteOrChord(vector<unsigned char> *message, int source) {
+  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
+  PROBE4(note_or_chord, source, channel, (*message)[1], chordModes[source][channel]);
+  // Handle chord mode
+  switch(chordModes[source][channel]) {
+    case CHORD_OFF:
+      sink->send(message);
+      break;
+    case MINOR3:
+      sink->send(message);
+      transposeAndSend(message, 3);
+      transposeAndSend(message, 4);
+      break;
+    case MAJOR3:
+      sink->send(message);
+      transposeAndSend(message, 4);
+      transposeAndSend(message, 3);
+      break;
+    case MINOR3_LO:
+      transposeAndSend(message, -5);
+      transposeAndSend(message, 5);
+      transposeAndSend(message, 3);
+      break;
+    case MAJOR3_LO:
+      transposeAndSend(message, -5);
+      transposeAndSend(message, 5);
+      transposeAndSend(message, 4);
+      break;
+    case MINOR2:
+      sink->send(message);
+      transposeAndSend(message, 3);
+      break;
+    case MAJOR2:
+      sink->send(message);
+      transposeAndSend(message, 4);
+      break;
+    case M7:
+      sink->send(message);
+      transposeAndSend(message, 3);
+      transposeAndSend(message, 4);
+      transposeAndSend(message, 3);
+      break;
+    case MAJ7:
+      sink->send(message);
+      transposeAndSend(message, 4);
+      transposeAndSend(message, 3);
+      transposeAndSend(message, 4);
+      break;
+    case M9:
+      sink->send(message);
+      transposeAndSend(message, 3);
+      transposeAndSend(message, 4);
+      transposeAndSend(message, 3);
+      transposeAndSend(message, 4);
+      break;
+    case MAJ9:
+      sink->send(message);
+      transposeAndSend(message, 4);
+      transposeAndSend(message, 3);
+      transposeAndSend(message, 4);
+      transposeAndSend(message, 3);
+      break;
+    case SUS4:
+      sink->send(message);
+      transposeAndSend(message, 5);
+      transposeAndSend(message, 2);
+      break;
+    case POWER2:
+      sink->send(message);
+      transposeAndSend(message, 7);
+      break;
+    case POWER3:
+      sink->send(message);
+      transposeAndSend(message, 7);
+      transposeAndSend(message, 5);
+      break;
+    case OCTAVE2:
+      sink->send(message);
+      transposeAndSend(message, 12);
+      break;
+    case OCTAVE3:
+      sink->send(message);
+      transposeAndSend(message, 12);
+      transposeAndSend(message, 12);
+      break;
+    default:
+      sink->send(message);
+      break;
+  }
+}
+
+void MidiEngine::sendNoteOffAndNote(vector<unsigned char> *message, int source) {
+  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
+  bool thisIsNoteOn = ((*message)[0] & BOOST_BINARY(10010000)) == BOOST_BINARY(10010000);
+  if (!monoLegato[source][channel]) {
+    if (thisIsNoteOn && lastNote[source][channel] != -1) {
+      noteOffMessage[0] = 128 + channel;
+      noteOffMessage[1] = lastNote[source][channel];
+      sendNoteOrChord(&noteOffMessage, source);
+    }
+    lastNote[source][channel] = thisIsNoteOn ? (*message)[1] : -1;
+    sendNoteOrChord(message, source);
+  }
+  else {
+    unsigned char currNote = (*message)[1];
+    sendNoteOrChord(message, source);
+    if (thisIsNoteOn && lastNote[source][channel] != -1) {
+      noteOffMessage[0] = 128 + channel;
+      noteOffMessage[1] = lastNote[source][channel];
+      sendNoteOrChord(&noteOffMessage, source);
+    }
+    lastNote[source][channel] = thisIsNoteOn ? currNote : -1;
+  }
+}
+
+
+void MidiEngine::setChordMode(int source, int channel, int value) {
+  if (chordModes[source][channel] == 0 && value == 0)
+    monoLegato[source][channel] = !monoLegato[source][channel];
+
+  chordModes[source][channel] = value/8;
+}
+
+void MidiEngine::routeChannel(vector<unsigned char> *message, int source) {
+  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
+  (*message)[0] = ((*message)[0] & BOOST_BINARY(11110000)) + channelRouting[source][channel];
+}
+
+void MidiEngine::setChannelRouting(int source, int channel, int newChannel) {
+  if (newChannel >= 0 && newChannel <= 127)
+    channelRouting[source][channel] = newChannel/8;
+}
+
+void MidiEngine::applyVelocity(vector<unsigned char> *message, int source) {
+  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
+  if (velocityModes[source][channel] == VEL_OFF || message->size() < 3)
+    return;
+
+  if (velocityModes[source][channel] == VEL_RDM) {
+    if (config.velocityRandomOffset < 0)
+      (*message)[2] = max(velocity[source][channel]+(int)(config.velocityRandomOffset*random01()), 1);
+    else if (config.velocityRandomOffset > 0)
+      (*message)[2] = min(velocity[source][channel]+(int)(config.velocityRandomOffset*random01()), 126) + 1;
+    else
+      (*message)[2] = max((int)(random01()*127), 1);
+  }
+  else {
+    (*message)[2] = max(velocity[source][channel], 1);
+  }
+}
+
+void MidiEngine::setVelocityMode(int source, int channel, int value) {
+  if (value == 127) {
+    velocityModes[source][channel] = (velocityModes[source][channel] == VEL_RDM) ? VEL_ON : VEL_RDM;
+  }
+  else if (value == 0) {
+    velocityModes[source][channel] = VEL_OFF;
+  }
+  else {
+    value = scaleUp(value);
+    velocity[source][channel] = value;
+    if (velocityModes[source][channel] == VEL_OFF)
+      velocityModes[source][channel] = VEL_ON;
+  }
+}
+
+void MidiEngine::setVelocityModeMulti(int source, int channel, int value) {
+  if (value == 127) {
+    int newMode = (velocityModes[source][channel] == VEL_RDM) ? VEL_ON : VEL_RDM;
+    for (int i=source; i>=0; i--)
+      velocityModes[i][channel] = newMode;
+  }
+  else if (value == 0) {
+    for (int i=source; i>=0; i--)
+      velocityModes[i][channel] = VEL_OFF;
+  }
+  else {
+    value = scaleUp(value);
+    for (int i=source; i>=0; i--)
+      velocity[i][channel] = value;
+    if (velocityModes[source][channel] == VEL_OFF)
+      for (int i=source; i>=0; i--)
+        velocityModes[i][channel] = VEL_ON;
+  }
+}
+
+int MidiEngine::scaleUp(int value) {
+  // Scale value to let 8-120 contain the whole range 0-127
+  if (value > 64) {
+    value += 8*(value - 64)/56;
+    value = min(value, 127);
+  }
+  else if (value < 64) {
+    value -= 8*(64 - value)/56;
+    value = max(value, 0);
+  }
+  return value;
+}
+
+long MidiEngine::tapTempo() {
+  tapTempoTimes.push_front(time->now());
+  // The taps since the last pause longer than a beat at the slowest tempo. A longer pause starts
+  // over, so a single tempo CC sent a while after tapping sets the tempo from its value.
+  size_t nTaps = 1;
+  while (nTaps < tapTempoTimes.size() && tapTempoTimes[nTaps-1] - tapTempoTimes[nTaps] <= tapTempoMaxInterval)
+    nTaps++;
+  // Their median interval within the tempo limits is what the taps are held against
+  tapIntervals.clear();
+  for (size_t i=1; i<nTaps; i++) {
+    long long interval = tapTempoTimes[i-1] - tapTempoTimes[i];
+    if (interval >= tapTempoMinInterval && interval <= tapTempoMaxInterval)
+      tapIntervals.push_back(interval);
+  }
+  if (tapIntervals.empty()) {
+    // Number of taps used and the interval between them in ns, 0 if the tap stands alone
+    PROBE2(tap_tempo, 1, 0);
+    return 0;
+  }
+  nth_element(tapIntervals.begin(), tapIntervals.begin() + tapIntervals.size()/2, tapIntervals.end());
+  long long reference = tapIntervals[tapIntervals.size()/2];
+
+  // Number the beats back from the newest tap. A tap that skipped a beat counts two, and one
+  // too far off the beat (a doubled tap, a stumble) is left out.
+  tapBeats.clear();
+  tapTimes.clear();
+  tapBeats.push_back(0);
+  tapTimes.push_back(0);
+  long long beat = 0, kept = tapTempoTimes[0];
+  for (size_t i=1; i<nTaps; i++) {
+    long long gap = kept - tapTempoTimes[i];
+    long long beats = (gap + reference/2)/reference;
+    if (beats == 0 || llabs(gap - beats*reference)*100 > reference*config.tapTempoTolerance)
+      continue;
+    beat += beats;
+    kept = tapTempoTimes[i];
+    tapBeats.push_back(beat);
+    tapTimes.push_back(tapTempoTimes[0] - kept);
+  }
+  size_t n = tapBeats.size();
+  if (n < 2) {
+    // The newest tap is the one off the beat, the others still give the tempo
+    PROBE2(tap_tempo, 1, reference);
+    return reference;
+  }
+
+  double meanBeat = 0, meanTime = 0;
+  for (size_t i=0; i<n; i++) {
+    meanBeat += tapBeats[i];
+    meanTime += tapTimes[i];
+  }
+  meanBeat /= n;
+  meanTime /= n;
+  double spread = 0, interval = 0;
+  for (size_t i=0; i<n; i++)
+    spread += (tapBeats[i] - meanBeat)*(tapBeats[i] - meanBeat);
+  if (config.tapTempoEstimator == "leastsquares") {
+    // The slope of the straight line closest to the taps
+    for (size_t i=0; i<n; i++)
+      interval += (tapBeats[i] - meanBeat)*(tapTimes[i] - meanTime);
+    interval /= spread;
+  }
+  else {
+    // The median of the intervals between the taps kept, per beat
+    tapIntervals.clear();
+    for (size_t i=1; i<n; i++)
+      tapIntervals.push_back((tapTimes[i] - tapTimes[i-1])/(tapBeats[i] - tapBeats[i-1]));
+    nth_element(tapIntervals.begin(), tapIntervals.begin() + tapIntervals.size()/2, tapIntervals.end());
+    interval = tapIntervals[tapIntervals.size()/2];
+  }
+
+  // How far the taps are from the beats the tempo puts them on, and how far that leaves the tempo
+  // from the one tapped. Both need a tap more than it takes to set the tempo.
+  double squares = 0;
+  for (size_t i=0; i<n; i++) {
+    double off = tapTimes[i] - meanTime - (tapBeats[i] - meanBeat)*interval;
+    squares += off*off;
+  }
+  double jitter = n > 2 ? sqrt(squares/(n - 2)) : 0;
+  __atomic_store_n(&tapJitter, (long)jitter, __ATOMIC_RELAXED);
+  __atomic_store_n(&tapDeviation, (long)(jitter/sqrt(spread)), __ATOMIC_RELAXED);
+  // Number of taps used and the interval between them in ns
+  PROBE2(tap_tempo, n, (long)interval);
+  return (long)interval; // Interval in ns
+}
+
+void MidiEngine::handleMessage(vector<unsigned char> *message, int source) {
+  PROBE4(handle_message, source, (*message)[0], message->size() > 1 ? (*message)[1] : 0, message->size());
+  // Sysex or a streamed sysex chunk: pass it through untouched
+  if ((*message)[0] == BOOST_BINARY(11110000) || (*message)[0] == BOOST_BINARY(11110111) || (*message)[0] < BOOST_BINARY(10000000)) {
+    TRACE_BRANCH(BRANCH_SYSEX);
+    sink->send(message);
+    return;
+  }
+
+  // Handle mono mode
+  if (config.mono[source] && ((*message)[0] & BOOST_BINARY(11100000)) == BOOST_BINARY(10000000)) {
+    TRACE_BRANCH(BRANCH_MONO);
+    routeChannel(message, source);
+    applyVelocity(message, source);
+    sendNoteOffAndNote(message, source);
+  }
+  // Note on/off: send note or chord
+  else if (((*message)[0] & BOOST_BINARY(11100000)) == BOOST_BINARY(10000000)) {
+    TRACE_BRANCH(BRANCH_NOTE);
+    routeChannel(message, source);
+    applyVelocity(message, source);
+    sendNoteOrChord(message, source);
+  }
+  // Start message: pass it through and reset clock
+  else if (config.enableClock && ((*message)[0] == BOOST_BINARY(11111010))) {
+    TRACE_BRANCH(BRANCH_START);
+    sink->send(message);
+    sink->restartClock();
+    sink->transportStart();
+  }
+  // Stop message: reset last notes
+  else if (config.enableClock && ((*message)[0] == BOOST_BINARY(11111100))) {
+    TRACE_BRANCH(BRANCH_STOP);
+    sink->send(message);
+    sink->transportStop();
+    for (int i=0; i<4; i++)
+      for (int j=0; j<16; j++)
+        lastNote[i][j] = -1;
+  }
+  // Tap-tempo MIDI CC: use tap-tempo or tempo from MIDI message
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.tempoMidiCC) {
+    TRACE_BRANCH(BRANCH_TEMPO_CC);
+    long tapInterval = tapTempo();
+    if (tapInterval != 0)
+      __atomic_store_n(&clockInterval, tapInterval/24, __ATOMIC_RELAXED);
+    else
+      __atomic_store_n(&clockInterval, 60000000000/((config.bpmOffsetForMidiCC+(*message)[2])*24), __ATOMIC_RELAXED);
+    __atomic_store_n(&tapTempoEvents, tapTempoEvents + 1, __ATOMIC_RELAXED);
+  }
+  // Chord mode MIDI CC: set chord mode
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.chordMidiCC) {
+    TRACE_BRANCH(BRANCH_CHORD_CC);
+    routeChannel(message, source);
+    setChordMode(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
+  }
+  // Channel routing MIDI CC: set channel routing
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.routeMidiCC) {
+    TRACE_BRANCH(BRANCH_ROUTE_CC);
+    setChannelRouting(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
+  }
+  // Velocity MIDI CC: set velocity mode
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.velocityMidiCC) {
+    TRACE_BRANCH(BRANCH_VELOCITY_CC);
+    routeChannel(message, source);
+    if (config.velocityMultiDeviceCtrl)
+      setVelocityModeMulti(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
+    else
+      setVelocityMode(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
+  }
+  // Looper MIDI CC: arm, record, overdub or clear the loop of the channel
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.loopMidiCC) {
+    TRACE_BRANCH(BRANCH_LOOP_CC);
+    routeChannel(message, source);
+    sink->loopControl((*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
+  }
+  // Start message CC: Send midi clock start
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.startMidiCC && (*message)[2] >= 64) {
+    TRACE_BRANCH(BRANCH_START_CC);
+    sink->send(&clockStartMessage);
+    sink->transportStart();
+  }
+  // Stop message CC: Send midi clock stop
+  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == config.stopMidiCC && (*message)[2] >= 64) {
+    TRACE_BRANCH(BRANCH_STOP_CC);
+    sink->send(&clockStopMessage);
+    sink->transportStop();
+  }
+  // Other MIDI messages
+  else if (!ignoreMessage((*message)[0])) {
+    TRACE_BRANCH(BRANCH_OTHER);
+    if ((((*message)[0] & BOOST_BINARY(11110000)) >= BOOST_BINARY(10000000)) &&
+        (((*message)[0] & BOOST_BINARY(11110000)) <= BOOST_BINARY(11100000))) {
+      routeChannel(message, source);
+    }
+    sink->send(message);
+  }
+  else
+    TRACE_BRANCH(BRANCH_IGNORED);
+}
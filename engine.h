@@ -0,0 +1,122 @@
+//************** MIDIcloro **************
+//
+// MIDI engine: the transformations MIDIcloro applies to incoming
+// messages (channel routing, velocity mode, chord mode, mono mode,
+// tap-tempo and the control CCs). The engine doesn't know about MIDI
+// ports or the system clock: messages go to a MidiSink and time comes
+// from a MidiTime, so it runs the same live and over MIDI files.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_ENGINE_H
+#define MIDICLORO_ENGINE_H
+
+#include <string>
+#include <vector>
+#include <boost/circular_buffer.hpp>
+#include <boost/program_options.hpp>
+#include <boost/random.hpp>
+
+// Receives everything the engine sends, and the transport and tempo changes it asks for
+class MidiSink {
+ public:
+  virtual ~MidiSink() {}
+  virtual void send(std::vector<unsigned char> *message) = 0;
+  // The clock should restart its current tick, on start
+  virtual void restartClock() {}
+  virtual void transportStart() {}
+  virtual void transportStop() {}
+  virtual void loopControl(int /*channel*/, int /*value*/) {}
+};
+
+// Time in ns, only differences between calls matter
+class MidiTime {
+ public:
+  virtual ~MidiTime() {}
+  virtual long long now() = 0;
+};
+
+// The settings read from midicloro.cfg that the engine uses
+struct EngineConfig {
+  EngineConfig();
+  bool enableClock;
+  bool ignoreProgramChanges;
+  bool mono[4];
+  int initialBpm;
+  int tapTempoMinBpm;
+  int tapTempoMaxBpm;
+  int tapTempoHistory; // Taps kept
+  std::string tapTempoEstimator; // "median" or "leastsquares"
+  int tapTempoTolerance; // How far off the beat a tap may be, percent of a beat
+  int bpmOffsetForMidiCC;
+  int velocityRandomOffset;
+  bool velocityMultiDeviceCtrl;
+  int velocityMidiCC;
+  int tempoMidiCC;
+  int chordMidiCC;
+  int routeMidiCC;
+  int startMidiCC;
+  int stopMidiCC;
+  int loopMidiCC;
+  unsigned int randomSeed;
+};
+
+// Add the engine settings to the options read from the config file
+void addEngineOptions(boost::program_options::options_description *desc, EngineConfig *config);
+
+class MidiEngine {
+ public:
+  MidiEngine(const EngineConfig &config, MidiSink *sink, MidiTime *time);
+  // Handle a message from input source (0-3). The message may be changed.
+  void handleMessage(std::vector<unsigned char> *message, int source);
+  // Clock interval in ns
+  long getClockInterval() const { return __atomic_load_n(&clockInterval, __ATOMIC_RELAXED); }
+  // Counters for the metrics, these and the clock interval can be read from any thread
+  unsigned long getChordNotes() const { return __atomic_load_n(&chordNotes, __ATOMIC_RELAXED); }
+  unsigned long getTapTempoEvents() const { return __atomic_load_n(&tapTempoEvents, __ATOMIC_RELAXED); }
+  // Standard deviation of the last taps from the beats of the tempo they set, in ns
+  long getTapJitter() const { return __atomic_load_n(&tapJitter, __ATOMIC_RELAXED); }
+  // Standard error of the beat interval those taps set, in ns
+  long getTapDeviation() const { return __atomic_load_n(&tapDeviation, __ATOMIC_RELAXED); }
+
+ private:
+  bool ignoreMessage(unsigned char msgByte);
+  double random01();
+  void transposeAndSend(std::vector<unsigned char> *message, int semiNotes);
+  void sendNoteOrChord(std::vector<unsigned char> *message, int source);
+  void sendNoteOffAndNote(std::vector<unsigned char> *message, int source);
+  void setChordMode(int source, int channel, int value);
+  void routeChannel(std::vector<unsigned char> *message, int source);
+  void setChannelRouting(int source, int channel, int newChannel);
+  void applyVelocity(std::vector<unsigned char> *message, int source);
+  void setVelocityMode(int source, int channel, int value);
+  void setVelocityModeMulti(int source, int channel, int value);
+  int scaleUp(int value);
+  long tapTempo();
+
+  EngineConfig config;
+  MidiSink *sink;
+  MidiTime *time;
+  boost::uniform_01<boost::mt19937> random;
+  long clockInterval; // Clock interval in ns
+  unsigned long chordNotes; // Notes added by chord mode, note ons and note offs
+  unsigned long tapTempoEvents; // Tempo CCs handled
+  long tapJitter, tapDeviation;
+  long tapTempoMinInterval; // Tap-tempo min interval in ns
+  long tapTempoMaxInterval; // Tap-tempo max interval in ns
+  boost::circular_buffer<long long> tapTempoTimes;
+  std::vector<long long> tapIntervals, tapBeats, tapTimes; // Working space of tapTempo
+  std::vector<unsigned char> noteOffMessage;
+  std::vector<unsigned char> clockStartMessage;
+  std::vector<unsigned char> clockStopMessage;
+  int lastNote[4][16];
+  int channelRouting[4][16];
+  int chordModes[4][16];
+  int velocityModes[4][16];
+  int velocity[4][16];
+  bool monoLegato[4][16];
+};
+
+#endif
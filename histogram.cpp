@@ -0,0 +1,61 @@
+//************** MIDIcloro **************
+//
+// Latency histograms
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <algorithm>
+#include "histogram.h"
+
+using namespace std;
+
+Histogram::Histogram() : maxValue(0) {
+  for (int i=0; i<BUCKETS; i++)
+    counts[i] = 0;
+}
+
+void Histogram::merge(const Histogram &other) {
+  for (int i=0; i<BUCKETS; i++) {
+    unsigned long long n = __atomic_load_n(&other.counts[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&counts[i], __atomic_load_n(&counts[i], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+  }
+  if (other.getMax() > getMax())
+    __atomic_store_n(&maxValue, other.getMax(), __ATOMIC_RELAXED);
+}
+
+unsigned long long Histogram::getCount() const {
+  unsigned long long n = 0;
+  for (int i=0; i<BUCKETS; i++)
+    n += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+  return n;
+}
+
+long long Histogram::percentile(double fraction) const {
+  // Read the counts once, the writer may be adding to them
+  unsigned long long snapshot[BUCKETS];
+  unsigned long long total = 0;
+  for (int i=0; i<BUCKETS; i++) {
+    snapshot[i] = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+    total += snapshot[i];
+  }
+  if (total == 0)
+    return 0;
+  unsigned long long rank = max((unsigned long long)(fraction*total + 0.5), 1ULL);
+  unsigned long long seen = 0;
+  for (int i=0; i<BUCKETS; i++) {
+    seen += snapshot[i];
+    // The top of the bucket, but never more than the largest value seen
+    if (seen >= rank)
+      return i == BUCKETS - 1 ? getMax() : min(bucketStart(i + 1) - 1, getMax());
+  }
+  return getMax();
+}
+
+long long Histogram::bucketStart(int i) {
+  if (i < 2*SUB_BUCKETS)
+    return i;
+  int msb = i/SUB_BUCKETS + SUB_BITS - 1;
+  return (long long)(SUB_BUCKETS + i % SUB_BUCKETS) << (msb - SUB_BITS);
+}
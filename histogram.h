@@ -0,0 +1,53 @@
+//************** MIDIcloro **************
+//
+// Latency histograms with log-spaced buckets, eight per power of two,
+// so any value from 1 ns to minutes is kept within 12.5% in a fixed
+// 2.5 kB of counts. Recording is a couple of instructions and never
+// locks or allocates: each histogram has one writing thread, and any
+// other thread can read it or merge several into one at any time.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_HISTOGRAM_H
+#define MIDICLORO_HISTOGRAM_H
+
+class Histogram {
+ public:
+  static const int SUB_BITS = 3;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  // Up to 2^40 ns, about 18 minutes, larger values go in the last bucket
+  static const int BUCKETS = (40 - SUB_BITS + 2)*SUB_BUCKETS;
+
+  Histogram();
+  // Only one thread may record into a histogram
+  void record(long long value) {
+    int i = bucket(value);
+    __atomic_store_n(&counts[i], __atomic_load_n(&counts[i], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    if (value > __atomic_load_n(&maxValue, __ATOMIC_RELAXED))
+      __atomic_store_n(&maxValue, value, __ATOMIC_RELAXED);
+  }
+  // Add the counts of another histogram, e.g. the same measurement from another thread
+  void merge(const Histogram &other);
+  unsigned long long getCount() const;
+  long long getMax() const { return __atomic_load_n(&maxValue, __ATOMIC_RELAXED); }
+  // The value that the given fraction of the values are at or below, to within a bucket
+  long long percentile(double fraction) const;
+
+  static int bucket(long long value) {
+    if (value < 2*SUB_BUCKETS)
+      return value < 0 ? 0 : value;
+    int msb = 63 - __builtin_clzll(value);
+    int i = (msb - SUB_BITS + 1)*SUB_BUCKETS + ((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return i < BUCKETS ? i : BUCKETS - 1;
+  }
+  // Smallest value that goes in a bucket
+  static long long bucketStart(int i);
+
+ private:
+  unsigned long long counts[BUCKETS];
+  long long maxValue;
+};
+
+#endif
@@ -0,0 +1,148 @@
+//************** MIDIcloro **************
+//
+// Loopback latency probe
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <time.h>
+#include "loopback.h"
+#include "timeutil.h"
+
+using namespace std;
+
+// How long to wait for the probes still out after the last one was sent
+const long long RETURN_TIMEOUT = 1000000000LL;
+// Pause between polls of the inputs. The return is timed by the input thread, so this doesn't add to it.
+const long POLL_PERIOD = 100000;
+// Columns of the distribution chart
+const int CHART_BINS = 12;
+const int CHART_WIDTH = 40;
+
+LoopbackProbe::LoopbackProbe(int channel, int count, long long interval)
+  : channel(channel & 0x0F), count(min(max(count, 1), MAX_PROBES)), interval(interval), sent(0),
+    sendTimes(this->count, 0), message(3) {
+  for (int i=0; i<4; i++) {
+    inputs[i].listened = false;
+    inputs[i].back.assign(this->count, false);
+    inputs[i].roundTrips.reserve(this->count);
+    inputs[i].duplicates = 0;
+  }
+}
+
+void LoopbackProbe::run(RtMidiOut *out, RtMidiIn *ins[4], const bool *stop) {
+  for (int i=0; i<4; i++)
+    inputs[i].listened = ins[i] != 0;
+  vector<RtMidiMessage> incoming;
+  long long nextSend = monotonicNanos();
+  long long lastSend = 0;
+  struct timespec wait = {0, POLL_PERIOD};
+  while (!*stop) {
+    long long now = monotonicNanos();
+    if (sent < count && now >= nextSend) {
+      sendProbe(out, sent);
+      lastSend = sendTimes[sent];
+      sent++;
+      nextSend += interval;
+    }
+    for (int i=0; i<4; i++) {
+      if (!ins[i])
+        continue;
+      unsigned int nMsgs = ins[i]->getMessages(&incoming);
+      now = monotonicNanos();
+      for (unsigned int m=0; m<nMsgs; m++)
+        receive(i, incoming[m], now);
+    }
+    out->flushOutput();
+    if (sent == count && (allBack() || monotonicNanos() - lastSend > RETURN_TIMEOUT))
+      break;
+    nanosleep(&wait, 0);
+  }
+}
+
+void LoopbackProbe::sendProbe(RtMidiOut *out, int probe) {
+  message[0] = 0x90 | channel;
+  message[1] = probe & 0x7F;
+  message[2] = (probe >> 7) + 1;
+  sendTimes[probe] = monotonicNanos();
+  out->sendMessage(&message);
+  // Ended right away, so a synth on the loop isn't left playing
+  message[0] = 0x80 | channel;
+  message[2] = 0;
+  out->sendMessage(&message);
+}
+
+void LoopbackProbe::receive(int input, const RtMidiMessage &received, long long now) {
+  const vector<unsigned char> &bytes = received.bytes;
+  if (bytes.size() != 3 || bytes[0] != (0x90 | channel) || bytes[2] == 0)
+    return;
+  int probe = (bytes[2] - 1)*128 + bytes[1];
+  if (probe >= sent)
+    return;
+  Input &in = inputs[input];
+  if (in.back[probe]) {
+    in.duplicates++;
+    return;
+  }
+  in.back[probe] = true;
+  // The input thread's arrival time, where the API gives one
+  long long arrival = received.arrivalTime != 0 ? received.arrivalTime : now;
+  in.roundTrips.push_back(arrival - sendTimes[probe]);
+}
+
+bool LoopbackProbe::allBack() const {
+  for (int i=0; i<4; i++)
+    if (inputs[i].listened && inputs[i].roundTrips.size() < (size_t)sent)
+      return false;
+  return true;
+}
+
+void LoopbackProbe::report(ostream &out, const string inputNames[4], const string &outputName) {
+  out << fixed << setprecision(1);
+  for (int i=0; i<4; i++) {
+    const Input &in = inputs[i];
+    if (!in.listened)
+      continue;
+    out << endl << "Output " << outputName << " to input " << i+1 << " " << inputNames[i] << ": "
+        << in.roundTrips.size() << " of " << sent << " probes back";
+    if (in.duplicates > 0)
+      out << ", " << in.duplicates << " twice";
+    out << endl;
+    if (in.roundTrips.empty())
+      continue;
+
+    vector<long long> sorted(in.roundTrips);
+    sort(sorted.begin(), sorted.end());
+    double sum = 0, sumSquares = 0;
+    for (size_t j=0; j<sorted.size(); j++) {
+      sum += sorted[j];
+      sumSquares += (double)sorted[j]*sorted[j];
+    }
+    double mean = sum/sorted.size();
+    double deviation = sqrt(max(sumSquares/sorted.size() - mean*mean, 0.0));
+    const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    const char *names[] = {"p50", "p90", "p99", "p99.9"};
+    out << "  round trip us: min " << sorted.front()/1000.0;
+    for (int f=0; f<4; f++)
+      out << ", " << names[f] << " " << sorted[min((size_t)(fractions[f]*sorted.size()), sorted.size()-1)]/1000.0;
+    out << ", max " << sorted.back()/1000.0 << ", mean " << mean/1000.0 << ", std dev " << deviation/1000.0 << endl;
+
+    // The distribution between min and max
+    long long low = sorted.front(), width = max((sorted.back() - low + CHART_BINS - 1)/CHART_BINS, 1LL);
+    vector<int> bins(CHART_BINS, 0);
+    int most = 0;
+    for (size_t j=0; j<sorted.size(); j++) {
+      int b = min((int)((sorted[j] - low)/width), CHART_BINS - 1);
+      most = max(most, ++bins[b]);
+    }
+    for (int b=0; b<CHART_BINS; b++)
+      out << "  " << setw(9) << (low + b*width)/1000.0 << " us " << setw(6) << bins[b] << " "
+          << string((bins[b]*CHART_WIDTH + most - 1)/most, '#') << endl;
+  }
+  out.unsetf(ios::floatfield);
+  out << setprecision(6);
+}
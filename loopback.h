@@ -0,0 +1,53 @@
+//************** MIDIcloro **************
+//
+// Loopback latency probe: sends numbered test notes out of the output
+// and times their return on inputs connected back to it, by a DIN
+// cable or an ALSA connection, to measure the round trip of each
+// input and output pair.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_LOOPBACK_H
+#define MIDICLORO_LOOPBACK_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "rtmidi/RtMidi.h"
+
+class LoopbackProbe {
+ public:
+  // The note number and velocity of a probe tell which one it is, so there are at most this many
+  static const int MAX_PROBES = 128*127;
+
+  // count notes interval ns apart, on channel 0-15
+  LoopbackProbe(int channel, int count, long long interval);
+  // Send the probes to out and time them on each input in ins that isn't null,
+  // until all came back, a second after the last one, or stop is set
+  void run(RtMidiOut *out, RtMidiIn *ins[4], const bool *stop);
+  // Round trip distribution of each input that was listened to
+  void report(std::ostream &out, const std::string inputNames[4], const std::string &outputName);
+
+ private:
+  struct Input {
+    bool listened;
+    std::vector<long long> roundTrips; // ns, in the order the probes came back
+    std::vector<bool> back; // By probe
+    unsigned int duplicates;
+  };
+  void sendProbe(RtMidiOut *out, int probe);
+  void receive(int input, const RtMidiMessage &message, long long now);
+  bool allBack() const;
+
+  int channel;
+  int count;
+  long long interval;
+  int sent;
+  std::vector<long long> sendTimes; // By probe
+  Input inputs[4];
+  std::vector<unsigned char> message;
+};
+
+#endif
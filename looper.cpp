@@ -0,0 +1,233 @@
+//************** MIDIcloro **************
+//
+// Looper
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <cstring>
+#include <algorithm>
+#include "looper.h"
+#include "timeutil.h"
+
+using namespace std;
+
+Looper::Looper(int capacity, int bars)
+  : timeline(16*max(capacity, 1)), capacity(max(capacity, 1)), running(true), tick(-1),
+    lastTickTime(0), clockInterval(0) {
+  for (int i=0; i<16; i++) {
+    Loop *loop = &loops[i];
+    loop->state = EMPTY;
+    loop->bars = max(bars, 1);
+    loop->start = 0;
+    loop->length = (long long)loop->bars*TICKS_PER_BAR*STEPS_PER_TICK;
+    loop->events = &timeline[i*this->capacity];
+    loop->count = 0;
+    loop->cursor = 0;
+    loop->lastPos = -1;
+    memset(loop->notesOn, 0, sizeof(loop->notesOn));
+    memset(loop->recordedOn, 0, sizeof(loop->recordedOn));
+    loop->release = false;
+  }
+}
+
+void Looper::control(int channel, int value) {
+  Loop *loop = &loops[channel & 0x0F];
+  if (value == 0) {
+    loop->state = EMPTY;
+    loop->count = 0;
+    loop->release = true;
+  }
+  else if (value < 64) {
+    loop->bars = value;
+    if (loop->state == EMPTY || loop->state == ARMED)
+      loop->length = (long long)loop->bars*TICKS_PER_BAR*STEPS_PER_TICK;
+  }
+  else {
+    switch (loop->state) {
+      case EMPTY:
+        loop->length = (long long)loop->bars*TICKS_PER_BAR*STEPS_PER_TICK;
+        loop->state = ARMED;
+        break;
+      case ARMED:
+        loop->state = EMPTY;
+        break;
+      case RECORDING: {
+        // Close the loop early, rounded up to whole bars
+        long long barLength = TICKS_PER_BAR*STEPS_PER_TICK;
+        long long recorded = max(position(monotonicNanos()) - loop->start, 1LL);
+        loop->length = min(loop->length, (recorded + barLength - 1)/barLength*barLength);
+        loop->state = PLAYING;
+        break;
+      }
+      case PLAYING:
+        loop->state = OVERDUB;
+        break;
+      case OVERDUB:
+        loop->state = PLAYING;
+        break;
+    }
+  }
+}
+
+void Looper::clockTick(long long tickTime, long long clockInterval) {
+  tick++;
+  lastTickTime = tickTime;
+  this->clockInterval = clockInterval;
+  if (!running)
+    return;
+  long long step = tick*STEPS_PER_TICK;
+  for (int i=0; i<16; i++) {
+    Loop *loop = &loops[i];
+    if (loop->state == ARMED && tick % TICKS_PER_BAR == 0) {
+      loop->state = RECORDING;
+      loop->start = step;
+      loop->count = 0;
+      loop->cursor = 0;
+      loop->lastPos = -1;
+      memset(loop->recordedOn, 0, sizeof(loop->recordedOn));
+    }
+    else if (loop->state == RECORDING && step >= loop->start + loop->length) {
+      loop->state = PLAYING;
+    }
+  }
+}
+
+void Looper::start() {
+  resume(0);
+}
+
+void Looper::resume(long long clocks) {
+  // The step the next tick would have had, which becomes the step of the song position
+  long long restart = (tick + 1 - clocks)*STEPS_PER_TICK;
+  bool wasRunning = running;
+  running = true;
+  tick = clocks - 1;
+  // The first tick after start is the first step of every loop that is playing or waiting.
+  // A start while running leaves a loop being recorded going on from where it is, moved onto the new count.
+  for (int i=0; i<16; i++) {
+    Loop *loop = &loops[i];
+    if (wasRunning && (loop->state == RECORDING || loop->state == OVERDUB)) {
+      loop->start -= restart;
+      continue;
+    }
+    loop->start = 0;
+    loop->cursor = 0;
+    loop->lastPos = -1;
+    // Continued in the middle of a loop: the events before the song position wait for the next pass
+    if (clocks > 0 && loop->length > 0) {
+      long long phase = clocks*STEPS_PER_TICK % loop->length;
+      while (loop->cursor < loop->count && loop->events[loop->cursor].step < phase)
+        loop->cursor++;
+      loop->lastPos = phase - 1;
+    }
+  }
+}
+
+void Looper::stop() {
+  running = false;
+  for (int i=0; i<16; i++) {
+    if (loops[i].state == RECORDING)
+      loops[i].state = PLAYING;
+    loops[i].release = true;
+  }
+}
+
+void Looper::record(const unsigned char *bytes, size_t nBytes) {
+  unsigned char type = bytes[0] & 0xF0;
+  if (nBytes != 3 || (type != 0x80 && type != 0x90 && type != 0xB0))
+    return;
+  Loop *loop = &loops[bytes[0] & 0x0F];
+  bool noteOn = type == 0x90 && bytes[2] > 0;
+  bool noteOff = type == 0x80 || (type == 0x90 && bytes[2] == 0);
+
+  if (loop->state == RECORDING) {
+    if (loop->count >= capacity)
+      return;
+    long long step = min(max(position(monotonicNanos()) - loop->start, 0LL), loop->length - 1);
+    Event *event = &loop->events[loop->count++];
+    event->step = step;
+    memcpy(event->bytes, bytes, 3);
+    event->size = 3;
+  }
+  // Notes still held when recording ended get their note off in the loop too
+  else if (loop->state == OVERDUB || (loop->state == PLAYING && noteOff && loop->recordedOn[bytes[1] & 0x7F])) {
+    insert(loop, max(loop->lastPos, 0LL), bytes, nBytes);
+  }
+  else
+    return;
+  if (noteOn || noteOff)
+    loop->recordedOn[bytes[1] & 0x7F] = noteOn;
+}
+
+void Looper::insert(Loop *loop, long long step, const unsigned char *bytes, size_t nBytes) {
+  // Goes in just before the cursor at the position last played, so it's not played again
+  // until the next pass and the timeline stays in order
+  if (loop->count >= capacity)
+    return;
+  Event *at = &loop->events[loop->cursor];
+  memmove(at + 1, at, (loop->count - loop->cursor)*sizeof(Event));
+  at->step = step;
+  memcpy(at->bytes, bytes, nBytes);
+  at->size = nBytes;
+  loop->count++;
+  loop->cursor++;
+}
+
+long long Looper::position(long long now) const {
+  long long step = tick*STEPS_PER_TICK;
+  if (clockInterval > 0 && now > lastTickTime)
+    step += min((now - lastTickTime)*STEPS_PER_TICK/clockInterval, (long long)STEPS_PER_TICK - 1);
+  return step;
+}
+
+void Looper::emit(Loop *loop, const Event &event, vector<unsigned char> *message) {
+  message->assign(event.bytes, event.bytes + event.size);
+  unsigned char type = event.bytes[0] & 0xF0;
+  if (type == 0x90 || type == 0x80)
+    loop->notesOn[event.bytes[1] & 0x7F] = type == 0x90 && event.bytes[2] > 0;
+}
+
+bool Looper::nextDue(long long now, vector<unsigned char> *message) {
+  for (int i=0; i<16; i++) {
+    Loop *loop = &loops[i];
+    if (!loop->release)
+      continue;
+    bool *note = find(loop->notesOn, loop->notesOn + 128, true);
+    if (note != loop->notesOn + 128) {
+      *note = false;
+      message->resize(3);
+      (*message)[0] = 0x80 + i;
+      (*message)[1] = note - loop->notesOn;
+      (*message)[2] = 0;
+      return true;
+    }
+    loop->release = false;
+  }
+  if (!running || tick < 0)
+    return false;
+
+  long long pos = position(now);
+  for (int i=0; i<16; i++) {
+    Loop *loop = &loops[i];
+    if ((loop->state != PLAYING && loop->state != OVERDUB) || pos < loop->start)
+      continue;
+    long long loopPos = (pos - loop->start) % loop->length;
+    if (loopPos < loop->lastPos) {
+      // Wrapped around, finish the end of the loop first
+      if (loop->cursor < loop->count) {
+        emit(loop, loop->events[loop->cursor++], message);
+        return true;
+      }
+      loop->cursor = 0;
+      loop->lastPos = -1;
+    }
+    if (loop->cursor < loop->count && loop->events[loop->cursor].step <= loopPos) {
+      emit(loop, loop->events[loop->cursor++], message);
+      return true;
+    }
+    loop->lastPos = loopPos;
+  }
+  return false;
+}
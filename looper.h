@@ -0,0 +1,84 @@
+//************** MIDIcloro **************
+//
+// Looper: one loop per MIDI channel, recording N bars of notes and
+// CCs and playing them back locked to the clock. All events live in
+// one timeline allocated up front, so recording, overdubbing and
+// playing never allocate memory.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_LOOPER_H
+#define MIDICLORO_LOOPER_H
+
+#include <cstddef>
+#include <vector>
+
+class Looper {
+ public:
+  enum State {
+    EMPTY,
+    ARMED, // Waiting for the next bar to start recording
+    RECORDING,
+    PLAYING,
+    OVERDUB
+  };
+
+  // capacity is the number of events each loop can hold
+  Looper(int capacity, int bars);
+  // Loop MIDI CC: 0 clears the loop, 1-63 sets the length in bars, 64-127 steps through
+  // empty -> armed -> recording -> playing <-> overdub
+  void control(int channel, int value);
+  State getState(int channel) const { return loops[channel].state; }
+  // Called for every clock tick sent, with the time it was sent and the current clock interval in ns
+  void clockTick(long long tickTime, long long clockInterval);
+  // Transport start realigns the loops to the first bar, stop pauses them
+  void start();
+  // Transport continue realigns them to the song position, in clock ticks from the start
+  void resume(long long clocks);
+  void stop();
+  // Offer a message sent to the output, it's kept if its channel is recording
+  void record(const unsigned char *bytes, size_t nBytes);
+  // Fetch the next message due at the time now, note offs for stopped loops come first.
+  // Returns false when nothing is due.
+  bool nextDue(long long now, std::vector<unsigned char> *message);
+
+ private:
+  // One step is a 16th of a clock tick, 384 PPQN
+  static const int STEPS_PER_TICK = 16;
+  static const int TICKS_PER_BAR = 96;
+
+  struct Event {
+    unsigned int step; // Position in the loop
+    unsigned char bytes[3];
+    unsigned char size;
+  };
+  struct Loop {
+    State state;
+    int bars;
+    long long start; // Step where the loop began
+    long long length; // In steps
+    Event *events;
+    unsigned int count;
+    unsigned int cursor; // Next event to play
+    long long lastPos; // Loop position played up to
+    bool notesOn[128]; // Notes played by the loop
+    bool recordedOn[128]; // Notes recorded without their note off yet
+    bool release; // End the notes the loop left playing
+  };
+
+  long long position(long long now) const;
+  void insert(Loop *loop, long long step, const unsigned char *bytes, size_t nBytes);
+  void emit(Loop *loop, const Event &event, std::vector<unsigned char> *message);
+
+  std::vector<Event> timeline;
+  Loop loops[16];
+  unsigned int capacity;
+  bool running;
+  long long tick;
+  long long lastTickTime;
+  long long clockInterval;
+};
+
+#endif
@@ -0,0 +1,205 @@
+//************** MIDIcloro **************
+//
+// Metrics export
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "metrics.h"
+#include "timeutil.h"
+
+using namespace std;
+
+const char *MESSAGE_CLASS_NAMES[MESSAGE_CLASSES] = {
+  "note", "cc", "program", "pitchbend", "aftertouch", "sysex", "realtime", "other"
+};
+
+// Longest the exporter thread sleeps before checking whether it should stop
+const int STOP_POLL_MS = 100;
+
+void writeMetricHeader(ostream &out, const char *name, const char *type, const char *help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+string metricLabel(const string &value) {
+  string escaped;
+  for (size_t i=0; i<value.size(); i++) {
+    if (value[i] == '\\' || value[i] == '"')
+      escaped += '\\';
+    if (value[i] == '\n')
+      escaped += "\\n";
+    else
+      escaped += value[i];
+  }
+  return escaped;
+}
+
+void writeCpuMetrics(ostream &out) {
+  double ticksPerSecond = sysconf(_SC_CLK_TCK);
+  writeMetricHeader(out, "midicloro_thread_cpu_seconds_total", "counter", "CPU time of each thread, by mode.");
+  DIR *d = opendir("/proc/self/task");
+  if (d) {
+    struct dirent *entry;
+    while ((entry = readdir(d)) != 0) {
+      if (entry->d_name[0] == '.')
+        continue;
+      ifstream stat((string("/proc/self/task/") + entry->d_name + "/stat").c_str());
+      string line;
+      if (!getline(stat, line))
+        continue;
+      // The thread name is in parentheses and may hold spaces, the fields after it are numbers
+      size_t open = line.find('('), close = line.rfind(')');
+      if (open == string::npos || close == string::npos || close < open)
+        continue;
+      string name = line.substr(open + 1, close - open - 1);
+      istringstream fields(line.substr(close + 2));
+      string field;
+      unsigned long long utime = 0, stime = 0;
+      // utime and stime are fields 14 and 15, the state after the name is field 3
+      for (int i=3; i<=15 && fields >> field; i++) {
+        if (i == 14) utime = strtoull(field.c_str(), 0, 10);
+        if (i == 15) stime = strtoull(field.c_str(), 0, 10);
+      }
+      string labels = string("{tid=\"") + entry->d_name + "\",thread=\"" + metricLabel(name) + "\",mode=\"";
+      out << "midicloro_thread_cpu_seconds_total" << labels << "user\"} " << utime/ticksPerSecond << "\n";
+      out << "midicloro_thread_cpu_seconds_total" << labels << "system\"} " << stime/ticksPerSecond << "\n";
+    }
+    closedir(d);
+  }
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return;
+  writeMetricHeader(out, "midicloro_process_cpu_seconds_total", "counter", "CPU time of the whole process, by mode.");
+  out << "midicloro_process_cpu_seconds_total{mode=\"user\"} " << usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1000000.0 << "\n";
+  out << "midicloro_process_cpu_seconds_total{mode=\"system\"} " << usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1000000.0 << "\n";
+  writeMetricHeader(out, "midicloro_context_switches_total", "counter", "Context switches of the process.");
+  out << "midicloro_context_switches_total{kind=\"voluntary\"} " << usage.ru_nvcsw << "\n";
+  out << "midicloro_context_switches_total{kind=\"involuntary\"} " << usage.ru_nivcsw << "\n";
+}
+
+MetricsExporter::MetricsExporter(const string &file, const string &socketPath, long long interval, WriteMetrics write)
+  : file(file), socketPath(socketPath), interval(max(interval, 1000000LL)), write(write), listenFd(-1),
+    threadStarted(false), stopRequested(false) {
+  if (!socketPath.empty() && !openSocket())
+    cerr << "Couldn't open metrics socket: " << socketPath << endl;
+  if (file.empty() && listenFd < 0)
+    return;
+  if (pthread_create(&thread, 0, exporterThread, this) != 0)
+    cerr << "Couldn't start the metrics thread, metrics disabled" << endl;
+  else
+    threadStarted = true;
+}
+
+MetricsExporter::~MetricsExporter() {
+  if (threadStarted) {
+    __atomic_store_n(&stopRequested, true, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+  }
+  if (listenFd >= 0) {
+    close(listenFd);
+    unlink(socketPath.c_str());
+  }
+}
+
+bool MetricsExporter::openSocket() {
+  struct sockaddr_un address;
+  if (socketPath.size() >= sizeof(address.sun_path))
+    return false;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socketPath.c_str());
+  listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenFd < 0)
+    return false;
+  // A socket left behind by a previous run would make bind fail
+  unlink(socketPath.c_str());
+  if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, 4) != 0) {
+    close(listenFd);
+    listenFd = -1;
+    return false;
+  }
+  return true;
+}
+
+void *MetricsExporter::exporterThread(void *exporter) {
+  ((MetricsExporter *)exporter)->run();
+  return 0;
+}
+
+void MetricsExporter::run() {
+  // Named so the thread can be told apart in its own CPU metrics, and kept out of the way of the MIDI threads
+  prctl(PR_SET_NAME, "cloro-metrics");
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  long long nextWrite = monotonicNanos();
+  while (!__atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE)) {
+    long long now = monotonicNanos();
+    if (!file.empty() && now >= nextWrite) {
+      writeFile();
+      nextWrite = now + interval;
+    }
+    int timeout = STOP_POLL_MS;
+    if (!file.empty())
+      timeout = min((long long)timeout, (nextWrite - now)/1000000 + 1);
+    if (listenFd < 0) {
+      struct timespec wait = {0, timeout*1000000L};
+      nanosleep(&wait, 0);
+      continue;
+    }
+    struct pollfd pfd = {listenFd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+      serveClient();
+  }
+}
+
+void MetricsExporter::writeFile() {
+  // Written next to the file and renamed over it, so a reader never sees half an export
+  string tmpPath = file + ".tmp";
+  {
+    ofstream out(tmpPath.c_str());
+    if (!out)
+      return;
+    write(out);
+    if (!out)
+      return;
+  }
+  rename(tmpPath.c_str(), file.c_str());
+}
+
+void MetricsExporter::serveClient() {
+  int fd = accept4(listenFd, 0, 0, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  // A client that doesn't read mustn't hold up the file exports
+  struct timeval sendTimeout = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+  // Each connection gets one export and is closed, like a scrape
+  ostringstream out;
+  write(out);
+  string text = out.str();
+  size_t sent = 0;
+  while (sent < text.size()) {
+    ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  close(fd);
+}
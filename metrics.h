@@ -0,0 +1,85 @@
+//************** MIDIcloro **************
+//
+// Metrics export: counters and gauges in the Prometheus text format,
+// rewritten to a file at an interval and/or served to every client
+// that connects to a Unix socket. The text is produced by a function
+// given by the program and run on a background thread, so the MIDI
+// threads only bump counters and never wait for an export.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_METRICS_H
+#define MIDICLORO_METRICS_H
+
+#include <ostream>
+#include <string>
+#include <pthread.h>
+
+// Message classes counted in the metrics, by status byte
+enum MessageClass {
+  MSG_NOTE, MSG_CC, MSG_PROGRAM, MSG_PITCH_BEND, MSG_AFTERTOUCH, MSG_SYSEX, MSG_REALTIME, MSG_OTHER,
+  MESSAGE_CLASSES
+};
+
+extern const char *MESSAGE_CLASS_NAMES[MESSAGE_CLASSES];
+
+inline int messageClass(unsigned char status) {
+  // Data bytes start streamed sysex chunks
+  if (status < 0x80 || status == 0xF0 || status == 0xF7)
+    return MSG_SYSEX;
+  if (status >= 0xF8)
+    return MSG_REALTIME;
+  switch (status & 0xF0) {
+    case 0x80: case 0x90: return MSG_NOTE;
+    case 0xA0: case 0xD0: return MSG_AFTERTOUCH;
+    case 0xB0: return MSG_CC;
+    case 0xC0: return MSG_PROGRAM;
+    case 0xE0: return MSG_PITCH_BEND;
+  }
+  return MSG_OTHER;
+}
+
+// Add one to a counter that only one thread writes, readable from the exporter thread
+inline void countMetric(unsigned long *counter) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+inline unsigned long readMetric(const unsigned long *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Start a metric family: the HELP and TYPE lines
+void writeMetricHeader(std::ostream &out, const char *name, const char *type, const char *help);
+// A label value with backslashes, quotes and newlines escaped
+std::string metricLabel(const std::string &value);
+// CPU time of each thread of the process from /proc, and of the whole process from getrusage
+void writeCpuMetrics(std::ostream &out);
+
+class MetricsExporter {
+ public:
+  typedef void (*WriteMetrics)(std::ostream &out);
+
+  // Leave file or socketPath empty to not use it, interval in ns applies to the file
+  MetricsExporter(const std::string &file, const std::string &socketPath, long long interval, WriteMetrics write);
+  ~MetricsExporter();
+
+ private:
+  static void *exporterThread(void *exporter);
+  void run();
+  bool openSocket();
+  void writeFile();
+  void serveClient();
+
+  std::string file;
+  std::string socketPath;
+  long long interval;
+  WriteMetrics write;
+  int listenFd;
+  pthread_t thread;
+  bool threadStarted;
+  bool stopRequested;
+};
+
+#endif
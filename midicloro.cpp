@@ -6,7 +6,7 @@
 // This project is licensed under the terms of the MIT license
 //
 // Run:
-// ./midicloro [-c to start interactive configuration]
+// ./midicloro [-c to start interactive configuration] [-s file.syx to send a sysex file] [-f file.mid to play a MIDI file]
 //
 //***************************************
 
@@ -20,12 +20,25 @@
 #include <map>
 #include <signal.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <boost/utility/binary.hpp>
-#include <boost/circular_buffer.hpp>
 #include <boost/program_options.hpp>
 #include <boost/regex.hpp>
-#include <boost/random.hpp>
 #include "rtmidi/RtMidi.h"
+#include "sysexfile.h"
+#include "smf.h"
+#include "recorder.h"
+#include "looper.h"
+#include "engine.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "loopback.h"
+#include "clock.h"
+#include "trace.h"
+#include "probes.h"
+#include "timeutil.h"
 
 using namespace std;
 
@@ -38,100 +51,79 @@ namespace convert {
     }
 }
 
-enum Chord {
-  CHORD_OFF = 0,
-  MINOR3,
-  MAJOR3,
-  MINOR3_LO,
-  MAJOR3_LO,
-  MINOR2,
-  MAJOR2,
-  M7,
-  MAJ7,
-  M9,
-  MAJ9,
-  SUS4,
-  POWER2,
-  POWER3,
-  OCTAVE2,
-  OCTAVE3
-};
-
-enum Velo {
-  VEL_OFF,
-  VEL_ON,
-  VEL_RDM
-};
-
 RtMidiIn *midiin1 = 0;
 RtMidiIn *midiin2 = 0;
 RtMidiIn *midiin3 = 0;
 RtMidiIn *midiin4 = 0;
-RtMidiOut *midiout = 0;
+// Output 1 and up to three more, each gets everything sent to the output
+RtMidiOut *midiouts[4] = {0, 0, 0, 0};
 bool done;
-bool enableClock;
 bool resetClock;
-bool ignoreProgramChanges;
-int tempoMidiCC;
-int chordMidiCC;
-int routeMidiCC;
-int startMidiCC;
-int stopMidiCC;
-int velocityMidiCC;
-int bpmOffsetForMidiCC;
-long clockInterval; // Clock interval in ns
-long tapTempoMinInterval; // Tap-tempo min interval in ns
-long tapTempoMaxInterval; // Tap-tempo max interval in ns
-int velocityRandomOffset;
-bool velocityMultiDeviceCtrl;
-boost::mt19937 *randomGenerator;
+bool streamSysex;
+int sysexSource = -1; // Input currently streaming sysex to the output, -1 if none
+const int SYSEX_PLAYER_SOURCE = 4; // sysexSource while the sysex player is mid-message
+const int SMF_PLAYER_SOURCE = 5; // Source of the MIDI file events, and sysexSource while the file is mid-sysex
+long long sysexTimeout; // How long an input may hold the output mid-sysex without sending more, ns
+long long sysexLastChunk; // When the input holding the output last sent a chunk
+bool sysexAbandoned[4] = {false, false, false, false}; // The rest of this input's dump is dropped
+vector<unsigned char> sysexEnd(1, 0xF7);
+unsigned long sysexTimeouts = 0;
+SysexRecorder *sysexRecorder = 0;
+SysexPlayer *sysexPlayer = 0;
+SmfReader *smfReader = 0;
+SmfPlayer *smfPlayer = 0;
+int smfSource; // Input whose settings apply to the MIDI file
+MidiRecorder *midiRecorder = 0;
+bool recordInputs;
+Looper *looper = 0;
+MidiEngine *engine = 0;
 vector<unsigned char> *clockMessage;
-vector<unsigned char> *clockStartMessage;
-vector<unsigned char> *clockStopMessage;
-vector<unsigned char> *noteOffMessage;
-int lastNote[4][16] = {{-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}};
-int channelRouting[4][16] = {{0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15},
-                             {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15},
-                             {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15},
-                             {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15}};
-int chordModes[4][16] = {{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-                         {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-                         {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-                         {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}};
-int velocityModes[4][16] = {{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-                            {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-                            {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-                            {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}};
-int velocity[4][16] = {{100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100},
-                       {100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100},
-                       {100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100},
-                       {100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100}};
-bool mono[4] = {false,false,false,false};
-bool monoLegato[4][16] = {{false,false,false,false,false,false,false,false,false,false,false,false,false,false,false,false},
-                          {false,false,false,false,false,false,false,false,false,false,false,false,false,false,false,false},
-                          {false,false,false,false,false,false,false,false,false,false,false,false,false,false,false,false},
-                          {false,false,false,false,false,false,false,false,false,false,false,false,false,false,false,false}};
-boost::circular_buffer<struct timespec> *tapTempoTimes;
+ClockGenerator clockGenerator; // Clock of every output, at its own rate
+long long lastClockSent; // When the previous batch of clock ticks was sent
+SongPosition songPosition;
+TimecodeGenerator timecode;
+bool sendTimecode = false;
+bool timecodeHeld = false; // Quarter frames were dropped during a sysex dump, a full frame is owed
+// Transport and time code messages, allocated once so sending them doesn't allocate
+vector<unsigned char> quarterFrameMessage(2, 0xF1);
+vector<unsigned char> transportMessage(1);
+vector<unsigned char> songPositionMessage(3);
+vector<unsigned char> fullFrameMessage(10);
+int transportQuantum = 0; // Sub-ticks start and stop wait for the boundary of, 0 to send them right away
+unsigned char pendingTransport = 0; // Start, continue or stop waiting for its boundary, 0 if none
+long long pendingTransportAt; // Sub-tick of the boundary, -1 while a sysex dump holds the output
+// Latency from arriving at an input to leaving the output port, time in the input queue,
+// and how far the clock tick periods are from the clock interval. All recorded by the main loop.
+Histogram inputLatency[4];
+Histogram queueDwell[4];
+Histogram clockError;
+int latencySource = -1; // Input of the message being handled, -1 when not from an input
+long long latencyArrival;
+// Message counts for the metrics, by message class, written by the main loop only
+MetricsExporter *metricsExporter = 0;
+unsigned long messagesIn[4][MESSAGE_CLASSES];
+unsigned long messagesOut[4][MESSAGE_CLASSES];
+string inputPorts[4];
+string outputPorts[4];
+// Heartbeats the stall watchdog checks, written by the main loop only
+enum WatchedActivity { WATCH_MAIN, WATCH_CLOCK, WATCH_INPUTS };
+StallWatchdog *stallWatchdog = 0;
+int mainThreadId;
+long long loopHeartbeat = 0; // Last pass of the main loop
+long long clockDue = 0; // When the next batch of clock ticks is due
 const char *CONFIG_FILE = "midicloro.cfg";
 
 void usage(void);
 static void finish( int /*ignore*/ ){ done = true; }
-double random01();
-bool ignoreMessage(unsigned char msgByte);
-void transposeAndSend(vector<unsigned char> *message, int semiNotes);
-void sendNoteOrChord(vector<unsigned char> *message, int source);
-void sendNoteOffAndNote(vector<unsigned char> *message, int source);
-void setChordMode(int source, int channel, int value);
-void routeChannel(vector<unsigned char> *message, int source);
-void setChannelRouting(int source, int channel, int newChannel);
-void applyVelocity(vector<unsigned char> *message, int source);
-void setVelocityMode(int source, int channel, int value);
-void setVelocityModeMulti(int source, int channel, int value);
-int scaleUp(int value);
-long tapTempo();
+void writeOut(vector<unsigned char> *message);
+void sendOut(vector<unsigned char> *message);
+void sendClockIfDue();
+void requestTransport(unsigned char status);
+long long transportBoundary(unsigned char status);
+void sendTransport(unsigned char status, long long time);
+void startTransport();
+void continueTransport();
+void stopTransport();
 void handleMessage(vector<unsigned char> *message, int source);
 void messageAtIn1(double deltatime, vector<unsigned char> *message, void */*userData*/);
 void messageAtIn2(double deltatime, vector<unsigned char> *message, void */*userData*/);
@@ -139,48 +131,124 @@ void messageAtIn3(double deltatime, vector<unsigned char> *message, void */*user
 void messageAtIn4(double deltatime, vector<unsigned char> *message, void */*userData*/);
 string trimPort(bool doTrim, const string& str);
 bool openInputPort(RtMidiIn *in, string port);
-bool openOutputPort(RtMidiIn *in, string port);
+bool openOutputPort(RtMidiOut *out, string port);
 bool openPorts(string i1, string i2, string i3, string i4, string o);
 void cleanUp();
+void printLatencies();
+void writeMetrics(ostream &out);
+long long stallOverdue(int activity, long long now, int *tid);
 void runInteractiveConfiguration();
 
+// Takes what the engine sends to the output port, and lets it control the clock, transport and looper
+class OutputSink : public MidiSink {
+ public:
+  void send(vector<unsigned char> *message) {
+    // Start, continue and stop carry the song position and the time code along
+    if ((*message)[0] == 0xFA || (*message)[0] == 0xFB || (*message)[0] == 0xFC)
+      requestTransport((*message)[0]);
+    else {
+      // A song position from an input moves ours too, while stopped as the receivers do
+      if ((*message)[0] == 0xF2 && message->size() == 3 && !songPosition.isRunning())
+        songPosition.locate((*message)[1] | ((*message)[2] << 7));
+      sendOut(message);
+    }
+  }
+  // A start waiting for its boundary lands on the running grid, so it doesn't restart the clock.
+  // Waiting transport changes start and stop the file and the loops when they go out.
+  void restartClock() { if (pendingTransport != 0xFA) resetClock = true; }
+  void transportStart() { if (!pendingTransport) startTransport(); }
+  void transportStop() { if (!pendingTransport) stopTransport(); }
+  void loopControl(int channel, int value) { looper->control(channel, value); }
+} outputSink;
+
+class SystemTime : public MidiTime {
+ public:
+  long long now() { return monotonicNanos(); }
+} systemTime;
+
 int main(int argc, char *argv[]) {
   try {
-    if (argc == 2 && string(argv[1]) == "-c")
-      runInteractiveConfiguration();
-    else if (argc > 1)
-      usage();
+    string sysexFile, smfFile;
+    bool probeMode = false;
+    for (int i=1; i<argc; i++) {
+      if (argc == 2 && string(argv[i]) == "-c")
+        runInteractiveConfiguration();
+      else if (string(argv[i]) == "-p")
+        probeMode = true;
+      else if (i+1 < argc && string(argv[i]) == "-s")
+        sysexFile = argv[++i];
+      else if (i+1 < argc && string(argv[i]) == "-f")
+        smfFile = argv[++i];
+      else
+        usage();
+    }
 
     // Handle configuration
     string input1, input2, input3, input4, output;
-    bool input1mono, input2mono, input3mono, input4mono;
-    int initialBpm, tapTempoMinBpm, tapTempoMaxBpm;
+    string extraOutputs[4];
+    int outputLatencyUs[4];
+    int outputClockPpqn[4];
+    EngineConfig engineConfig;
+    string sysexRecordDir;
+    int sysexChunkSize, sysexMessageDelay;
+    int sysexTimeoutMs;
+    int smfInput;
+    string recordDir;
+    int recordRotateMinutes;
+    int loopBars, loopEvents;
+    string metricsFile, metricsSocket;
+    int metricsInterval;
+    string traceDir;
+    int traceThresholdUs;
+    string mtcFrameRate;
+    int transportQuantizeBeats;
+    int tempoGlideBeats;
+    int stallThresholdMs;
+    int probeInput, probeChannel, probeCount, probeIntervalMs;
 
     po::options_description desc("Options");
     desc.add_options()
       ("input1", po::value<string>(&input1), "input1")
-      ("input1mono", po::value<bool>(&input1mono)->default_value(false), "input1mono")
       ("input2", po::value<string>(&input2), "input2")
-      ("input2mono", po::value<bool>(&input2mono)->default_value(false), "input2mono")
       ("input3", po::value<string>(&input3), "input3")
-      ("input3mono", po::value<bool>(&input3mono)->default_value(false), "input3mono")
       ("input4", po::value<string>(&input4), "input4")
-      ("input4mono", po::value<bool>(&input4mono)->default_value(false), "input4mono")
       ("output", po::value<string>(&output), "output")
-      ("enableClock", po::value<bool>(&enableClock)->default_value(true), "enableClock")
-      ("startMidiCC", po::value<int>(&startMidiCC)->default_value(13), "startMidiCC")
-      ("stopMidiCC", po::value<int>(&stopMidiCC)->default_value(14), "stopMidiCC")
-      ("ignoreProgramChanges", po::value<bool>(&ignoreProgramChanges)->default_value(false), "ignoreProgramChanges")
-      ("initialBpm", po::value<int>(&initialBpm)->default_value(142), "initialBpm")
-      ("tapTempoMinBpm", po::value<int>(&tapTempoMinBpm)->default_value(80), "tapTempoMinBpm")
-      ("tapTempoMaxBpm", po::value<int>(&tapTempoMaxBpm)->default_value(200), "tapTempoMaxBpm")
-      ("bpmOffsetForMidiCC", po::value<int>(&bpmOffsetForMidiCC)->default_value(70), "bpmOffsetForMidiCC")
-      ("velocityRandomOffset", po::value<int>(&velocityRandomOffset)->default_value(-40), "velocityRandomOffset")
-      ("velocityMultiDeviceCtrl", po::value<bool>(&velocityMultiDeviceCtrl)->default_value(true), "velocityMultiDeviceCtrl")
-      ("velocityMidiCC", po::value<int>(&velocityMidiCC)->default_value(7), "velocityMidiCC")
-      ("tempoMidiCC", po::value<int>(&tempoMidiCC)->default_value(10), "tempoMidiCC")
-      ("chordMidiCC", po::value<int>(&chordMidiCC)->default_value(11), "chordMidiCC")
-      ("routeMidiCC", po::value<int>(&routeMidiCC)->default_value(12), "routeMidiCC");
+      ("output2", po::value<string>(&extraOutputs[1]), "output2")
+      ("output3", po::value<string>(&extraOutputs[2]), "output3")
+      ("output4", po::value<string>(&extraOutputs[3]), "output4")
+      ("outputLatencyUs", po::value<int>(&outputLatencyUs[0])->default_value(0), "outputLatencyUs")
+      ("output2LatencyUs", po::value<int>(&outputLatencyUs[1])->default_value(0), "output2LatencyUs")
+      ("output3LatencyUs", po::value<int>(&outputLatencyUs[2])->default_value(0), "output3LatencyUs")
+      ("output4LatencyUs", po::value<int>(&outputLatencyUs[3])->default_value(0), "output4LatencyUs")
+      ("outputClockPpqn", po::value<int>(&outputClockPpqn[0])->default_value(24), "outputClockPpqn")
+      ("output2ClockPpqn", po::value<int>(&outputClockPpqn[1])->default_value(24), "output2ClockPpqn")
+      ("output3ClockPpqn", po::value<int>(&outputClockPpqn[2])->default_value(24), "output3ClockPpqn")
+      ("output4ClockPpqn", po::value<int>(&outputClockPpqn[3])->default_value(24), "output4ClockPpqn")
+      ("mtcFrameRate", po::value<string>(&mtcFrameRate), "mtcFrameRate")
+      ("transportQuantizeBeats", po::value<int>(&transportQuantizeBeats)->default_value(0), "transportQuantizeBeats")
+      ("tempoGlideBeats", po::value<int>(&tempoGlideBeats)->default_value(1), "tempoGlideBeats")
+      ("streamSysex", po::value<bool>(&streamSysex)->default_value(true), "streamSysex")
+      ("sysexRecordDir", po::value<string>(&sysexRecordDir), "sysexRecordDir")
+      ("sysexChunkSize", po::value<int>(&sysexChunkSize)->default_value(256), "sysexChunkSize")
+      ("sysexMessageDelay", po::value<int>(&sysexMessageDelay)->default_value(50), "sysexMessageDelay")
+      ("sysexTimeoutMs", po::value<int>(&sysexTimeoutMs)->default_value(1000), "sysexTimeoutMs")
+      ("smfInput", po::value<int>(&smfInput)->default_value(1), "smfInput")
+      ("recordDir", po::value<string>(&recordDir), "recordDir")
+      ("recordInputs", po::value<bool>(&recordInputs)->default_value(false), "recordInputs")
+      ("recordRotateMinutes", po::value<int>(&recordRotateMinutes)->default_value(0), "recordRotateMinutes")
+      ("loopBars", po::value<int>(&loopBars)->default_value(2), "loopBars")
+      ("loopEvents", po::value<int>(&loopEvents)->default_value(2048), "loopEvents")
+      ("metricsFile", po::value<string>(&metricsFile), "metricsFile")
+      ("metricsSocket", po::value<string>(&metricsSocket), "metricsSocket")
+      ("metricsInterval", po::value<int>(&metricsInterval)->default_value(10), "metricsInterval")
+      ("traceDir", po::value<string>(&traceDir), "traceDir")
+      ("traceThresholdUs", po::value<int>(&traceThresholdUs)->default_value(0), "traceThresholdUs")
+      ("stallThresholdMs", po::value<int>(&stallThresholdMs)->default_value(100), "stallThresholdMs")
+      ("probeInput", po::value<int>(&probeInput)->default_value(0), "probeInput")
+      ("probeChannel", po::value<int>(&probeChannel)->default_value(16), "probeChannel")
+      ("probeCount", po::value<int>(&probeCount)->default_value(1000), "probeCount")
+      ("probeIntervalMs", po::value<int>(&probeIntervalMs)->default_value(10), "probeIntervalMs");
+    addEngineOptions(&desc, &engineConfig);
     po::variables_map vm;
 
     ifstream file(CONFIG_FILE);
@@ -188,24 +256,21 @@ int main(int argc, char *argv[]) {
     po::notify(vm);
     file.close();
 
-    clockInterval = 60000000000/(initialBpm*24);
-    tapTempoMaxInterval = 60000000000/tapTempoMinBpm;
-    tapTempoMinInterval = 60000000000/tapTempoMaxBpm;
-
-    mono[0] = input1mono;
-    mono[1] = input2mono;
-    mono[2] = input3mono;
-    mono[3] = input4mono;
+    smfSource = min(max(smfInput, 1), 4) - 1;
 
-    struct timespec lastClock, now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    randomGenerator = new boost::mt19937(now.tv_nsec);
+    // The transformations, sending to the output port and timed by the system clock
+    engineConfig.randomSeed = monotonicNanos();
+    engine = new MidiEngine(engineConfig, &outputSink, &systemTime);
 
-    midiin1 = new RtMidiIn();
-    midiin2 = new RtMidiIn();
-    midiin3 = new RtMidiIn();
-    midiin4 = new RtMidiIn();
-    midiout = new RtMidiOut();
+    // Room for messages that wait while another input streams sysex
+    midiin1 = new RtMidiIn(RtMidi::UNSPECIFIED, "RtMidi Input Client", 1024);
+    midiin2 = new RtMidiIn(RtMidi::UNSPECIFIED, "RtMidi Input Client", 1024);
+    midiin3 = new RtMidiIn(RtMidi::UNSPECIFIED, "RtMidi Input Client", 1024);
+    midiin4 = new RtMidiIn(RtMidi::UNSPECIFIED, "RtMidi Input Client", 1024);
+    midiouts[0] = new RtMidiOut();
+    for (int o=1; o<4; o++)
+      if (!extraOutputs[o].empty())
+        midiouts[o] = new RtMidiOut();
 
     // Assign MIDI ports
     if (!openPorts(input1, input2, input3, input4, output)) {
@@ -213,34 +278,111 @@ int main(int argc, char *argv[]) {
       cleanUp();
       exit(0);
     }
+    for (int o=1; o<4; o++)
+      if (midiouts[o] && !openOutputPort(midiouts[o], extraOutputs[o])) {
+        delete midiouts[o];
+        midiouts[o] = 0;
+      }
+
+    // Latency compensation: faster outputs are delayed to sound together with the slowest
+    int slowestLatency = 0;
+    for (int o=0; o<4; o++)
+      if (midiouts[o])
+        slowestLatency = max(slowestLatency, outputLatencyUs[o]);
+    for (int o=0; o<4; o++) {
+      if (!midiouts[o] || slowestLatency - outputLatencyUs[o] <= 0)
+        continue;
+      cout << "Delaying output " << o+1 << " by " << slowestLatency - outputLatencyUs[o] << " us" << endl;
+      midiouts[o]->setOutputDelay((slowestLatency - outputLatencyUs[o])/1000000.0);
+    }
+
+    // Clock rate of each output
+    for (int o=0; o<4; o++) {
+      if (!clockGenerator.setPpqn(o, midiouts[o] ? outputClockPpqn[o] : 0)) {
+        cout << "Unsupported clock PPQN for output " << o+1 << ": " << outputClockPpqn[o]
+             << " (use a divisor of " << ClockGenerator::SUB_TICKS_PER_QUARTER << " or 0), using 24" << endl;
+        clockGenerator.setPpqn(o, 24);
+      }
+    }
+    clockGenerator.setGlide(tempoGlideBeats);
+    // Start and stop on the next beat or bar
+    transportQuantum = max(transportQuantizeBeats, 0)*ClockGenerator::SUB_TICKS_PER_QUARTER;
+    // MIDI Time Code while the transport runs
+    if (!mtcFrameRate.empty()) {
+      sendTimecode = timecode.setRate(mtcFrameRate);
+      if (!sendTimecode)
+        cout << "Unsupported MTC frame rate: " << mtcFrameRate << " (use 24, 25, 29.97 or 30), no MTC sent" << endl;
+    }
+
+    // Probe mode measures the round trip from the output back to the inputs instead of running
+    if (probeMode) {
+      RtMidiIn *inputs[4] = {midiin1, midiin2, midiin3, midiin4};
+      RtMidiIn *probed[4] = {0, 0, 0, 0};
+      for (int i=0; i<4; i++)
+        if (inputs[i]->isPortOpen() && (probeInput == 0 || probeInput == i+1))
+          probed[i] = inputs[i];
+      done = false;
+      (void) signal(SIGINT, finish);
+      // One output at a time, sent straight away so the latency compensation isn't measured
+      for (int o=0; o<4 && !done; o++) {
+        if (!midiouts[o])
+          continue;
+        midiouts[o]->setOutputDelay(0);
+        LoopbackProbe probe(probeChannel - 1, probeCount, probeIntervalMs*1000000LL);
+        cout << "Sending " << probeCount << " probe notes on channel " << probeChannel << " to output " << o+1 << ", "
+             << probeIntervalMs << " ms apart" << endl;
+        probe.run(midiouts[o], probed, &done);
+        probe.report(cout, inputPorts, outputPorts[o]);
+      }
+      cleanUp();
+      return 0;
+    }
+
+    sysexTimeout = max(sysexTimeoutMs, 1)*1000000LL;
+
+    // Sysex librarian
+    if (!sysexRecordDir.empty())
+      sysexRecorder = new SysexRecorder(sysexRecordDir);
+    if (!sysexFile.empty()) {
+      sysexPlayer = new SysexPlayer(sysexChunkSize, sysexMessageDelay*1000000LL);
+      if (!sysexPlayer->open(sysexFile)) {
+        delete sysexPlayer;
+        sysexPlayer = 0;
+      }
+    }
 
-    // Note off message
-    vector<unsigned char> offMsg;
-    offMsg.push_back(BOOST_BINARY(10000000));
-    offMsg.push_back(42);
-    offMsg.push_back(100);
-    noteOffMessage = &offMsg;
+    // Session recording
+    if (!recordDir.empty())
+      midiRecorder = new MidiRecorder(recordDir, recordRotateMinutes*60000000000LL);
+
+    // Looper, with the room for all loop events allocated here
+    looper = new Looper(loopEvents, loopBars);
+
+    // MIDI file playback, started and stopped with the clock
+    if (!smfFile.empty()) {
+      smfReader = new SmfReader();
+      if (smfReader->open(smfFile)) {
+        smfPlayer = new SmfPlayer(smfReader);
+        cout << "Playing MIDI file on start: " << smfFile << endl;
+      }
+      else {
+        delete smfReader;
+        smfReader = 0;
+      }
+    }
+
+    // Metrics, exported from their own thread once the ports are open
+    if (!metricsFile.empty() || !metricsSocket.empty())
+      metricsExporter = new MetricsExporter(metricsFile, metricsSocket, metricsInterval*1000000000LL, writeMetrics);
+
+    // Pipeline tracing, only in builds with tracing compiled in
+    traceStart(traceDir, traceThresholdUs*1000LL);
 
     // Clock messages
     vector<unsigned char> clkMsg;
     clkMsg.push_back(BOOST_BINARY(11111000));
     clockMessage = &clkMsg;
 
-    // Midi clock start
-    vector<unsigned char> clkStartMsg;
-    clkStartMsg.push_back(BOOST_BINARY(11111010));
-    clockStartMessage = &clkStartMsg;
-
-    // Midi clock stop
-    vector<unsigned char> clkStopMsg;
-    clkStopMsg.push_back(BOOST_BINARY(11111100));
-    clockStopMessage = &clkStopMsg;
-
-    // Tap-tempo
-    boost::circular_buffer<struct timespec> taps(4);
-    taps.push_front(now);
-    tapTempoTimes = &taps;
-
     map<int, RtMidiIn*> midiins;
     if (midiin1->isPortOpen()) midiins[0] = midiin1;
     if (midiin2->isPortOpen()) midiins[1] = midiin2;
@@ -250,23 +392,100 @@ int main(int argc, char *argv[]) {
     done = false;
     resetClock = false;
     (void) signal(SIGINT, finish);
-    std::vector<unsigned char> incomingMsg;
+    vector<RtMidiMessage> incomingMsgs;
+    vector<unsigned char> smfMsg;
+    vector<unsigned char> loopMsg;
+    unsigned int outputHeld = 0;
 
     cout << "Starting" << endl;
-    midiout->sendMessage(clockMessage);
-    clock_gettime(CLOCK_MONOTONIC, &lastClock);
+    // The first batch of clock ticks goes out right away
+    clockGenerator.restart(monotonicNanos());
+    sendClockIfDue();
+
+    // Stall watchdog for the main loop, the clock and the input threads
+    if (stallThresholdMs > 0) {
+      mainThreadId = syscall(SYS_gettid);
+      vector<string> activities;
+      activities.push_back("main loop");
+      activities.push_back("clock");
+      for (int i=0; i<4; i++)
+        activities.push_back("input " + convert::to_string(i+1));
+      stallWatchdog = new StallWatchdog(activities, stallOverdue, stallThresholdMs*1000000LL);
+    }
 
     while (!done) {
+      // An input that stopped in the middle of a dump, unplugged or with a truncated dump, gives the
+      // output back: the sysex is ended on the output and the rest of the dump is dropped
+      if (sysexSource >= 0 && sysexSource < SYSEX_PLAYER_SOURCE && monotonicNanos() - sysexLastChunk > sysexTimeout) {
+        writeOut(&sysexEnd);
+        sysexAbandoned[sysexSource] = true;
+        sysexSource = -1;
+        countMetric(&sysexTimeouts);
+      }
       for(map<int, RtMidiIn*>::iterator iter = midiins.begin(); iter != midiins.end(); ++iter) {
-        iter->second->getMessage(&incomingMsg);
-        if (incomingMsg.size() > 0) handleMessage(&incomingMsg, iter->first);
+        // While a sysex dump is streamed from one input, the others wait in their queues
+        if (sysexSource != -1 && sysexSource != iter->first)
+          continue;
+        // Take everything queued on this input in one go
+        unsigned int nMsgs = iter->second->getMessages(&incomingMsgs);
+        long long popped = monotonicNanos();
+        for (unsigned int i=0; i<nMsgs; i++) {
+          vector<unsigned char> *bytes = &incomingMsgs[i].bytes;
+          if (bytes->size() > 0)
+            countMetric(&messagesIn[iter->first][messageClass((*bytes)[0])]);
+          if (recordInputs && midiRecorder && bytes->size() > 0)
+            midiRecorder->record(iter->first + 1, &(*bytes)[0], bytes->size());
+          if (incomingMsgs[i].arrivalTime != 0) {
+            queueDwell[iter->first].record(popped - incomingMsgs[i].arrivalTime);
+            latencySource = iter->first;
+            latencyArrival = incomingMsgs[i].arrivalTime;
+            TRACE_AT(popped, TRACE_POP, iter->first, latencyArrival, bytes->empty() ? 0 : (*bytes)[0]);
+            TRACE_EVENT(latencyArrival, iter->first);
+          }
+          if (bytes->size() > 0) handleMessage(bytes, iter->first);
+          latencySource = -1;
+          TRACE_EVENT(0, TRACE_NO_PORT);
+          // Keep the clock going between the chunks of large sysex dumps
+          sendClockIfDue();
+        }
+      }
+      // Send the next chunk of the sysex file when the output is free and the pacing allows it
+      if (sysexPlayer && (sysexSource == -1 || sysexSource == SYSEX_PLAYER_SOURCE)) {
+        if (!sysexPlayer->poll(midiouts[0], monotonicNanos())) {
+          cout << "Sysex file sent" << endl;
+          delete sysexPlayer;
+          sysexPlayer = 0;
+          sysexSource = -1;
+        }
+        else
+          sysexSource = sysexPlayer->inMessage() ? SYSEX_PLAYER_SOURCE : -1;
       }
-      clock_gettime(CLOCK_MONOTONIC, &now);
-      if(resetClock || ((now.tv_nsec-lastClock.tv_nsec)+((now.tv_sec-lastClock.tv_sec)*1000000000)) >= clockInterval) {
-        midiout->sendMessage(clockMessage);
-        clock_gettime(CLOCK_MONOTONIC, &lastClock);
-        resetClock = false;
+      long long now = monotonicNanos();
+      // Play the MIDI file events that are due, as if they came from the smfInput input.
+      // A sysex the file splits in packets holds the output for the file, so the rest of it plays on.
+      if (smfPlayer && (sysexSource == -1 || sysexSource == SMF_PLAYER_SOURCE)) {
+        while (smfPlayer->nextDue(now, &smfMsg))
+          handleMessage(&smfMsg, SMF_PLAYER_SOURCE);
+        // A file that ended or was stopped in the middle of a sysex gives the output back
+        if (sysexSource == SMF_PLAYER_SOURCE && !smfPlayer->isRunning()) {
+          writeOut(&sysexEnd);
+          sysexSource = -1;
+        }
       }
+      // Play the loops, they were recorded after routing and chords so they go straight out
+      if (sysexSource == -1)
+        while (looper->nextDue(now, &loopMsg))
+          writeOut(&loopMsg);
+      // Pass on messages held back by a saturated output, never waits
+      unsigned int held = 0;
+      for (int o=0; o<4; o++)
+        if (midiouts[o])
+          held += midiouts[o]->flushOutput();
+      if (held != outputHeld) {
+        TRACE(TRACE_FLUSH, TRACE_NO_PORT, 0, min(held, 255u));
+        outputHeld = held;
+      }
+      sendClockIfDue();
     }
     cout << endl;
   }
@@ -283,319 +502,225 @@ int main(int argc, char *argv[]) {
 }
 
 void usage(void) {
-  cout << "Usage: ./midicloro [-c to start interactive configuration]" << endl;
+  cout << "Usage: ./midicloro [-c to start interactive configuration] [-s file.syx to send a sysex file] [-f file.mid to play a MIDI file] [-p to measure the loopback latency]" << endl;
   exit(0);
 }
 
-double random01() {
-  static boost::uniform_01<boost::mt19937> dist(*randomGenerator);
-  return dist();
-}
-
-bool ignoreMessage(unsigned char msgByte) {
-  if ((enableClock && (msgByte == BOOST_BINARY(11111000))) || // MIDI clock
-      (ignoreProgramChanges && ((msgByte & BOOST_BINARY(11110000)) == BOOST_BINARY(11000000)))) // Program change
-    return true;
-  return false;
-}
-
-void transposeAndSend(vector<unsigned char> *message, int semiNotes) {
-  // Verify that the note will end up withing the permitted range
-  int note = (int)(*message)[1] + semiNotes;
-  if (note >= 0 && note <= 127){
-    // This changes the message - keep in mind for the next note in the chord
-    (*message)[1] = note;
-    midiout->sendMessage(message);
+void writeOut(vector<unsigned char> *message) {
+  int messageClassOut = messageClass((*message)[0]);
+  for (int o=0; o<4; o++) {
+    if (midiouts[o]) {
+      midiouts[o]->sendMessage(message);
+      countMetric(&messagesOut[o][messageClassOut]);
+    }
+  }
+  if (latencySource >= 0) {
+    long long sent = monotonicNanos();
+    inputLatency[latencySource].record(sent - latencyArrival);
+    TRACE_AT(sent, TRACE_OUTPUT, latencySource, latencyArrival, (*message)[0]);
+    TRACE_LATENCY(sent - latencyArrival);
   }
+  if (midiRecorder)
+    midiRecorder->record(MidiRecorder::OUTPUT_STREAM, &(*message)[0], message->size());
 }
 
-void sendNoteOrChord(vector<unsigned char> *message, int source) {
-  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
-  // Handle chord mode
-  switch(chordModes[source][channel]) {
-    case CHORD_OFF:
-      midiout->sendMessage(message);
-      break;
-    case MINOR3:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 3);
-      transposeAndSend(message, 4);
-      break;
-    case MAJOR3:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 4);
-      transposeAndSend(message, 3);
-      break;
-    case MINOR3_LO:
-      transposeAndSend(message, -5);
-      transposeAndSend(message, 5);
-      transposeAndSend(message, 3);
-      break;
-    case MAJOR3_LO:
-      transposeAndSend(message, -5);
-      transposeAndSend(message, 5);
-      transposeAndSend(message, 4);
-      break;
-    case MINOR2:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 3);
-      break;
-    case MAJOR2:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 4);
-      break;
-    case M7:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 3);
-      transposeAndSend(message, 4);
-      transposeAndSend(message, 3);
-      break;
-    case MAJ7:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 4);
-      transposeAndSend(message, 3);
-      transposeAndSend(message, 4);
-      break;
-    case M9:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 3);
-      transposeAndSend(message, 4);
-      transposeAndSend(message, 3);
-      transposeAndSend(message, 4);
-      break;
-    case MAJ9:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 4);
-      transposeAndSend(message, 3);
-      transposeAndSend(message, 4);
-      transposeAndSend(message, 3);
-      break;
-    case SUS4:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 5);
-      transposeAndSend(message, 2);
-      break;
-    case POWER2:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 7);
-      break;
-    case POWER3:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 7);
-      transposeAndSend(message, 5);
-      break;
-    case OCTAVE2:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 12);
-      break;
-    case OCTAVE3:
-      midiout->sendMessage(message);
-      transposeAndSend(message, 12);
-      transposeAndSend(message, 12);
-      break;
-    default:
-      midiout->sendMessage(message);
-      break;
-  }
+void sendOut(vector<unsigned char> *message) {
+  writeOut(message);
+  looper->record(&(*message)[0], message->size());
 }
 
-void sendNoteOffAndNote(vector<unsigned char> *message, int source) {
-  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
-  bool thisIsNoteOn = ((*message)[0] & BOOST_BINARY(10010000)) == BOOST_BINARY(10010000);
-  if (!monoLegato[source][channel]) {
-    if (thisIsNoteOn && lastNote[source][channel] != -1) {
-      (*noteOffMessage)[0] = 128 + channel;
-      (*noteOffMessage)[1] = lastNote[source][channel];
-      sendNoteOrChord(noteOffMessage, source);
+void sendClockIfDue() {
+  long long now = monotonicNanos();
+  __atomic_store_n(&loopHeartbeat, now, __ATOMIC_RELAXED);
+  // Quarter frames aren't real-time messages and would end a sysex dump holding the output:
+  // they are dropped until it's done, then a full frame puts the receivers back on time
+  if (timecodeHeld && sysexSource == -1) {
+    if (timecode.isRunning()) {
+      timecode.fullFrameMessage(&fullFrameMessage);
+      writeOut(&fullFrameMessage);
     }
-    lastNote[source][channel] = thisIsNoteOn ? (*message)[1] : -1;
-    sendNoteOrChord(message, source);
+    timecodeHeld = false;
   }
-  else {
-    unsigned char currNote = (*message)[1];
-    sendNoteOrChord(message, source);
-    if (thisIsNoteOn && lastNote[source][channel] != -1) {
-      (*noteOffMessage)[0] = 128 + channel;
-      (*noteOffMessage)[1] = lastNote[source][channel];
-      sendNoteOrChord(noteOffMessage, source);
+  // MTC quarter frames are timed like the clock ticks, from the same pass of the main loop
+  if (sendTimecode && timecode.due(now, &quarterFrameMessage[1])) {
+    if (sysexSource != -1)
+      timecodeHeld = true;
+    else {
+      for (int o=0; o<4; o++) {
+        if (midiouts[o]) {
+          midiouts[o]->sendMessage(&quarterFrameMessage);
+          countMetric(&messagesOut[o][messageClass(0xF1)]);
+        }
+      }
     }
-    lastNote[source][channel] = thisIsNoteOn ? currNote : -1;
   }
-}
-
-
-void setChordMode(int source, int channel, int value) {
-  if (chordModes[source][channel] == 0 && value == 0)
-    monoLegato[source][channel] = !monoLegato[source][channel];
-
-  chordModes[source][channel] = value/8;
-}
+  long long clockInterval = engine->getClockInterval();
+  // A restarted clock ticks on every output right away
+  if (resetClock) {
+    clockGenerator.restart(now);
+    resetClock = false;
+  }
+  // A transport change kept from a sysex dump waits for the next boundary after it
+  if (pendingTransport && pendingTransportAt < 0 && sysexSource == -1)
+    pendingTransportAt = transportBoundary(pendingTransport);
+  ClockBatch batch;
+  if (!clockGenerator.due(now, clockInterval, &batch))
+    return;
 
-void routeChannel(vector<unsigned char> *message, int source) {
-  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
-  (*message)[0] = ((*message)[0] & BOOST_BINARY(11110000)) + channelRouting[source][channel];
-}
+  // A transport change waiting for this boundary goes out right ahead of its ticks,
+  // or with the first batch after a restart of the clock took the boundary away.
+  // Its song position and time code would corrupt a sysex dump holding the output, so it waits for that.
+  unsigned char transport = 0;
+  if (pendingTransport && pendingTransportAt >= 0 && (batch.subTick >= pendingTransportAt || batch.period == 0)) {
+    if (sysexSource != -1)
+      pendingTransportAt = -1;
+    else {
+      transport = pendingTransport;
+      pendingTransport = 0;
+      sendTransport(transport, batch.time);
+    }
+  }
+  // All outputs ticking at this instant, one after the other with nothing in between
+  for (int o=0; o<4; o++)
+    if ((batch.outputs & (1 << o)) && midiouts[o])
+      midiouts[o]->sendMessage(clockMessage);
+  long long sent = monotonicNanos();
+  for (int o=0; o<4; o++)
+    if ((batch.outputs & (1 << o)) && midiouts[o])
+      countMetric(&messagesOut[o][MSG_REALTIME]);
+  if (transport == 0xFA)
+    startTransport();
+  else if (transport == 0xFB)
+    continueTransport();
+  else if (transport == 0xFC)
+    stopTransport();
+  __atomic_store_n(&clockDue, clockGenerator.nextDue(), __ATOMIC_RELAXED);
+  // Period since the previous batch and the period it should have had in ns, a restarted batch has no period
+  PROBE3(clock_tick, sent - lastClockSent, batch.period, batch.period == 0);
+  if (batch.period != 0) {
+    long long error = sent - lastClockSent - batch.period;
+    clockError.record(error < 0 ? -error : error);
+  }
+  lastClockSent = sent;
 
-void setChannelRouting(int source, int channel, int newChannel) {
-  if (newChannel >= 0 && newChannel <= 127)
-    channelRouting[source][channel] = newChannel/8;
+  // The song position, the MIDI file and the loops follow the standard 24 PPQN clock
+  if (!batch.masterTick)
+    return;
+  songPosition.clockTick();
+  if (smfPlayer)
+    smfPlayer->clockTick(sent, clockGenerator.getInterval());
+  looper->clockTick(sent, clockGenerator.getInterval());
 }
 
-void applyVelocity(vector<unsigned char> *message, int source) {
-  int channel = (int)((*message)[0] & BOOST_BINARY(00001111));
-  if (velocityModes[source][channel] == VEL_OFF || message->size() < 3)
+void requestTransport(unsigned char status) {
+  if (transportQuantum == 0 && sysexSource == -1 && !pendingTransport) {
+    sendTransport(status, monotonicNanos());
+    // Start and stop of the file and the loops come from the engine, a continue has none
+    if (status == 0xFB)
+      continueTransport();
     return;
-
-  if (velocityModes[source][channel] == VEL_RDM) {
-    if (velocityRandomOffset < 0)
-      (*message)[2] = max(velocity[source][channel]+(int)(velocityRandomOffset*random01()), 1);
-    else if (velocityRandomOffset > 0)
-      (*message)[2] = min(velocity[source][channel]+(int)(velocityRandomOffset*random01()), 126) + 1;
-    else
-      (*message)[2] = max((int)(random01()*127), 1);
   }
-  else {
-    (*message)[2] = max(velocity[source][channel], 1);
+  // A stop takes back a start that hasn't gone out yet
+  if (status == 0xFC && pendingTransport == 0xFA) {
+    pendingTransport = 0;
+    return;
   }
+  pendingTransport = status;
+  pendingTransportAt = sysexSource == -1 ? transportBoundary(status) : -1;
 }
 
-void setVelocityMode(int source, int channel, int value) {
-  if (value == 127) {
-    velocityModes[source][channel] = (velocityModes[source][channel] == VEL_RDM) ? VEL_ON : VEL_RDM;
-  }
-  else if (value == 0) {
-    velocityModes[source][channel] = VEL_OFF;
-  }
-  else {
-    value = scaleUp(value);
-    velocity[source][channel] = value;
-    if (velocityModes[source][channel] == VEL_OFF)
-      velocityModes[source][channel] = VEL_ON;
+long long transportBoundary(unsigned char status) {
+  // Unquantized, with the next batch
+  if (transportQuantum == 0)
+    return 0;
+  if (status == 0xFC && songPosition.isRunning()) {
+    // The next bar or beat of the song, counted in clock ticks from the start. The stop goes out
+    // right ahead of the tick that would begin it; that tick is still sent, as the clock runs on
+    // while stopped, but the song position stays at the boundary
+    int quantumTicks = transportQuantum/ClockGenerator::SUB_TICKS_PER_CLOCK;
+    return clockGenerator.nextBoundary(ClockGenerator::SUB_TICKS_PER_CLOCK) +
+      songPosition.ticksToBoundary(quantumTicks)*ClockGenerator::SUB_TICKS_PER_CLOCK;
   }
+  return clockGenerator.nextBoundary(transportQuantum);
 }
 
-void setVelocityModeMulti(int source, int channel, int value) {
-  if (value == 127) {
-    int newMode = (velocityModes[source][channel] == VEL_RDM) ? VEL_ON : VEL_RDM;
-    for (int i=source; i>=0; i--)
-      velocityModes[i][channel] = newMode;
-  }
-  else if (value == 0) {
-    for (int i=source; i>=0; i--)
-      velocityModes[i][channel] = VEL_OFF;
+void sendTransport(unsigned char status, long long time) {
+  transportMessage[0] = status;
+  if (status == 0xFC) {
+    songPosition.stop();
+    timecode.stop();
+    sendOut(&transportMessage);
+    return;
   }
-  else {
-    value = scaleUp(value);
-    for (int i=source; i>=0; i--)
-      velocity[i][channel] = value;
-    if (velocityModes[source][channel] == VEL_OFF)
-      for (int i=source; i>=0; i--)
-        velocityModes[i][channel] = VEL_ON;
+  if (status == 0xFA)
+    songPosition.start();
+  else
+    songPosition.resume();
+  // Where to start from goes first
+  songPosition.songPositionMessage(&songPositionMessage);
+  sendOut(&songPositionMessage);
+  if (sendTimecode) {
+    if (status == 0xFA)
+      timecode.start(time);
+    else
+      timecode.resume(time);
+    timecode.fullFrameMessage(&fullFrameMessage);
+    writeOut(&fullFrameMessage);
   }
+  sendOut(&transportMessage);
 }
 
-int scaleUp(int value) {
-  // Scale value to let 8-120 contain the whole range 0-127
-  if (value > 64) {
-    value += 8*(value - 64)/56;
-    value = min(value, 127);
-  }
-  else if (value < 64) {
-    value -= 8*(64 - value)/56;
-    value = max(value, 0);
-  }
-  return value;
+void startTransport() {
+  if (smfPlayer)
+    smfPlayer->start();
+  looper->start();
 }
 
-long tapTempo() {
-  long diff = 0;
-  long accumulatedDiffs = 0;
-  unsigned int i = 0;
-  struct timespec now, curr, prev;
-  clock_gettime(CLOCK_MONOTONIC, &now);
-  tapTempoTimes->push_front(now);
-  do {
-    curr = (*tapTempoTimes)[i];
-    prev = (*tapTempoTimes)[i+1];
-    diff = (curr.tv_nsec - prev.tv_nsec) + (curr.tv_sec - prev.tv_sec) * 1000000000;
-    accumulatedDiffs += diff;
-    i++;
-  }
-  while (diff >= tapTempoMinInterval && diff <= tapTempoMaxInterval && i < tapTempoTimes->size()-1);
-  if (i > 1)
-    return accumulatedDiffs/i; // Interval in ns
-  else
-    return 0;
+void continueTransport() {
+  // The file and the loops pick up at the song position sent ahead of the continue
+  long long clocks = songPosition.getClocks();
+  if (smfPlayer)
+    smfPlayer->resume(clocks);
+  looper->resume(clocks);
+}
+
+void stopTransport() {
+  // The loops' note offs are sent from the main loop
+  looper->stop();
+  if (!smfPlayer)
+    return;
+  smfPlayer->stop();
+  // End the notes the file left playing, also when it had already played to its end
+  vector<unsigned char> noteOff;
+  while (smfPlayer->nextHangingNoteOff(&noteOff))
+    handleMessage(&noteOff, SMF_PLAYER_SOURCE);
 }
 
 void handleMessage(vector<unsigned char> *message, int source) {
-  // Handle mono mode
-  if (mono[source] && ((*message)[0] & BOOST_BINARY(11100000)) == BOOST_BINARY(10000000)) {
-    routeChannel(message, source);
-    applyVelocity(message, source);
-    sendNoteOffAndNote(message, source);
-  }
-  // Note on/off: send note or chord
-  else if (((*message)[0] & BOOST_BINARY(11100000)) == BOOST_BINARY(10000000)) {
-    routeChannel(message, source);
-    applyVelocity(message, source);
-    sendNoteOrChord(message, source);
-  }
-  // Start message: pass it through and reset clock
-  else if (enableClock && ((*message)[0] == BOOST_BINARY(11111010))) {
-    midiout->sendMessage(message);
-    resetClock = true;
+  // Sysex or a streamed sysex chunk: record it and hold the output for this input until it ends
+  if ((*message)[0] == BOOST_BINARY(11110000) || (*message)[0] == BOOST_BINARY(11110111) || (*message)[0] < BOOST_BINARY(10000000)) {
+    // The rest of a dump that timed out, up to its end
+    if (source < SYSEX_PLAYER_SOURCE && sysexAbandoned[source] && (*message)[0] != BOOST_BINARY(11110000)) {
+      sysexAbandoned[source] = message->back() != BOOST_BINARY(11110111);
+      return;
+    }
+    if (source < SYSEX_PLAYER_SOURCE)
+      sysexAbandoned[source] = false;
+    sysexLastChunk = monotonicNanos();
+    if (sysexRecorder)
+      sysexRecorder->write(&(*message)[0], message->size());
+    sysexSource = (message->back() == BOOST_BINARY(11110111)) ? -1 : source;
   }
-  // Stop message: reset last notes
-  else if (enableClock && ((*message)[0] == BOOST_BINARY(11111100))) {
-    midiout->sendMessage(message);
-    for (int i=0; i<4; i++)
-      for (int j=0; j<16; j++)
-        lastNote[i][j] = -1;
+  // Any other status byte but real-time ends an unterminated sysex
+  else if ((*message)[0] < BOOST_BINARY(11111000)) {
+    if (source == sysexSource)
+      sysexSource = -1;
+    if (source < SYSEX_PLAYER_SOURCE)
+      sysexAbandoned[source] = false;
   }
-  // Tap-tempo MIDI CC: use tap-tempo or tempo from MIDI message
-  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == tempoMidiCC) {
-    long tapInterval = tapTempo();
-    if (tapInterval != 0)
-      clockInterval = tapInterval/24;
-    else
-      clockInterval = 60000000000/((bpmOffsetForMidiCC+(*message)[2])*24);
 
-    resetClock = true;
-  }
-  // Chord mode MIDI CC: set chord mode
-  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == chordMidiCC) {
-    routeChannel(message, source);
-    setChordMode(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
-  }
-  // Channel routing MIDI CC: set channel routing
-  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == routeMidiCC) {
-    setChannelRouting(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
-  }
-  // Velocity MIDI CC: set velocity mode
-  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == velocityMidiCC) {
-    routeChannel(message, source);
-    if (velocityMultiDeviceCtrl)
-      setVelocityModeMulti(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
-    else
-      setVelocityMode(source, (*message)[0] & BOOST_BINARY(00001111), (*message)[2]);
-  }
-  // Start message CC: Send midi clock start
-  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == startMidiCC && (*message)[2] >= 64) {
-    midiout->sendMessage(clockStartMessage);
-  }
-  // Stop message CC: Send midi clock stop
-  else if (((*message)[0] & BOOST_BINARY(11110000)) == BOOST_BINARY(10110000) && message->size() > 2 && (*message)[1] == stopMidiCC && (*message)[2] >= 64) {
-    midiout->sendMessage(clockStopMessage);
-  }
-  // Other MIDI messages
-  else if (!ignoreMessage((*message)[0])) {
-    if ((((*message)[0] & BOOST_BINARY(11110000)) >= BOOST_BINARY(10000000)) &&
-        (((*message)[0] & BOOST_BINARY(11110000)) <= BOOST_BINARY(11100000))) {
-      routeChannel(message, source);
-    }
-    midiout->sendMessage(message);
-  }
+  // The file is routed with the settings of its input
+  engine->handleMessage(message, source == SMF_PLAYER_SOURCE ? smfSource : source);
 }
 
 void messageAtIn1(double deltatime, vector<unsigned char> *message, void */*userData*/) {
@@ -633,7 +758,12 @@ bool openInputPort(RtMidiIn *in, string port) {
     if (trimPort(doTrim, portName) == port) {
       cout << "Opening input port: " << portName << endl;
       in->openPort(i);
+      if (in == midiin1) inputPorts[0] = portName;
+      if (in == midiin2) inputPorts[1] = portName;
+      if (in == midiin3) inputPorts[2] = portName;
+      if (in == midiin4) inputPorts[3] = portName;
       in->ignoreTypes(false, false, false);
+      in->setSysexStreaming(streamSysex);
       return true;
     }
   }
@@ -651,6 +781,8 @@ bool openOutputPort(RtMidiOut *out, string port) {
     if (trimPort(doTrim, portName) == port) {
       cout << "Opening output port: " << portName << endl;
       out->openPort(i);
+      for (int o=0; o<4; o++)
+        if (out == midiouts[o]) outputPorts[o] = portName;
       return true;
     }
   }
@@ -663,15 +795,178 @@ bool openPorts(string i1, string i2, string i3, string i4, string o) {
   openInputPort(midiin2, i2);
   openInputPort(midiin3, i3);
   openInputPort(midiin4, i4);
-  return openOutputPort(midiout, o);
+  return openOutputPort(midiouts[0], o);
 }
 
 void cleanUp() {
+  // Stopped first, their threads read from everything below
+  delete metricsExporter;
+  delete stallWatchdog;
+  traceStop();
+  printLatencies();
+  delete sysexRecorder;
+  delete sysexPlayer;
+  delete smfPlayer;
+  delete smfReader;
+  // Finishes the recording
+  delete midiRecorder;
+  delete looper;
+  delete engine;
   delete midiin1;
   delete midiin2;
   delete midiin3;
   delete midiin4;
-  delete midiout;
+  for (int o=0; o<4; o++)
+    delete midiouts[o];
+}
+
+void printLatency(const string &name, const Histogram &histogram) {
+  if (histogram.getCount() == 0)
+    return;
+  cout << name << " (" << histogram.getCount() << "): p50 " << histogram.percentile(0.5)/1000
+       << " us, p99 " << histogram.percentile(0.99)/1000 << " us, p99.9 " << histogram.percentile(0.999)/1000
+       << " us, max " << histogram.getMax()/1000 << " us" << endl;
+}
+
+void printLatencies() {
+  Histogram allInputs, allQueues;
+  for (int i=0; i<4; i++) {
+    printLatency("Input " + convert::to_string(i+1) + " to output", inputLatency[i]);
+    allInputs.merge(inputLatency[i]);
+    allQueues.merge(queueDwell[i]);
+  }
+  printLatency("All inputs to output", allInputs);
+  printLatency("Time in input queues", allQueues);
+  printLatency("Clock period error", clockError);
+}
+
+void writeLatencyMetric(ostream &out, const char *name, const string &labels, const Histogram &histogram) {
+  const double quantiles[] = {0.5, 0.99, 0.999};
+  for (int q=0; q<3; q++)
+    out << name << "{" << labels << (labels.empty() ? "" : ",") << "quantile=\"" << quantiles[q] << "\"} "
+        << histogram.percentile(quantiles[q])/1e9 << "\n";
+  out << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << histogram.getCount() << "\n";
+}
+
+void writeMetrics(ostream &out) {
+  RtMidiIn *inputs[4] = {midiin1, midiin2, midiin3, midiin4};
+  string inputLabels[4];
+  for (int i=0; i<4; i++)
+    inputLabels[i] = "input=\"" + convert::to_string(i+1) + "\",port=\"" + metricLabel(inputPorts[i]) + "\"";
+  string outputLabels[4];
+  for (int o=0; o<4; o++)
+    outputLabels[o] = "output=\"" + convert::to_string(o+1) + "\",port=\"" + metricLabel(outputPorts[o]) + "\"";
+
+  writeMetricHeader(out, "midicloro_messages_in_total", "counter", "Messages taken from each input, by message class.");
+  for (int i=0; i<4; i++) {
+    if (inputPorts[i].empty())
+      continue;
+    for (int c=0; c<MESSAGE_CLASSES; c++)
+      out << "midicloro_messages_in_total{" << inputLabels[i] << ",class=\"" << MESSAGE_CLASS_NAMES[c] << "\"} " << readMetric(&messagesIn[i][c]) << "\n";
+  }
+  writeMetricHeader(out, "midicloro_messages_out_total", "counter", "Messages sent to each output, by message class.");
+  for (int o=0; o<4; o++) {
+    if (!midiouts[o])
+      continue;
+    for (int c=0; c<MESSAGE_CLASSES; c++)
+      out << "midicloro_messages_out_total{" << outputLabels[o] << ",class=\"" << MESSAGE_CLASS_NAMES[c] << "\"} " << readMetric(&messagesOut[o][c]) << "\n";
+  }
+  writeMetricHeader(out, "midicloro_output_drops_total", "counter", "Messages dropped because an output's retry queue was full.");
+  for (int o=0; o<4; o++)
+    if (midiouts[o])
+      out << "midicloro_output_drops_total{" << outputLabels[o] << "} " << midiouts[o]->getDrops() << "\n";
+
+  // What the input threads counted
+  RtMidiInStats stats[4];
+  for (int i=0; i<4; i++)
+    if (!inputPorts[i].empty())
+      stats[i] = inputs[i]->getStats();
+  writeMetricHeader(out, "midicloro_input_drops_total", "counter", "Messages dropped because an input queue was full.");
+  for (int i=0; i<4; i++)
+    if (!inputPorts[i].empty())
+      out << "midicloro_input_drops_total{" << inputLabels[i] << "} " << stats[i].drops << "\n";
+  writeMetricHeader(out, "midicloro_input_overruns_total", "counter", "Times the MIDI system lost input before it was read.");
+  for (int i=0; i<4; i++)
+    if (!inputPorts[i].empty())
+      out << "midicloro_input_overruns_total{" << inputLabels[i] << "} " << stats[i].overruns << "\n";
+  writeMetricHeader(out, "midicloro_input_queue_high_water", "gauge", "Most messages that have waited in an input queue at once.");
+  for (int i=0; i<4; i++)
+    if (!inputPorts[i].empty())
+      out << "midicloro_input_queue_high_water{" << inputLabels[i] << "} " << stats[i].queueHighWater << "\n";
+  RtMidiLogStats logStats = RtMidi::getLogStats();
+  writeMetricHeader(out, "midicloro_log_messages_total", "counter", "Warnings from the MIDI threads: logged, counted as repeats instead of written, or lost to a full log.");
+  out << "midicloro_log_messages_total{kind=\"logged\"} " << logStats.logged << "\n";
+  out << "midicloro_log_messages_total{kind=\"suppressed\"} " << logStats.suppressed << "\n";
+  out << "midicloro_log_messages_total{kind=\"dropped\"} " << logStats.dropped << "\n";
+  if (midiRecorder) {
+    writeMetricHeader(out, "midicloro_recorder_drops_total", "counter", "Messages the session recorder dropped.");
+    out << "midicloro_recorder_drops_total " << midiRecorder->getDropped() << "\n";
+  }
+  writeMetricHeader(out, "midicloro_sysex_timeouts_total", "counter", "Sysex dumps cut off because their input stopped sending.");
+  out << "midicloro_sysex_timeouts_total " << readMetric(&sysexTimeouts) << "\n";
+  if (sysexRecorder) {
+    writeMetricHeader(out, "midicloro_sysex_recorder_drops_total", "counter", "Sysex chunks the sysex recorder dropped.");
+    out << "midicloro_sysex_recorder_drops_total " << sysexRecorder->getDropped() << "\n";
+  }
+
+  // The engine
+  writeMetricHeader(out, "midicloro_chord_notes_total", "counter", "Notes added by chord mode, note ons and note offs.");
+  out << "midicloro_chord_notes_total " << engine->getChordNotes() << "\n";
+  writeMetricHeader(out, "midicloro_tap_tempo_events_total", "counter", "Tempo CCs handled.");
+  out << "midicloro_tap_tempo_events_total " << engine->getTapTempoEvents() << "\n";
+  writeMetricHeader(out, "midicloro_bpm", "gauge", "Current clock tempo.");
+  out << "midicloro_bpm " << 60000000000.0/(engine->getClockInterval()*24) << "\n";
+  // How steady the tapping that set the tempo was, and so how sure the tempo is
+  writeMetricHeader(out, "midicloro_tap_jitter_seconds", "gauge", "Standard deviation of the last taps from the beats of the tempo they set.");
+  out << "midicloro_tap_jitter_seconds " << engine->getTapJitter()/1000000000.0 << "\n";
+  writeMetricHeader(out, "midicloro_bpm_deviation", "gauge", "Standard error of the tapped tempo in BPM.");
+  out << "midicloro_bpm_deviation " << 60000000000.0*engine->getTapDeviation()/((double)engine->getClockInterval()*24*engine->getClockInterval()*24) << "\n";
+  writeMetricHeader(out, "midicloro_song_position", "gauge", "16th notes played since the last start, as sent in Song Position Pointer.");
+  out << "midicloro_song_position " << songPosition.getSixteenths() << "\n";
+  int bar, beat, sixteenth;
+  songPosition.getBarBeatSixteenth(&bar, &beat, &sixteenth);
+  writeMetricHeader(out, "midicloro_song_bar", "gauge", "Bar of the song position, from 1, in 4/4.");
+  out << "midicloro_song_bar " << bar << "\n";
+  writeMetricHeader(out, "midicloro_song_beat", "gauge", "Beat in the bar of the song position, from 1.");
+  out << "midicloro_song_beat " << beat << "\n";
+
+  // Timing, from the histograms kept by the main loop
+  writeMetricHeader(out, "midicloro_input_latency_seconds", "summary", "Time from arriving at an input to leaving the output port.");
+  for (int i=0; i<4; i++)
+    if (!inputPorts[i].empty())
+      writeLatencyMetric(out, "midicloro_input_latency_seconds", inputLabels[i], inputLatency[i]);
+  writeMetricHeader(out, "midicloro_queue_dwell_seconds", "summary", "Time messages wait in an input queue.");
+  for (int i=0; i<4; i++)
+    if (!inputPorts[i].empty())
+      writeLatencyMetric(out, "midicloro_queue_dwell_seconds", inputLabels[i], queueDwell[i]);
+  writeMetricHeader(out, "midicloro_clock_error_seconds", "summary", "Difference between clock tick periods and the clock interval.");
+  writeLatencyMetric(out, "midicloro_clock_error_seconds", "", clockError);
+
+  if (stallWatchdog)
+    stallWatchdog->writeMetrics(out);
+
+  writeCpuMetrics(out);
+}
+
+long long stallOverdue(int activity, long long now, int *tid) {
+  if (activity == WATCH_MAIN || activity == WATCH_CLOCK) {
+    *tid = mainThreadId;
+    // The clock is late once its next batch of ticks is past due
+    if (activity == WATCH_CLOCK) {
+      long long due = __atomic_load_n(&clockDue, __ATOMIC_RELAXED);
+      return due != 0 ? now - due : 0;
+    }
+    long long beat = __atomic_load_n(&loopHeartbeat, __ATOMIC_RELAXED);
+    return beat != 0 ? now - beat : 0;
+  }
+  // An input thread is only late while it's working on an event, waiting for one is fine
+  int input = activity - WATCH_INPUTS;
+  RtMidiIn *inputs[4] = {midiin1, midiin2, midiin3, midiin4};
+  if (inputPorts[input].empty())
+    return 0;
+  RtMidiInStats stats = inputs[input]->getStats();
+  *tid = stats.threadId;
+  return stats.heartbeat != 0 ? now - stats.heartbeat : 0;
 }
 
 void runInteractiveConfiguration() {
@@ -879,6 +1174,15 @@ void runInteractiveConfiguration() {
   cin.clear();
   cin.ignore(numeric_limits<streamsize>::max(), '\n');
 
+  cout << "Enter looper MIDI CC number (default 15): ";
+  if (cin.peek()=='\n' || !(cin >> userIn) || userIn<0 || userIn>127)
+    cfg += string("loopMidiCC = 15") + "\n";
+  else
+    cfg += string("loopMidiCC = ") + convert::to_string(userIn) + "\n";
+
+  cin.clear();
+  cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
   cout << endl;
 
   ofstream file(CONFIG_FILE);
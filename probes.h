@@ -0,0 +1,39 @@
+//************** MIDIcloro **************
+//
+// USDT static probes for perf, bpftrace and SystemTap. A probe is a
+// single nop in the code and a note in the binary, until a tracer
+// attaches to it, so they are always built in when the systemtap SDT
+// header (sys/sdt.h, package systemtap-sdt-dev) is installed. Define
+// MIDICLORO_NO_PROBES to leave them out.
+//
+// List them with: perf list 'sdt_midicloro:*' or bpftrace -l 'usdt:./midicloro:*'
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_PROBES_H
+#define MIDICLORO_PROBES_H
+
+#if !defined(MIDICLORO_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MIDICLORO_PROBES
+#endif
+#endif
+
+#ifdef MIDICLORO_PROBES
+#define PROBE(name) DTRACE_PROBE(midicloro, name)
+#define PROBE1(name, a) DTRACE_PROBE1(midicloro, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(midicloro, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(midicloro, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(midicloro, name, a, b, c, d)
+#else
+#define PROBE(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+#endif
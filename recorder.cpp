@@ -0,0 +1,335 @@
+//************** MIDIcloro **************
+//
+// MIDI recorder
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "recorder.h"
+#include "smf.h"
+#include "timeutil.h"
+
+using namespace std;
+
+// Room for a few seconds of dense MIDI if the writer thread falls behind, must be a power of two
+const size_t RING_SIZE = 1024*1024;
+// The log file grows in steps of this size
+const size_t LOG_GROW_SIZE = 256*1024;
+// How often the writer thread wakes up to move events to the log
+const long WRITER_PERIOD = 10000000;
+
+// Log file layout: the header below, then records of a LogRecord followed by the message bytes.
+// A record's magic byte is stored last with release ordering, after its header and bytes,
+// so a reader of the shared mapping stops at the first incomplete record.
+const char LOG_MAGIC[8] = {'M','C','L','O','G','0','0','1'};
+const unsigned char RECORD_MAGIC = 0xA5;
+struct LogHeader {
+  char magic[8];
+  long long startTime;
+};
+struct LogRecord {
+  unsigned char magic;
+  unsigned char stream;
+  unsigned short reserved;
+  unsigned int length;
+  long long time; // ns since the log was started
+};
+
+// Recordings are written at 120 BPM with a tick of 100 us
+const int SMF_DIVISION = 5000;
+const long long SMF_NS_PER_TICK = 100000;
+
+MidiRecorder::MidiRecorder(const string &dir, long long rotateInterval)
+  : dir(dir), rotateInterval(rotateInterval), threadStarted(false), stopRequested(false),
+    ring(RING_SIZE), ringHead(0), ringTail(0), dropped(0),
+    fd(-1), map(0), mapSize(0), used(0), logStart(0), fileCount(0) {
+  if (pthread_create(&thread, 0, writerThread, this) != 0)
+    cerr << "Couldn't start the recorder thread, recording disabled" << endl;
+  else
+    threadStarted = true;
+}
+
+MidiRecorder::~MidiRecorder() {
+  if (threadStarted) {
+    __atomic_store_n(&stopRequested, true, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+  }
+}
+
+void MidiRecorder::record(int stream, const unsigned char *bytes, size_t nBytes) {
+  // Clock and other real-time messages aren't recorded
+  if (nBytes == 0 || bytes[0] >= 0xF8 || !threadStarted)
+    return;
+  RingHeader header;
+  size_t recordSize = sizeof(header) + nBytes;
+  size_t head = ringHead;
+  if (RING_SIZE - (head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE)) < recordSize) {
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  header.time = monotonicNanos();
+  header.length = nBytes;
+  header.stream = stream;
+
+  // Copy in at most two parts when the record wraps around the end of the ring
+  const unsigned char *parts[2] = {(const unsigned char *)&header, bytes};
+  size_t sizes[2] = {sizeof(header), nBytes};
+  size_t pos = head;
+  for (int p=0; p<2; p++) {
+    size_t index = pos & (RING_SIZE-1);
+    size_t first = min(sizes[p], RING_SIZE - index);
+    memcpy(&ring[index], parts[p], first);
+    memcpy(&ring[0], parts[p] + first, sizes[p] - first);
+    pos += sizes[p];
+  }
+  __atomic_store_n(&ringHead, head + recordSize, __ATOMIC_RELEASE);
+}
+
+void *MidiRecorder::writerThread(void *recorder) {
+  ((MidiRecorder *)recorder)->run();
+  return 0;
+}
+
+void MidiRecorder::run() {
+  // Disk writes must never compete with the MIDI threads
+  prctl(PR_SET_NAME, "cloro-record");
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  recoverLogs();
+  openLog();
+  struct timespec period = {0, WRITER_PERIOD};
+  while (true) {
+    bool stopping = __atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE);
+    drain();
+    if (stopping)
+      break;
+    if (fd >= 0 && rotateInterval > 0 && monotonicNanos() - logStart >= rotateInterval) {
+      string finished = logPath;
+      closeLog();
+      finalize(finished);
+      openLog();
+    }
+    nanosleep(&period, 0);
+  }
+  string finished = logPath;
+  closeLog();
+  if (!finished.empty())
+    finalize(finished);
+  unsigned long nDropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (nDropped > 0)
+    cerr << "Recorder dropped " << nDropped << " messages" << endl;
+}
+
+void MidiRecorder::recoverLogs() {
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    cerr << "Couldn't open recording directory: " << dir << endl;
+    return;
+  }
+  vector<string> logs;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != 0) {
+    string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".wal") == 0)
+      logs.push_back(dir + "/" + name);
+  }
+  closedir(d);
+  for (unsigned int i=0; i<logs.size(); i++) {
+    cout << "Recovering recording: " << logs[i] << endl;
+    finalize(logs[i]);
+  }
+}
+
+size_t MidiRecorder::ringRead(size_t pos, void *dest, size_t nBytes) {
+  size_t index = pos & (RING_SIZE-1);
+  size_t first = min(nBytes, RING_SIZE - index);
+  memcpy(dest, &ring[index], first);
+  memcpy((unsigned char *)dest + first, &ring[0], nBytes - first);
+  return pos + nBytes;
+}
+
+void MidiRecorder::drain() {
+  size_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+  size_t tail = ringTail;
+  while (tail != head) {
+    RingHeader header;
+    tail = ringRead(tail, &header, sizeof(header));
+    message.resize(header.length);
+    tail = ringRead(tail, &message[0], header.length);
+    appendLog(header.time, header.stream, &message[0], header.length);
+  }
+  __atomic_store_n(&ringTail, tail, __ATOMIC_RELEASE);
+  // Hand the new records to the kernel, they're in the file even if midicloro dies now
+  if (map && used > 0)
+    msync(map, used, MS_ASYNC);
+}
+
+bool MidiRecorder::openLog() {
+  time_t now = time(0);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  // Never reuse the name of an earlier recording, including recovered ones
+  string base;
+  fd = -1;
+  for (int attempts=0; fd < 0 && attempts < 1000; attempts++) {
+    ostringstream path;
+    path << dir << "/midicloro-" << stamp << "-" << setw(3) << setfill('0') << fileCount++;
+    base = path.str();
+    if (access((base + ".mid").c_str(), F_OK) != 0)
+      fd = ::open((base + ".wal").c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  }
+  if (fd < 0) {
+    cerr << "Couldn't create recording: " << base << ".wal" << endl;
+    logPath.clear();
+    return false;
+  }
+  logPath = base + ".wal";
+  cout << "Recording to: " << logPath << endl;
+  // The first step of the file holds the header. Without one there would be nothing to recover,
+  // so a file that can't be mapped is removed rather than left for the next start.
+  void *newMap = MAP_FAILED;
+  if (ftruncate(fd, LOG_GROW_SIZE) == 0)
+    newMap = mmap(0, LOG_GROW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (newMap == MAP_FAILED) {
+    cerr << "Couldn't map recording: " << logPath << endl;
+    ::close(fd);
+    fd = -1;
+    unlink(logPath.c_str());
+    logPath.clear();
+    return false;
+  }
+  map = (unsigned char *)newMap;
+  mapSize = LOG_GROW_SIZE;
+  used = 0;
+  LogHeader header;
+  memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+  logStart = header.startTime = monotonicNanos();
+  memcpy(map, &header, sizeof(header));
+  used = sizeof(header);
+  return true;
+}
+
+bool MidiRecorder::reserve(size_t nBytes) {
+  if (used + nBytes <= mapSize)
+    return true;
+  size_t newSize = ((used + nBytes)/LOG_GROW_SIZE + 1)*LOG_GROW_SIZE;
+  void *newMap;
+  if (ftruncate(fd, newSize) != 0)
+    newMap = MAP_FAILED;
+  else if (map)
+    newMap = mremap(map, mapSize, newSize, MREMAP_MAYMOVE);
+  else
+    newMap = mmap(0, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (newMap == MAP_FAILED) {
+    cerr << "Couldn't grow recording, recording stopped" << endl;
+    string finished = logPath;
+    closeLog();
+    finalize(finished);
+    return false;
+  }
+  map = (unsigned char *)newMap;
+  mapSize = newSize;
+  return true;
+}
+
+void MidiRecorder::appendLog(long long time, int stream, const unsigned char *bytes, size_t nBytes) {
+  if (fd < 0 || !reserve(sizeof(LogRecord) + nBytes))
+    return;
+  LogRecord record;
+  record.magic = 0;
+  record.stream = stream;
+  record.reserved = 0;
+  record.length = nBytes;
+  // Events queued just before a rotation belong at the start of the new recording
+  record.time = max(time - logStart, 0LL);
+  memcpy(map + used, &record, sizeof(record));
+  memcpy(map + used + sizeof(record), bytes, nBytes);
+  __atomic_store_n(&map[used], RECORD_MAGIC, __ATOMIC_RELEASE);
+  used += sizeof(record) + nBytes;
+}
+
+void MidiRecorder::closeLog() {
+  if (map)
+    munmap(map, mapSize);
+  if (fd >= 0) {
+    if (ftruncate(fd, used) != 0)
+      cerr << "Couldn't truncate recording" << endl;
+    ::close(fd);
+  }
+  map = 0;
+  mapSize = 0;
+  used = 0;
+  fd = -1;
+  logPath.clear();
+}
+
+bool MidiRecorder::finalize(const string &logPath) {
+  int logFd = ::open(logPath.c_str(), O_RDONLY);
+  if (logFd < 0) {
+    cerr << "Couldn't open recording: " << logPath << endl;
+    return false;
+  }
+  struct stat st;
+  void *logMap = MAP_FAILED;
+  if (fstat(logFd, &st) == 0 && (size_t)st.st_size >= sizeof(LogHeader))
+    logMap = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, logFd, 0);
+  ::close(logFd);
+  const unsigned char *log = (const unsigned char *)logMap;
+  if (logMap == MAP_FAILED || memcmp(log, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+    cerr << "Not a midicloro recording: " << logPath << endl;
+    if (logMap != MAP_FAILED)
+      munmap(logMap, st.st_size);
+    return false;
+  }
+  madvise(logMap, st.st_size, MADV_SEQUENTIAL);
+
+  // One track per stream in the order they appear, the output track first with the tempo.
+  // The tracks are named after their stream, which is how midicloro-replay finds them.
+  SmfWriter smf(SMF_DIVISION);
+  int streamTracks[MAX_STREAMS] = {0, -1, -1, -1, -1};
+  const unsigned char tempo[] = {0x07, 0xA1, 0x20};
+  smf.addMeta(0, 0, 0x51, tempo, sizeof(tempo));
+  smf.addMeta(0, 0, 0x03, (const unsigned char *)"Output", 6);
+
+  size_t offset = sizeof(LogHeader);
+  unsigned long nEvents = 0;
+  while (offset + sizeof(LogRecord) <= (size_t)st.st_size) {
+    LogRecord record;
+    if (__atomic_load_n(log + offset, __ATOMIC_ACQUIRE) != RECORD_MAGIC)
+      break;
+    memcpy(&record, log + offset, sizeof(record));
+    if (record.magic != RECORD_MAGIC || record.length == 0 || record.stream >= MAX_STREAMS ||
+        offset + sizeof(record) + record.length > (size_t)st.st_size)
+      break;
+    if (streamTracks[record.stream] < 0) {
+      streamTracks[record.stream] = smf.getTrackCount();
+      string name = "Input " + string(1, '0' + record.stream);
+      smf.addMeta(streamTracks[record.stream], 0, 0x03, (const unsigned char *)name.data(), name.size());
+    }
+    smf.addMessage(streamTracks[record.stream], record.time/SMF_NS_PER_TICK, log + offset + sizeof(record), record.length);
+    offset += sizeof(record) + record.length;
+    nEvents++;
+  }
+  munmap(logMap, st.st_size);
+
+  string smfPath = logPath.substr(0, logPath.size() - 4) + ".mid";
+  if (!smf.save(smfPath))
+    return false;
+  unlink(logPath.c_str());
+  cout << "Saved recording: " << smfPath << " (" << nEvents << " events)" << endl;
+  return true;
+}
@@ -0,0 +1,77 @@
+//************** MIDIcloro **************
+//
+// MIDI recorder: captures the output, and optionally the raw inputs,
+// to Standard MIDI Files. Events are handed to a background thread
+// through a lock-free ring, and the thread appends them to a log file
+// that is turned into a .mid file when recording stops or rotates.
+// A log left behind by a crash is turned into a .mid file on the next
+// start.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_RECORDER_H
+#define MIDICLORO_RECORDER_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class MidiRecorder {
+ public:
+  // Stream 0 is the output, streams 1-4 are the inputs
+  static const int OUTPUT_STREAM = 0;
+  static const int MAX_STREAMS = 5;
+
+  // rotateInterval in ns, 0 to keep one recording until stopped
+  MidiRecorder(const std::string &dir, long long rotateInterval);
+  ~MidiRecorder();
+  // Queue a message for recording. Never blocks, the message is dropped if the ring is full.
+  // Only to be called from one thread.
+  void record(int stream, const unsigned char *bytes, size_t nBytes);
+  // Messages dropped because the ring was full, can be read from any thread
+  unsigned long getDropped() const { return __atomic_load_n(&dropped, __ATOMIC_RELAXED); }
+  // Turn a log into a .mid file next to it and remove the log
+  static bool finalize(const std::string &logPath);
+
+ private:
+  struct RingHeader {
+    long long time;
+    unsigned int length;
+    unsigned char stream;
+  };
+  static void *writerThread(void *recorder);
+  void run();
+  void recoverLogs();
+  void drain();
+  size_t ringRead(size_t pos, void *dest, size_t nBytes);
+  bool openLog();
+  bool reserve(size_t nBytes);
+  void appendLog(long long time, int stream, const unsigned char *bytes, size_t nBytes);
+  void closeLog();
+
+  std::string dir;
+  long long rotateInterval;
+  pthread_t thread;
+  bool threadStarted;
+  bool stopRequested;
+
+  // Ring shared between record() and the writer thread
+  std::vector<unsigned char> ring;
+  size_t ringHead; // Written by record() only
+  size_t ringTail; // Written by the writer thread only
+  unsigned long dropped;
+
+  // Log file, used by the writer thread only
+  std::string logPath;
+  int fd;
+  unsigned char *map;
+  size_t mapSize;
+  size_t used;
+  long long logStart;
+  int fileCount;
+  std::vector<unsigned char> message;
+};
+
+#endif
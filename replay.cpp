@@ -0,0 +1,342 @@
+//************** MIDIcloro **************
+//
+// Replay: plays a session recording (see recordDir and recordInputs)
+// into a running MIDIcloro over virtual ALSA sequencer ports, with
+// the timing it was recorded with or sped up, and compares what comes
+// out with the output in the recording: missing and unexpected
+// messages, order and timing. Any other MIDI file can be played too,
+// it then goes to input 1 and nothing is compared.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-replay [-s speed] [-w wait seconds] [-n deviations to list] file.mid
+//
+//***************************************
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <time.h>
+#include <pthread.h>
+#include "rtmidi/RtMidi.h"
+#include "smf.h"
+#include "histogram.h"
+#include "timeutil.h"
+
+using namespace std;
+
+// The probe has the non-commercial manufacturer id, the same as midicloro-stress
+const unsigned char SYSEX_ID = 0x7D;
+const unsigned char SYSEX_PROBE = 0x00;
+// Output that midicloro sends later than this after the last expected message is left out
+const long long DRAIN_TIME = 1000000000LL;
+
+// A message of the recording, at its time in ns from the start of the recording
+struct ReplayEvent {
+  long long time;
+  int input; // 0-3, -1 for the recorded output
+  vector<unsigned char> bytes;
+};
+
+// A message from midicloro, at its time in ns from the start of the replay
+struct Received {
+  long long time;
+  vector<unsigned char> bytes;
+};
+
+double speed = 1.0;
+int waitSeconds = 60;
+int nDeviations = 10;
+
+pthread_mutex_t receivedMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<Received> received;
+bool recording = false;
+bool probeSeen = false;
+long long replayStart;
+
+void usage(void);
+bool readRecording(const string &path, vector<ReplayEvent> *inputs, vector<ReplayEvent> *outputs);
+void onMessage(double deltaTime, vector<unsigned char> *message, void *userData);
+bool waitForMidicloro(RtMidiOut *out);
+void compare(const vector<ReplayEvent> &expected, const vector<Received> &actual);
+string formatMessage(const vector<unsigned char> &bytes);
+
+int main(int argc, char *argv[]) {
+  string path;
+  for (int i=1; i<argc; i++) {
+    string arg = argv[i];
+    if (arg == "-s" && i+1 < argc)
+      speed = atof(argv[++i]);
+    else if (arg == "-w" && i+1 < argc)
+      waitSeconds = atoi(argv[++i]);
+    else if (arg == "-n" && i+1 < argc)
+      nDeviations = atoi(argv[++i]);
+    else if (arg[0] == '-' || !path.empty())
+      usage();
+    else
+      path = arg;
+  }
+  if (path.empty() || speed <= 0 || nDeviations < 0)
+    usage();
+
+  vector<ReplayEvent> inputs, outputs;
+  if (!readRecording(path, &inputs, &outputs))
+    return 1;
+  if (inputs.empty()) {
+    cout << "Nothing to replay in " << path << endl;
+    return 1;
+  }
+  bool used[4] = {false, false, false, false};
+  for (unsigned int i=0; i<inputs.size(); i++)
+    used[inputs[i].input] = true;
+
+  // Every input is a client of its own, midicloro tells ports apart by client name
+  RtMidiIn *midiin = 0;
+  RtMidiOut *devices[4] = {0, 0, 0, 0};
+  try {
+    midiin = new RtMidiIn(RtMidi::LINUX_ALSA, "MIDIcloro replay in", 4096);
+    midiin->ignoreTypes(false, true, true);
+    midiin->setCallback(&onMessage);
+    midiin->openVirtualPort("in");
+    for (int i=0; i<4; i++) {
+      if (!used[i] && i > 0)
+        continue;
+      ostringstream name;
+      name << "MIDIcloro replay " << i+1;
+      devices[i] = new RtMidiOut(RtMidi::LINUX_ALSA, name.str());
+      devices[i]->openVirtualPort("out");
+    }
+  }
+  catch (RtMidiError &error) {
+    error.printMessage();
+    return 1;
+  }
+
+  cout << "Set these ports in midicloro.cfg and start midicloro:" << endl;
+  for (int i=0; i<4; i++)
+    if (devices[i])
+      cout << "input" << i+1 << " = MIDIcloro replay " << i+1 << endl;
+  cout << "output = MIDIcloro replay in" << endl;
+  if (!waitForMidicloro(devices[0])) {
+    cout << "No answer from midicloro, exiting" << endl;
+    return 1;
+  }
+
+  // The recording starts with its first input message
+  long long offset = inputs[0].time;
+  cout << "Replaying " << inputs.size() << " messages over " << (inputs.back().time - offset)/speed/1000000000.0
+       << " s at " << speed << "x" << endl;
+  pthread_mutex_lock(&receivedMutex);
+  received.reserve(outputs.size()*2 + 1024);
+  replayStart = monotonicNanos();
+  recording = true;
+  pthread_mutex_unlock(&receivedMutex);
+  long long maxLate = 0;
+  for (unsigned int i=0; i<inputs.size(); i++) {
+    long long dueTime = replayStart + (long long)((inputs[i].time - offset)/speed);
+    struct timespec due;
+    due.tv_sec = dueTime/1000000000LL;
+    due.tv_nsec = dueTime%1000000000LL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0);
+    maxLate = max(maxLate, monotonicNanos() - dueTime);
+    devices[inputs[i].input]->sendMessage(&inputs[i].bytes);
+  }
+  long long lastExpected = outputs.empty() ? 0 : (long long)((outputs.back().time - offset)/speed);
+  long long drainUntil = replayStart + max(lastExpected, (long long)((inputs.back().time - offset)/speed)) + DRAIN_TIME;
+  struct timespec drain;
+  drain.tv_sec = drainUntil/1000000000LL;
+  drain.tv_nsec = drainUntil%1000000000LL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &drain, 0);
+  pthread_mutex_lock(&receivedMutex);
+  recording = false;
+  vector<Received> actual = received;
+  pthread_mutex_unlock(&receivedMutex);
+  cout << "Sent with up to " << maxLate/1000.0 << " us delay from the recorded timing" << endl;
+
+  if (outputs.empty())
+    cout << "No recorded output to compare with, " << actual.size() << " messages received" << endl;
+  else {
+    // Expected times in replay time
+    for (unsigned int i=0; i<outputs.size(); i++)
+      outputs[i].time = (long long)((outputs[i].time - offset)/speed);
+    compare(outputs, actual);
+  }
+
+  delete midiin;
+  for (int i=0; i<4; i++)
+    delete devices[i];
+  return 0;
+}
+
+void usage(void) {
+  cout << "Usage: ./midicloro-replay [-s speed] [-w wait seconds] [-n deviations to list] file.mid" << endl;
+  exit(0);
+}
+
+// Tracks named "Input 1-4" go to that input and the "Output" track is what midicloro
+// should send, as in midicloro's recordings. Other tracks go to input 1.
+bool readRecording(const string &path, vector<ReplayEvent> *inputs, vector<ReplayEvent> *outputs) {
+  SmfReader reader;
+  if (!reader.open(path)) {
+    cout << "Couldn't read " << path << endl;
+    return false;
+  }
+  vector<int> trackInputs(reader.getTrackCount(), 0);
+  SmfEvent event;
+  while (reader.next(&event)) {
+    if (event.isMeta && event.metaType == 0x03) {
+      string name(event.bytes.begin(), event.bytes.end());
+      if (name == "Output")
+        trackInputs[event.track] = -1;
+      else if (name.size() == 7 && name.compare(0, 6, "Input ") == 0 && name[6] >= '1' && name[6] <= '4')
+        trackInputs[event.track] = name[6] - '1';
+    }
+  }
+
+  // Ticks to ns, following the tempo changes of the file
+  reader.rewind();
+  double nsPerTick = 500000000.0/reader.getDivision();
+  unsigned long lastTick = 0;
+  double time = 0;
+  while (reader.next(&event)) {
+    time += (event.tick - lastTick)*nsPerTick;
+    lastTick = event.tick;
+    if (event.isMeta) {
+      if (event.metaType == 0x51 && event.bytes.size() == 3)
+        nsPerTick = ((event.bytes[0] << 16) | (event.bytes[1] << 8) | event.bytes[2])*1000.0/reader.getDivision();
+      continue;
+    }
+    if (event.bytes.empty())
+      continue;
+    ReplayEvent replayEvent;
+    replayEvent.time = (long long)time;
+    replayEvent.input = trackInputs[event.track];
+    replayEvent.bytes = event.bytes;
+    if (replayEvent.input < 0)
+      outputs->push_back(replayEvent);
+    else
+      inputs->push_back(replayEvent);
+  }
+  return true;
+}
+
+// Called from the RtMidi input thread for every message from midicloro
+void onMessage(double /*deltaTime*/, vector<unsigned char> *message, void * /*userData*/) {
+  long long now = monotonicNanos();
+  if (message->empty())
+    return;
+  if (message->size() > 2 && (*message)[0] == 0xF0 && (*message)[1] == SYSEX_ID && (*message)[2] == SYSEX_PROBE) {
+    __atomic_store_n(&probeSeen, true, __ATOMIC_RELEASE);
+    return;
+  }
+  // Real-time messages aren't in recordings
+  if ((*message)[0] >= 0xF8)
+    return;
+  pthread_mutex_lock(&receivedMutex);
+  if (recording) {
+    Received r = {now - replayStart, *message};
+    received.push_back(r);
+  }
+  pthread_mutex_unlock(&receivedMutex);
+}
+
+// midicloro opens the ports when it starts, a probe sysex comes back once it's running
+bool waitForMidicloro(RtMidiOut *out) {
+  unsigned char probeBytes[] = {0xF0, SYSEX_ID, SYSEX_PROBE, 0xF7};
+  vector<unsigned char> probe(probeBytes, probeBytes + sizeof(probeBytes));
+  struct timespec period = {0, 100000000};
+  for (int i=0; i<waitSeconds*10; i++) {
+    out->sendMessage(&probe);
+    nanosleep(&period, 0);
+    if (__atomic_load_n(&probeSeen, __ATOMIC_ACQUIRE))
+      return true;
+  }
+  return false;
+}
+
+string formatMessage(const vector<unsigned char> &bytes) {
+  ostringstream text;
+  text << hex << setfill('0');
+  for (unsigned int i=0; i<bytes.size() && i<8; i++)
+    text << (i ? " " : "") << setw(2) << (int)bytes[i];
+  if (bytes.size() > 8)
+    text << " ... (" << dec << bytes.size() << " bytes)";
+  return text.str();
+}
+
+// The same message is matched with the oldest one of its kind not matched yet, so
+// messages that come back in a different order show up as reordered.
+void compare(const vector<ReplayEvent> &expected, const vector<Received> &actual) {
+  map<vector<unsigned char>, deque<unsigned int> > waiting;
+  for (unsigned int i=0; i<actual.size(); i++)
+    waiting[actual[i].bytes].push_back(i);
+
+  Histogram deviation;
+  double sumDeviation = 0;
+  unsigned long matched = 0, reordered = 0;
+  vector<unsigned int> missing;
+  long long lastMatch = -1;
+  vector<pair<long long, unsigned int> > worst; // |deviation|, expected index
+  vector<bool> actualUsed(actual.size(), false);
+  for (unsigned int i=0; i<expected.size(); i++) {
+    deque<unsigned int> &candidates = waiting[expected[i].bytes];
+    if (candidates.empty()) {
+      missing.push_back(i);
+      continue;
+    }
+    unsigned int a = candidates.front();
+    candidates.pop_front();
+    actualUsed[a] = true;
+    matched++;
+    if ((long long)a < lastMatch)
+      reordered++;
+    lastMatch = max(lastMatch, (long long)a);
+    long long d = actual[a].time - expected[i].time;
+    sumDeviation += d;
+    deviation.record(d < 0 ? -d : d);
+    worst.push_back(make_pair(d < 0 ? -d : d, i));
+  }
+  unsigned long unexpected = actual.size() - matched;
+
+  cout << expected.size() << " messages expected, " << actual.size() << " received: " << matched << " matched, "
+       << missing.size() << " missing, " << unexpected << " unexpected, " << reordered << " out of order" << endl;
+  if (matched == 0)
+    return;
+  cout << "Timing against the recording: mean " << fixed << setprecision(1) << sumDeviation/matched/1000.0
+       << " us (positive is later), |deviation| p50 " << deviation.percentile(0.5)/1000.0 << " us, p99 "
+       << deviation.percentile(0.99)/1000.0 << " us, p99.9 " << deviation.percentile(0.999)/1000.0 << " us, max "
+       << deviation.getMax()/1000.0 << " us" << endl;
+
+  sort(worst.rbegin(), worst.rend());
+  if (worst.size() > (size_t)nDeviations)
+    worst.resize(nDeviations);
+  if (!worst.empty())
+    cout << "Largest deviations:" << endl;
+  for (unsigned int i=0; i<worst.size(); i++) {
+    const ReplayEvent &e = expected[worst[i].second];
+    cout << "  at " << e.time/1000000.0 << " ms: " << formatMessage(e.bytes) << ", " << worst[i].first/1000.0 << " us" << endl;
+  }
+  for (unsigned int i=0; i<missing.size() && i<(size_t)nDeviations; i++) {
+    if (i == 0)
+      cout << "Missing messages:" << endl;
+    const ReplayEvent &e = expected[missing[i]];
+    cout << "  at " << e.time/1000000.0 << " ms: " << formatMessage(e.bytes) << endl;
+  }
+  int shown = 0;
+  for (unsigned int a=0; a<actual.size() && shown < nDeviations; a++) {
+    if (actualUsed[a])
+      continue;
+    if (shown++ == 0)
+      cout << "Unexpected messages:" << endl;
+    cout << "  at " << actual[a].time/1000000.0 << " ms: " << formatMessage(actual[a].bytes) << endl;
+  }
+  cout.unsetf(ios::floatfield);
+}
@@ -38,6 +38,8 @@
 
 #include "RtMidi.h"
 #include <sstream>
+#include <algorithm>
+#include <cstring>
 
 //*********************************************************************//
 //  RtMidi Definitions
@@ -219,6 +221,225 @@ RtMidiOut :: ~RtMidiOut() throw()
 {
 }
 
+//*********************************************************************//
+//  RtMidi Log
+//*********************************************************************//
+
+// Warnings raised on the MIDI threads go to a preallocated ring and a
+// background thread writes them to std::cerr.  Raising one takes a
+// few atomic operations: it never blocks, allocates or makes a system
+// call, even when the system is overloaded and the same warning comes
+// thousands of times a second.  The ring is a bounded queue with a
+// sequence number per slot, so any number of threads can write to it.
+
+#if !defined(__WINDOWS_MM__)
+
+#include <pthread.h>
+#include <time.h>
+#include <map>
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Entries in the ring, must be a power of two.
+#define RTMIDI_LOG_SIZE 256
+// How often the log thread writes out the ring, in nanoseconds.
+#define RTMIDI_LOG_PERIOD 50000000
+// Repeats of a message within this many nanoseconds are only counted.
+#define RTMIDI_LOG_INTERVAL 1000000000LL
+
+struct RtMidiLogEntry {
+  unsigned long sequence; // Equals the write position when the slot is free, and one more when it's written.
+  const char *text;
+  int code;               // An errno value, or 0.
+};
+
+struct RtMidiLogRepeats {
+  long long lastWritten;
+  unsigned long count;
+
+  RtMidiLogRepeats()
+  :lastWritten(0), count(0) {}
+};
+
+static RtMidiLogEntry rtMidiLogRing[RTMIDI_LOG_SIZE];
+static unsigned long rtMidiLogHead = 0; // Next position to write.
+static unsigned long rtMidiLogTail = 0; // Next position to read, only used by the log thread.
+static RtMidiLogStats rtMidiLogCounters;
+static pthread_once_t rtMidiLogOnce = PTHREAD_ONCE_INIT;
+static pthread_t rtMidiLogThread;
+static bool rtMidiLogRunning = false;
+static bool rtMidiLogStopRequested = false;
+
+static long long rtMidiLogNow( void )
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void rtMidiLogWrite( const char *text, int code, unsigned long repeats )
+{
+  std::cerr << '\n' << text;
+  if ( code != 0 ) std::cerr << " (" << strerror( code ) << ")";
+  if ( repeats > 0 ) std::cerr << "\n(" << repeats << " more since last reported)";
+  std::cerr << "\n\n";
+}
+
+// Write out what's in the ring.  With final set, the repeats still
+// being counted are written too.
+static void rtMidiLogDrain( std::map<const char *, RtMidiLogRepeats> &repeats, bool final )
+{
+  long long now = rtMidiLogNow();
+  for ( ;; ) {
+    RtMidiLogEntry *entry = &rtMidiLogRing[rtMidiLogTail & ( RTMIDI_LOG_SIZE - 1 )];
+    if ( __atomic_load_n( &entry->sequence, __ATOMIC_ACQUIRE ) != rtMidiLogTail + 1 ) break;
+    const char *text = entry->text;
+    int code = entry->code;
+    __atomic_store_n( &entry->sequence, rtMidiLogTail + RTMIDI_LOG_SIZE, __ATOMIC_RELEASE );
+    rtMidiLogTail++;
+
+    RtMidiLogRepeats &message = repeats[text];
+    if ( message.lastWritten != 0 && now - message.lastWritten < RTMIDI_LOG_INTERVAL ) {
+      message.count++;
+      __atomic_store_n( &rtMidiLogCounters.suppressed,
+                        __atomic_load_n( &rtMidiLogCounters.suppressed, __ATOMIC_RELAXED ) + 1, __ATOMIC_RELAXED );
+      continue;
+    }
+    rtMidiLogWrite( text, code, message.count );
+    message.lastWritten = now;
+    message.count = 0;
+  }
+
+  // Repeats that weren't followed by a message after the interval are
+  // reported on their own.
+  std::map<const char *, RtMidiLogRepeats>::iterator it;
+  for ( it = repeats.begin(); it != repeats.end(); ++it ) {
+    if ( it->second.count == 0 ) continue;
+    if ( !final && now - it->second.lastWritten < RTMIDI_LOG_INTERVAL ) continue;
+    std::cerr << '\n' << it->first << "\n(repeated " << it->second.count << " times)\n\n";
+    it->second.lastWritten = now;
+    it->second.count = 0;
+  }
+
+  static unsigned long dropped = 0;
+  unsigned long totalDropped = __atomic_load_n( &rtMidiLogCounters.dropped, __ATOMIC_RELAXED );
+  if ( totalDropped != dropped ) {
+    std::cerr << "\nRtMidi: " << totalDropped - dropped << " log messages lost, the log was full.\n\n";
+    dropped = totalDropped;
+  }
+}
+
+static void *rtMidiLogThreadMain( void * )
+{
+#if defined(__linux__)
+  // Writing the log must never compete with the MIDI threads.
+  pthread_setname_np( pthread_self(), "rtmidi-log" );
+  setpriority( PRIO_PROCESS, syscall( SYS_gettid ), 19 );
+#endif
+  std::map<const char *, RtMidiLogRepeats> repeats;
+  struct timespec period = { 0, RTMIDI_LOG_PERIOD };
+  while ( !__atomic_load_n( &rtMidiLogStopRequested, __ATOMIC_ACQUIRE ) ) {
+    rtMidiLogDrain( repeats, false );
+    nanosleep( &period, 0 );
+  }
+  rtMidiLogDrain( repeats, true );
+  return 0;
+}
+
+static void rtMidiLogStartThread( void )
+{
+  for ( unsigned long i=0; i<RTMIDI_LOG_SIZE; i++ )
+    rtMidiLogRing[i].sequence = i;
+  if ( pthread_create( &rtMidiLogThread, NULL, rtMidiLogThreadMain, NULL ) == 0 )
+    __atomic_store_n( &rtMidiLogRunning, true, __ATOMIC_RELEASE );
+}
+
+// The log thread is started with the first RtMidi instance and stopped
+// at exit, after writing what's left in the ring.
+static void rtMidiLogStart( void )
+{
+  pthread_once( &rtMidiLogOnce, rtMidiLogStartThread );
+}
+
+struct RtMidiLogShutdown {
+  ~RtMidiLogShutdown()
+  {
+    if ( !__atomic_load_n( &rtMidiLogRunning, __ATOMIC_ACQUIRE ) ) return;
+    __atomic_store_n( &rtMidiLogStopRequested, true, __ATOMIC_RELEASE );
+    pthread_join( rtMidiLogThread, NULL );
+    __atomic_store_n( &rtMidiLogRunning, false, __ATOMIC_RELEASE );
+  }
+};
+static RtMidiLogShutdown rtMidiLogShutdown;
+
+static void rtMidiLog( const char *text, int code = 0 )
+{
+  // Without the log thread, before it started or after it stopped,
+  // the message is written straight away.
+  if ( !__atomic_load_n( &rtMidiLogRunning, __ATOMIC_ACQUIRE ) ) {
+    rtMidiLogWrite( text, code, 0 );
+    return;
+  }
+
+  unsigned long position = __atomic_load_n( &rtMidiLogHead, __ATOMIC_RELAXED );
+  RtMidiLogEntry *entry;
+  for ( ;; ) {
+    entry = &rtMidiLogRing[position & ( RTMIDI_LOG_SIZE - 1 )];
+    long difference = (long) ( __atomic_load_n( &entry->sequence, __ATOMIC_ACQUIRE ) - position );
+    if ( difference == 0 ) {
+      // A failed exchange loads the current position for the next try.
+      if ( __atomic_compare_exchange_n( &rtMidiLogHead, &position, position + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    }
+    else if ( difference < 0 ) {
+      // Full, the log thread is behind.
+      __atomic_add_fetch( &rtMidiLogCounters.dropped, 1, __ATOMIC_RELAXED );
+      return;
+    }
+    else
+      position = __atomic_load_n( &rtMidiLogHead, __ATOMIC_RELAXED );
+  }
+  entry->text = text;
+  entry->code = code;
+  __atomic_store_n( &entry->sequence, position + 1, __ATOMIC_RELEASE );
+  __atomic_add_fetch( &rtMidiLogCounters.logged, 1, __ATOMIC_RELAXED );
+}
+
+RtMidiLogStats RtMidi :: getLogStats( void ) throw()
+{
+  RtMidiLogStats stats;
+  stats.logged = __atomic_load_n( &rtMidiLogCounters.logged, __ATOMIC_RELAXED );
+  stats.suppressed = __atomic_load_n( &rtMidiLogCounters.suppressed, __ATOMIC_RELAXED );
+  stats.dropped = __atomic_load_n( &rtMidiLogCounters.dropped, __ATOMIC_RELAXED );
+  return stats;
+}
+
+#else
+
+// Windows MM calls back on its own threads, the messages are written
+// from there as before.
+static void rtMidiLogStart( void )
+{
+}
+
+static void rtMidiLog( const char *text, int code = 0 )
+{
+  std::cerr << '\n' << text;
+  if ( code != 0 ) std::cerr << " (" << strerror( code ) << ")";
+  std::cerr << "\n\n";
+}
+
+RtMidiLogStats RtMidi :: getLogStats( void ) throw()
+{
+  return RtMidiLogStats();
+}
+
+#endif
+
 //*********************************************************************//
 //  Common MidiApi Definitions
 //*********************************************************************//
@@ -226,6 +447,7 @@ RtMidiOut :: ~RtMidiOut() throw()
 MidiApi :: MidiApi( void )
   : apiData_( 0 ), connected_( false ), errorCallback_(0)
 {
+  rtMidiLogStart();
 }
 
 MidiApi :: ~MidiApi( void )
@@ -237,7 +459,7 @@ void MidiApi :: setErrorCallback( RtMidiErrorCallback errorCallback )
     errorCallback_ = errorCallback;
 }
 
-void MidiApi :: error( RtMidiError::Type type, std::string errorString )
+void MidiApi :: error( RtMidiError::Type type, const std::string &errorString )
 {
   if ( errorCallback_ ) {
     static bool firstErrorOccured = false;
@@ -267,6 +489,17 @@ void MidiApi :: error( RtMidiError::Type type, std::string errorString )
   }
 }
 
+void MidiApi :: warning( const char *text )
+{
+  // An error callback gets the message as a string, like any other.
+  if ( errorCallback_ ) {
+    errorString_ = text;
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+  rtMidiLog( text );
+}
+
 //*********************************************************************//
 //  Common MidiInApi Definitions
 //*********************************************************************//
@@ -326,6 +559,11 @@ void MidiInApi :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense )
   if ( midiSense ) inputData_.ignoreFlags |= 0x04;
 }
 
+void MidiInApi :: setSysexStreaming( bool enable )
+{
+  inputData_.streamSysex = enable;
+}
+
 double MidiInApi :: getMessage( std::vector<unsigned char> *message )
 {
   message->clear();
@@ -342,14 +580,71 @@ double MidiInApi :: getMessage( std::vector<unsigned char> *message )
   std::vector<unsigned char> *bytes = &(inputData_.queue.ring[inputData_.queue.front].bytes);
   message->assign( bytes->begin(), bytes->end() );
   double deltaTime = inputData_.queue.ring[inputData_.queue.front].timeStamp;
-  inputData_.queue.size--;
   inputData_.queue.front++;
   if ( inputData_.queue.front == inputData_.queue.ringSize )
     inputData_.queue.front = 0;
+  __sync_fetch_and_sub( &inputData_.queue.size, 1 );
 
   return deltaTime;
 }
 
+unsigned int MidiInApi :: getMessages( std::vector<RtMidiMessage> *messages )
+{
+  if ( inputData_.usingCallback ) {
+    errorString_ = "RtMidiIn::getMessages: a user callback is currently set for this port.";
+    error( RtMidiError::WARNING, errorString_ );
+    return 0;
+  }
+
+  // Only take what was queued when we started, the input thread may
+  // keep pushing behind us.
+  unsigned int nMessages = inputData_.queue.size;
+  if ( nMessages == 0 ) return 0;
+  if ( messages->size() < nMessages )
+    messages->resize( nMessages );
+
+  // Swap rather than copy the bytes.  The queue slot gets the caller's
+  // old vector, so its capacity is reused by the next incoming message.
+  MidiMessage *ring = inputData_.queue.ring;
+  unsigned int front = inputData_.queue.front;
+  for ( unsigned int i=0; i<nMessages; ++i ) {
+    (*messages)[i].bytes.swap( ring[front].bytes );
+    (*messages)[i].timeStamp = ring[front].timeStamp;
+    (*messages)[i].arrivalTime = ring[front].arrivalTime;
+    if ( ++front == inputData_.queue.ringSize )
+      front = 0;
+  }
+  inputData_.queue.front = front;
+  __sync_fetch_and_sub( &inputData_.queue.size, nMessages );
+
+  return nMessages;
+}
+
+RtMidiInStats MidiInApi :: getStats( void )
+{
+  RtMidiInStats stats;
+  stats.drops = __atomic_load_n( &inputData_.stats.drops, __ATOMIC_RELAXED );
+  stats.overruns = __atomic_load_n( &inputData_.stats.overruns, __ATOMIC_RELAXED );
+  stats.queueHighWater = __atomic_load_n( &inputData_.stats.queueHighWater, __ATOMIC_RELAXED );
+  stats.heartbeat = __atomic_load_n( &inputData_.stats.heartbeat, __ATOMIC_RELAXED );
+  stats.threadId = __atomic_load_n( &inputData_.stats.threadId, __ATOMIC_RELAXED );
+  return stats;
+}
+
+// The input counters have a single writer, the thread that receives
+// the messages, so they are updated without a locked instruction and
+// only stored atomically for getStats().
+static inline void rtMidiCount( unsigned long *counter )
+{
+  __atomic_store_n( counter, __atomic_load_n( counter, __ATOMIC_RELAXED ) + 1, __ATOMIC_RELAXED );
+}
+
+static inline void rtMidiQueued( RtMidiInStats *stats, unsigned int queueSize )
+{
+  if ( queueSize > __atomic_load_n( &stats->queueHighWater, __ATOMIC_RELAXED ) )
+    __atomic_store_n( &stats->queueHighWater, queueSize, __ATOMIC_RELAXED );
+}
+
 //*********************************************************************//
 //  Common MidiOutApi Definitions
 //*********************************************************************//
@@ -363,6 +658,13 @@ MidiOutApi :: ~MidiOutApi( void )
 {
 }
 
+void MidiOutApi :: setOutputDelay( double seconds )
+{
+  if ( seconds <= 0 ) return;
+  errorString_ = "MidiOutApi::setOutputDelay: scheduled output is not supported by this API, messages are sent immediately.";
+  error( RtMidiError::WARNING, errorString_ );
+}
+
 // *************************************************** //
 //
 // OS/API-specific methods.
@@ -468,9 +770,12 @@ static void midiInputCallback( const MIDIPacketList *list, void *procRef, void *
             if ( data->queue.back == data->queue.ringSize )
               data->queue.back = 0;
             data->queue.size++;
+            rtMidiQueued( &data->stats, data->queue.size );
+          }
+          else {
+            rtMidiCount( &data->stats.drops );
+            rtMidiLog( "MidiInCore: message queue limit reached!!" );
           }
-          else
-            std::cerr << "\nMidiInCore: message queue limit reached!!\n\n";
         }
         message.bytes.clear();
       }
@@ -532,9 +837,12 @@ static void midiInputCallback( const MIDIPacketList *list, void *procRef, void *
                 if ( data->queue.back == data->queue.ringSize )
                   data->queue.back = 0;
                 data->queue.size++;
+                rtMidiQueued( &data->stats, data->queue.size );
+              }
+              else {
+                rtMidiCount( &data->stats.drops );
+                rtMidiLog( "MidiInCore: message queue limit reached!!" );
               }
-              else
-                std::cerr << "\nMidiInCore: message queue limit reached!!\n\n";
             }
             message.bytes.clear();
           }
@@ -1101,10 +1409,38 @@ void MidiOutCore :: sendMessage( std::vector<unsigned char> *message )
 
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
 
 // ALSA header file.
 #include <alsa/asoundlib.h>
 
+// Records of each message for the pipeline tracing of MIDIcloro (see
+// trace.h), only compiled in when MIDICLORO_TRACE is defined.
+#if defined(MIDICLORO_TRACE)
+#include "../trace.h"
+#else
+#define TRACE_AT( time, stage, port, eventId, detail ) ((void)0)
+#endif
+
+// USDT probes (provider rtmidi) for perf and bpftrace, a single nop
+// until a tracer attaches.  Built in when sys/sdt.h is installed,
+// unless MIDICLORO_NO_PROBES is defined.
+#if !defined(MIDICLORO_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RTMIDI_PROBES
+#endif
+#endif
+#if defined(RTMIDI_PROBES)
+#define RTMIDI_PROBE1( name, a ) DTRACE_PROBE1( rtmidi, name, a )
+#define RTMIDI_PROBE3( name, a, b, c ) DTRACE_PROBE3( rtmidi, name, a, b, c )
+#else
+#define RTMIDI_PROBE1( name, a ) ((void)0)
+#define RTMIDI_PROBE3( name, a, b, c ) ((void)0)
+#endif
+
 // A structure to hold variables related to the ALSA API
 // implementation.
 struct AlsaMidiData {
@@ -1120,8 +1456,27 @@ struct AlsaMidiData {
   unsigned long long lastTime;
   int queue_id; // an input queue is needed to get timestamped events
   int trigger_fds[2];
+  struct pollfd *outPollFds; // output descriptors, polled for POLLOUT
+  int outPollCount;
+  std::vector< std::vector<unsigned char> > retryRing; // messages held back by a full output pool
+  unsigned int retryFront;
+  unsigned int retrySize;
+  unsigned long retryDrops; // messages lost to a full retry queue, read atomically by getDrops()
+  int outQueue; // queue for scheduled output, -1 until an output delay is set
+  snd_seq_real_time_t outDelay; // zero to send directly
 };
 
+// Number of messages or sysex chunks the output retry queue can hold.
+#define ALSA_RETRY_QUEUE_SIZE 1024
+
+// Sysex is passed to the sequencer in chunks of this size, the same
+// segmentation the sequencer uses for data from MIDI devices.
+#define ALSA_SYSEX_CHUNK 256
+
+// Sysex messages and streamed sysex chunks (which start with a data
+// byte, or with 0xF7 when only the end is left) skip the MIDI event encoder.
+#define IS_SYSEX_DATA( byte ) ( (byte) == 0xF0 || (byte) == 0xF7 || (byte) < 0x80 )
+
 #define PORT_TYPE( pinfo, bits ) ((snd_seq_port_info_get_capability(pinfo) & (bits)) == (bits))
 
 //*********************************************************************//
@@ -1129,19 +1484,39 @@ struct AlsaMidiData {
 //  Class Definitions: MidiInAlsa
 //*********************************************************************//
 
+// Calculate the delta-time in seconds since the previous message from
+// the ALSA sequencer event time data (thanks to Pedro Lopez-Cabanillas!).
+static double alsaDeltaTime( MidiInApi::RtMidiInData *data, AlsaMidiData *apiData, const snd_seq_event_t *ev )
+{
+  unsigned long long time, lastTime;
+  time = ( ev->time.time.tv_sec * 1000000 ) + ( ev->time.time.tv_nsec/1000 );
+  lastTime = time;
+  time -= apiData->lastTime;
+  apiData->lastTime = lastTime;
+  if ( data->firstMessage == true ) {
+    data->firstMessage = false;
+    return 0.0;
+  }
+  return time * 0.000001;
+}
+
 static void *alsaMidiHandler( void *ptr )
 {
   MidiInApi::RtMidiInData *data = static_cast<MidiInApi::RtMidiInData *> (ptr);
   AlsaMidiData *apiData = static_cast<AlsaMidiData *> (data->apiData);
 
   long nBytes;
-  unsigned long long time, lastTime;
   bool continueSysex = false;
   bool doDecode = false;
+  bool draining = false;
   MidiInApi::MidiMessage message;
   int poll_fd_count;
   struct pollfd *poll_fds;
 
+  // Give the thread a name of its own, e.g. for per-thread CPU accounting.
+  pthread_setname_np( pthread_self(), "rtmidi-alsa-in" );
+  __atomic_store_n( &data->stats.threadId, (int) syscall( SYS_gettid ), __ATOMIC_RELAXED );
+
   snd_seq_event_t *ev;
   int result;
   apiData->bufferSize = 32;
@@ -1170,8 +1545,10 @@ static void *alsaMidiHandler( void *ptr )
 
   while ( data->doInput ) {
 
-    if ( snd_seq_event_input_pending( apiData->seq, 1 ) == 0 ) {
-      // No data pending
+    if ( !draining ) {
+      // Sleep until the sequencer has data or we are told to stop.
+      // Waiting for input isn't a stall, the heartbeat is 0 meanwhile.
+      __atomic_store_n( &data->stats.heartbeat, 0, __ATOMIC_RELAXED );
       if ( poll( poll_fds, poll_fd_count, -1) >= 0 ) {
         if ( poll_fds[0].revents & POLLIN ) {
           bool dummy;
@@ -1179,24 +1556,43 @@ static void *alsaMidiHandler( void *ptr )
           (void) res;
         }
       }
-      continue;
+      draining = true;
     }
 
-    // If here, there should be data.
+    // A watchdog can tell from the heartbeat when the thread is stuck
+    // on an event.
+    struct timespec beat;
+    clock_gettime( CLOCK_MONOTONIC, &beat );
+    __atomic_store_n( &data->stats.heartbeat, (long long) beat.tv_sec * 1000000000LL + beat.tv_nsec, __ATOMIC_RELAXED );
+
+    // Drain every pending event before polling again.  The client is
+    // non-blocking, so -EAGAIN tells us the sequencer is empty.
     result = snd_seq_event_input( apiData->seq, &ev );
+    if ( result == -EAGAIN ) {
+      draining = false;
+      continue;
+    }
     if ( result == -ENOSPC ) {
-      std::cerr << "\nMidiInAlsa::alsaMidiHandler: MIDI input buffer overrun!\n\n";
+      rtMidiCount( &data->stats.overruns );
+      RTMIDI_PROBE1( alsa_overrun, data->stats.overruns );
+      rtMidiLog( "MidiInAlsa::alsaMidiHandler: MIDI input buffer overrun!" );
       continue;
     }
     else if ( result <= 0 ) {
-      std::cerr << "\nMidiInAlsa::alsaMidiHandler: unknown MIDI input error!\n";
-      perror("System reports");
+      rtMidiLog( "MidiInAlsa::alsaMidiHandler: unknown MIDI input error!", -result );
+      draining = false;
       continue;
     }
 
     // This is a bit weird, but we now have to decode an ALSA MIDI
     // event (back) into MIDI bytes.  We'll ignore non-MIDI types.
-    if ( !continueSysex ) message.bytes.clear();
+    if ( !continueSysex ) {
+      message.bytes.clear();
+      // A message arrives with its first event, for sysex that's the first chunk.
+      struct timespec now;
+      clock_gettime( CLOCK_MONOTONIC, &now );
+      message.arrivalTime = (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
 
     doDecode = false;
     switch ( ev->type ) {
@@ -1236,13 +1632,23 @@ static void *alsaMidiHandler( void *ptr )
 
 		case SND_SEQ_EVENT_SYSEX:
       if ( (data->ignoreFlags & 0x01) ) break;
+      if ( data->streamSysex ) {
+        // Deliver the chunk as it is, straight from the event data.
+        // Memory use stays bounded by the chunk size, however large
+        // the dump is. This is the only copy of it on the way to the
+        // queue.
+        const unsigned char *chunk = (const unsigned char *) ev->data.ext.ptr;
+        message.bytes.assign( chunk, chunk + ev->data.ext.len );
+        message.timeStamp = alsaDeltaTime( data, apiData, ev );
+        break;
+      }
       if ( ev->data.ext.len > apiData->bufferSize ) {
         apiData->bufferSize = ev->data.ext.len;
         free( buffer );
         buffer = (unsigned char *) malloc( apiData->bufferSize );
         if ( buffer == NULL ) {
           data->doInput = false;
-          std::cerr << "\nMidiInAlsa::alsaMidiHandler: error resizing buffer memory!\n\n";
+          rtMidiLog( "MidiInAlsa::alsaMidiHandler: error resizing buffer memory!" );
           break;
         }
       }
@@ -1269,22 +1675,7 @@ static void *alsaMidiHandler( void *ptr )
         if ( !continueSysex ) {
 
           // Calculate the time stamp:
-          message.timeStamp = 0.0;
-
-          // Method 1: Use the system time.
-          //(void)gettimeofday(&tv, (struct timezone *)NULL);
-          //time = (tv.tv_sec * 1000000) + tv.tv_usec;
-
-          // Method 2: Use the ALSA sequencer event time data.
-          // (thanks to Pedro Lopez-Cabanillas!).
-          time = ( ev->time.time.tv_sec * 1000000 ) + ( ev->time.time.tv_nsec/1000 );
-          lastTime = time;
-          time -= apiData->lastTime;
-          apiData->lastTime = lastTime;
-          if ( data->firstMessage == true )
-            data->firstMessage = false;
-          else
-            message.timeStamp = time * 0.000001;
+          message.timeStamp = alsaDeltaTime( data, apiData, ev );
         }
         else {
 #if defined(__RTMIDI_DEBUG__)
@@ -1296,6 +1687,8 @@ static void *alsaMidiHandler( void *ptr )
 
     snd_seq_free_event( ev );
     if ( message.bytes.size() == 0 || continueSysex ) continue;
+    TRACE_AT( message.arrivalTime, TRACE_RECEIVE, TRACE_NO_PORT, message.arrivalTime, message.bytes[0] );
+    RTMIDI_PROBE3( alsa_receive, message.arrivalTime, message.bytes[0], message.bytes.size() );
 
     if ( data->usingCallback ) {
       RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) data->userCallback;
@@ -1304,13 +1697,24 @@ static void *alsaMidiHandler( void *ptr )
     else {
       // As long as we haven't reached our queue size limit, push the message.
       if ( data->queue.size < data->queue.ringSize ) {
-        data->queue.ring[data->queue.back++] = message;
+        // Swap the bytes into the slot instead of copying them, so a
+        // streamed sysex chunk is copied once, from the event into a
+        // buffer that getMessages() hands back for reuse.
+        MidiInApi::MidiMessage *slot = &data->queue.ring[data->queue.back++];
+        slot->bytes.swap( message.bytes );
+        slot->timeStamp = message.timeStamp;
+        slot->arrivalTime = message.arrivalTime;
         if ( data->queue.back == data->queue.ringSize )
           data->queue.back = 0;
-        data->queue.size++;
+        // The queue is read from another thread, publish the slot atomically.
+        rtMidiQueued( &data->stats, __sync_add_and_fetch( &data->queue.size, 1 ) );
+      }
+      else {
+        rtMidiCount( &data->stats.drops );
+        TRACE_AT( message.arrivalTime, TRACE_DROP, TRACE_NO_PORT, message.arrivalTime, message.bytes[0] );
+        RTMIDI_PROBE3( alsa_queue_full, message.arrivalTime, message.bytes[0], data->queue.ringSize );
+        rtMidiLog( "MidiInAlsa: message queue limit reached!!" );
       }
-      else
-        std::cerr << "\nMidiInAlsa: message queue limit reached!!\n\n";
     }
   }
 
@@ -1376,6 +1780,10 @@ void MidiInAlsa :: initialize( const std::string& clientName )
   data->thread = data->dummy_thread_id;
   data->trigger_fds[0] = -1;
   data->trigger_fds[1] = -1;
+  data->outPollFds = 0;
+  data->outPollCount = 0;
+  data->retryFront = 0;
+  data->retrySize = 0;
   apiData_ = (void *) data;
   inputData_.apiData = (void *) data;
 
@@ -1683,6 +2091,8 @@ MidiOutAlsa :: ~MidiOutAlsa()
   if ( data->vport >= 0 ) snd_seq_delete_port( data->seq, data->vport );
   if ( data->coder ) snd_midi_event_free( data->coder );
   if ( data->buffer ) free( data->buffer );
+  if ( data->outPollFds ) free( data->outPollFds );
+  if ( data->outQueue >= 0 ) snd_seq_free_queue( data->seq, data->outQueue );
   snd_seq_close( data->seq );
   delete data;
 }
@@ -1709,6 +2119,14 @@ void MidiOutAlsa :: initialize( const std::string& clientName )
   data->bufferSize = 32;
   data->coder = 0;
   data->buffer = 0;
+  data->outPollFds = 0;
+  data->outPollCount = 0;
+  data->retryFront = 0;
+  data->retrySize = 0;
+  data->retryDrops = 0;
+  data->outQueue = -1;
+  data->outDelay.tv_sec = 0;
+  data->outDelay.tv_nsec = 0;
   int result = snd_midi_event_new( data->bufferSize, &data->coder );
   if ( result < 0 ) {
     delete data;
@@ -1724,9 +2142,98 @@ void MidiOutAlsa :: initialize( const std::string& clientName )
     return;
   }
   snd_midi_event_init( data->coder );
+
+  // The client is opened in non-blocking mode, so a full output pool
+  // makes snd_seq_event_output() return -EAGAIN.  Such messages are kept
+  // in a retry queue and passed on by flushOutput() once the sequencer
+  // reports POLLOUT again.  The queue is allocated here, with room for
+  // a sysex chunk in every entry, so holding a message back never allocates.
+  data->retryRing.resize( ALSA_RETRY_QUEUE_SIZE );
+  for ( unsigned int i=0; i<ALSA_RETRY_QUEUE_SIZE; ++i )
+    data->retryRing[i].reserve( ALSA_SYSEX_CHUNK );
+  data->outPollCount = snd_seq_poll_descriptors_count( seq, POLLOUT );
+  if ( data->outPollCount > 0 ) {
+    data->outPollFds = (struct pollfd *) malloc( data->outPollCount * sizeof( struct pollfd ) );
+    if ( data->outPollFds == NULL ) {
+      delete data;
+      errorString_ = "MidiOutAlsa::initialize: error allocating poll descriptors!\n\n";
+      error( RtMidiError::MEMORY_ERROR, errorString_ );
+      return;
+    }
+    snd_seq_poll_descriptors( seq, data->outPollFds, data->outPollCount, POLLOUT );
+  }
   apiData_ = (void *) data;
 }
 
+// The last entry of the retry queue is kept for an F7 that ends a sysex
+// cut short, so a dropped sysex never leaves the port inside it.
+static const unsigned char ALSA_SYSEX_END = 0xF7;
+
+static void alsaRetryAppend( AlsaMidiData *data, const unsigned char *bytes, unsigned int nBytes )
+{
+  data->retryRing[(data->retryFront + data->retrySize) % ALSA_RETRY_QUEUE_SIZE].assign( bytes, bytes + nBytes );
+  data->retrySize++;
+}
+
+// Put a message at the back of the output retry queue.  A message that
+// finds the queue full is dropped and counted.  Returns false if it was dropped.
+static bool alsaRetryPush( AlsaMidiData *data, const unsigned char *bytes, unsigned int nBytes )
+{
+  if ( data->retrySize >= ALSA_RETRY_QUEUE_SIZE - 1 ) {
+    __atomic_store_n( &data->retryDrops, data->retryDrops + 1, __ATOMIC_RELAXED );
+    return false;
+  }
+  alsaRetryAppend( data, bytes, nBytes );
+  return true;
+}
+
+// Queue sysex bytes for retry in sequencer sized chunks, so a queued
+// entry always fits in a single event.  They are queued whole or not at
+// all: bytes that don't fit are dropped and counted, and when the port
+// is inside the sysex (inSysex: part of it went out already, or it
+// continues a streamed dump) an F7 is queued to end it.  Returns false
+// if the bytes were dropped.
+static bool alsaRetryPushSysex( AlsaMidiData *data, const unsigned char *bytes, unsigned int nBytes, bool inSysex )
+{
+  unsigned int nChunks = ( nBytes + ALSA_SYSEX_CHUNK - 1 ) / ALSA_SYSEX_CHUNK;
+  if ( data->retrySize + nChunks > ALSA_RETRY_QUEUE_SIZE - 1 ) {
+    __atomic_store_n( &data->retryDrops, data->retryDrops + 1, __ATOMIC_RELAXED );
+    // A full queue already ends with such an F7
+    if ( inSysex && data->retrySize < ALSA_RETRY_QUEUE_SIZE )
+      alsaRetryAppend( data, &ALSA_SYSEX_END, 1 );
+    return false;
+  }
+  for ( unsigned int offset=0; offset<nBytes; offset+=ALSA_SYSEX_CHUNK )
+    alsaRetryAppend( data, bytes + offset, std::min( nBytes - offset, (unsigned int) ALSA_SYSEX_CHUNK ) );
+  return true;
+}
+
+// Prepare a sequencer event addressed to our subscribers.
+static void alsaPrepareEvent( AlsaMidiData *data, snd_seq_event_t *ev )
+{
+  snd_seq_ev_clear( ev );
+  snd_seq_ev_set_source( ev, data->vport );
+  snd_seq_ev_set_subs( ev );
+  if ( data->outDelay.tv_sec == 0 && data->outDelay.tv_nsec == 0 )
+    snd_seq_ev_set_direct( ev );
+  else
+    snd_seq_ev_schedule_real( ev, data->outQueue, 1, &data->outDelay );
+}
+
+// Encode a MIDI message into a sequencer event.  Sysex data points
+// directly at the message bytes, which must outlive the event output.
+static long alsaEncodeMessage( AlsaMidiData *data, const std::vector<unsigned char> *message, snd_seq_event_t *ev )
+{
+  unsigned int nBytes = message->size();
+  alsaPrepareEvent( data, ev );
+  if ( nBytes > 0 && IS_SYSEX_DATA( (*message)[0] ) ) {
+    snd_seq_ev_set_sysex( ev, nBytes, &(*message)[0] );
+    return nBytes;
+  }
+  for ( unsigned int i=0; i<nBytes; ++i ) data->buffer[i] = (*message)[i];
+  return snd_midi_event_encode( data->coder, data->buffer, (long)nBytes, ev );
+}
+
 unsigned int MidiOutAlsa :: getPortCount()
 {
 	snd_seq_port_info_t *pinfo;
@@ -1859,6 +2366,11 @@ void MidiOutAlsa :: sendMessage( std::vector<unsigned char> *message )
   int result;
   AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
   unsigned int nBytes = message->size();
+  RTMIDI_PROBE3( alsa_send, nBytes > 0 ? (*message)[0] : 0, nBytes, data->retrySize );
+  if ( nBytes > 0 && IS_SYSEX_DATA( (*message)[0] ) ) {
+    sendSysex( &(*message)[0], nBytes );
+    return;
+  }
   if ( nBytes > data->bufferSize ) {
     data->bufferSize = nBytes;
     result = snd_midi_event_resize_buffer ( data->coder, nBytes);
@@ -1877,28 +2389,146 @@ void MidiOutAlsa :: sendMessage( std::vector<unsigned char> *message )
   }
 
   snd_seq_event_t ev;
-  snd_seq_ev_clear(&ev);
-  snd_seq_ev_set_source(&ev, data->vport);
-  snd_seq_ev_set_subs(&ev);
-  snd_seq_ev_set_direct(&ev);
-  for ( unsigned int i=0; i<nBytes; ++i ) data->buffer[i] = message->at(i);
-  result = snd_midi_event_encode( data->coder, data->buffer, (long)nBytes, &ev );
+  result = alsaEncodeMessage( data, message, &ev );
   if ( result < (int)nBytes ) {
-    errorString_ = "MidiOutAlsa::sendMessage: event parsing error!";
-    error( RtMidiError::WARNING, errorString_ );
+    warning( "MidiOutAlsa::sendMessage: event parsing error!" );
+    return;
+  }
+
+  // Keep the original order: while older messages are waiting to be
+  // retried, new messages are queued behind them.
+  if ( data->retrySize > 0 && flushOutput() > 0 ) {
+    if ( !alsaRetryPush( data, &(*message)[0], nBytes ) )
+      warning( "MidiOutAlsa::sendMessage: retry queue full, message dropped." );
+    RTMIDI_PROBE1( alsa_send_held, data->retrySize );
     return;
   }
 
   // Send the event.
   result = snd_seq_event_output(data->seq, &ev);
+  if ( result == -EAGAIN ) {
+    if ( !alsaRetryPush( data, &(*message)[0], nBytes ) )
+      warning( "MidiOutAlsa::sendMessage: retry queue full, message dropped." );
+    RTMIDI_PROBE1( alsa_send_held, data->retrySize );
+    return;
+  }
   if ( result < 0 ) {
-    errorString_ = "MidiOutAlsa::sendMessage: error sending MIDI message to port.";
-    error( RtMidiError::WARNING, errorString_ );
+    warning( "MidiOutAlsa::sendMessage: error sending MIDI message to port." );
     return;
   }
+  // An -EAGAIN from draining leaves the event in the output buffer,
+  // from where flushOutput() passes it on later.
   snd_seq_drain_output(data->seq);
 }
 
+void MidiOutAlsa :: sendSysex( const unsigned char *bytes, unsigned int nBytes )
+{
+  // A complete sysex message or a chunk of a streamed one.  The bytes
+  // go to the sequencer in chunks without passing the event encoder,
+  // so even a large dump is never copied into an intermediate buffer.
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  snd_seq_event_t ev;
+  for ( unsigned int offset=0; offset<nBytes; offset+=ALSA_SYSEX_CHUNK ) {
+    unsigned int chunkSize = std::min( nBytes - offset, (unsigned int) ALSA_SYSEX_CHUNK );
+    bool inSysex = offset > 0 || bytes[0] != 0xF0;
+    if ( data->retrySize > 0 && flushOutput() > 0 ) {
+      if ( !alsaRetryPushSysex( data, bytes + offset, nBytes - offset, inSysex ) )
+        warning( "MidiOutAlsa::sendSysex: retry queue full, sysex dropped." );
+      return;
+    }
+    alsaPrepareEvent( data, &ev );
+    snd_seq_ev_set_sysex( &ev, chunkSize, bytes + offset );
+    int result = snd_seq_event_output( data->seq, &ev );
+    if ( result == -EAGAIN ) {
+      if ( !alsaRetryPushSysex( data, bytes + offset, nBytes - offset, inSysex ) )
+        warning( "MidiOutAlsa::sendSysex: retry queue full, sysex dropped." );
+      return;
+    }
+    if ( result < 0 ) {
+      warning( "MidiOutAlsa::sendSysex: error sending MIDI message to port." );
+      return;
+    }
+    snd_seq_drain_output( data->seq );
+  }
+}
+
+void MidiOutAlsa :: setOutputDelay( double seconds )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( seconds > 0 && data->outQueue < 0 ) {
+    // Delayed events wait in a queue of our own, relative to its
+    // real time.  The high resolution timer, where the kernel has it,
+    // keeps them to the microsecond instead of the system tick.
+    data->outQueue = snd_seq_alloc_named_queue( data->seq, "RtMidi Output Queue" );
+    if ( data->outQueue < 0 ) {
+      errorString_ = "MidiOutAlsa::setOutputDelay: error creating ALSA sequencer queue, messages are sent immediately.";
+      error( RtMidiError::WARNING, errorString_ );
+      return;
+    }
+    snd_seq_queue_timer_t *timer;
+    snd_timer_id_t *timerId;
+    snd_seq_queue_timer_alloca( &timer );
+    snd_timer_id_alloca( &timerId );
+    snd_timer_id_set_class( timerId, SND_TIMER_CLASS_GLOBAL );
+    snd_timer_id_set_sclass( timerId, SND_TIMER_SCLASS_NONE );
+    snd_timer_id_set_card( timerId, -1 );
+    snd_timer_id_set_device( timerId, SND_TIMER_GLOBAL_HRTIMER );
+    snd_timer_id_set_subdevice( timerId, 0 );
+    if ( snd_seq_get_queue_timer( data->seq, data->outQueue, timer ) == 0 ) {
+      snd_seq_queue_timer_set_id( timer, timerId );
+      snd_seq_set_queue_timer( data->seq, data->outQueue, timer );
+    }
+    snd_seq_start_queue( data->seq, data->outQueue, NULL );
+    snd_seq_drain_output( data->seq );
+  }
+
+  if ( seconds <= 0 ) seconds = 0;
+  data->outDelay.tv_sec = (unsigned int) seconds;
+  data->outDelay.tv_nsec = (unsigned int) ( ( seconds - data->outDelay.tv_sec ) * 1000000000.0 );
+}
+
+unsigned int MidiOutAlsa :: flushOutput( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  if ( data->retrySize == 0 && snd_seq_event_output_pending( data->seq ) == 0 )
+    return 0;
+
+  // Check for POLLOUT without waiting, the caller must never stall here.
+  if ( data->outPollCount > 0 ) {
+    if ( poll( data->outPollFds, data->outPollCount, 0 ) <= 0 )
+      return data->retrySize;
+    bool writable = false;
+    for ( int i=0; i<data->outPollCount; ++i )
+      if ( data->outPollFds[i].revents & POLLOUT ) writable = true;
+    if ( !writable ) return data->retrySize;
+  }
+
+  if ( snd_seq_drain_output( data->seq ) == -EAGAIN )
+    return data->retrySize;
+
+  snd_seq_event_t ev;
+  while ( data->retrySize > 0 ) {
+    std::vector<unsigned char> *message = &data->retryRing[data->retryFront];
+    alsaEncodeMessage( data, message, &ev );
+    int result = snd_seq_event_output( data->seq, &ev );
+    if ( result == -EAGAIN ) break;
+    if ( result < 0 ) {
+      warning( "MidiOutAlsa::flushOutput: error sending MIDI message to port." );
+    }
+    data->retryFront = ( data->retryFront + 1 ) % ALSA_RETRY_QUEUE_SIZE;
+    data->retrySize--;
+    if ( snd_seq_drain_output( data->seq ) == -EAGAIN ) break;
+  }
+
+  return data->retrySize;
+}
+
+unsigned long MidiOutAlsa :: getDrops( void )
+{
+  AlsaMidiData *data = static_cast<AlsaMidiData *> (apiData_);
+  return __atomic_load_n( &data->retryDrops, __ATOMIC_RELAXED );
+}
+
 #endif // __LINUX_ALSA__
 
 
@@ -2030,9 +2660,12 @@ static void CALLBACK midiInputCallback( HMIDIIN /*hmin*/,
       if ( data->queue.back == data->queue.ringSize )
         data->queue.back = 0;
       data->queue.size++;
+      rtMidiQueued( &data->stats, data->queue.size );
+    }
+    else {
+      rtMidiCount( &data->stats.drops );
+      rtMidiLog( "RtMidiIn: message queue limit reached!!" );
     }
-    else
-      std::cerr << "\nRtMidiIn: message queue limit reached!!\n\n";
   }
 
   // Clear the vector for the next input message.
@@ -2498,9 +3131,12 @@ static int jackProcessIn( jack_nframes_t nframes, void *arg )
           if ( rtData->queue.back == rtData->queue.ringSize )
             rtData->queue.back = 0;
           rtData->queue.size++;
+          rtMidiQueued( &rtData->stats, rtData->queue.size );
+        }
+        else {
+          rtMidiCount( &rtData->stats.drops );
+          rtMidiLog( "MidiInJack: message queue limit reached!!" );
         }
-        else
-          std::cerr << "\nMidiInJack: message queue limit reached!!\n\n";
       }
     }
   }
@@ -2837,3 +3473,263 @@ void MidiOutJack :: sendMessage( std::vector<unsigned char> *message )
 }
 
 #endif  // __UNIX_JACK__
+
+//*********************************************************************//
+//  API: Dummy (in-memory)
+//  Class Definitions: MidiInDummy, MidiOutDummy
+//*********************************************************************//
+
+#if defined(__RTMIDI_DUMMY__)
+
+// A port on the in-memory bus.  The receivers get everything sent to
+// the port, the senders are only kept so their pointers can be cleared
+// when the port goes away.
+struct DummyPort {
+  std::string name;
+  bool forOutputs;  // Created by an input, so outputs can open it
+  void *owner;
+  std::vector<MidiInDummy *> receivers;
+  std::vector<MidiOutDummy *> senders;
+};
+
+static std::vector<DummyPort *> dummyPorts;
+
+static DummyPort *dummyCreatePort( const std::string &name, bool forOutputs, void *owner )
+{
+  DummyPort *port = new DummyPort;
+  port->name = name;
+  port->forOutputs = forOutputs;
+  port->owner = owner;
+  dummyPorts.push_back( port );
+  return port;
+}
+
+static DummyPort *dummyFindPort( unsigned int portNumber, bool forOutputs )
+{
+  unsigned int count = 0;
+  for ( unsigned int i=0; i<dummyPorts.size(); i++ ) {
+    if ( dummyPorts[i]->forOutputs != forOutputs ) continue;
+    if ( count++ == portNumber ) return dummyPorts[i];
+  }
+  return 0;
+}
+
+static unsigned int dummyCountPorts( bool forOutputs )
+{
+  unsigned int count = 0;
+  for ( unsigned int i=0; i<dummyPorts.size(); i++ )
+    if ( dummyPorts[i]->forOutputs == forOutputs ) count++;
+  return count;
+}
+
+template<class T>
+static void dummyRemove( std::vector<T *> &list, T *item )
+{
+  list.erase( std::remove( list.begin(), list.end(), item ), list.end() );
+}
+
+// Detach a port from everything connected to it and free it.
+static void dummyDestroyPort( DummyPort *port );
+
+MidiInDummy :: MidiInDummy( const std::string clientName, unsigned int queueSizeLimit )
+  : MidiInApi( queueSizeLimit ), port_( 0 )
+{
+  initialize( clientName );
+}
+
+MidiInDummy :: ~MidiInDummy()
+{
+  closePort();
+}
+
+void MidiInDummy :: initialize( const std::string& /*clientName*/ )
+{
+}
+
+void MidiInDummy :: openPort( unsigned int portNumber, const std::string /*portName*/ )
+{
+  if ( connected_ ) {
+    errorString_ = "MidiInDummy::openPort: a valid connection already exists!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  DummyPort *port = dummyFindPort( portNumber, false );
+  if ( port == 0 ) {
+    std::ostringstream ost;
+    ost << "MidiInDummy::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::INVALID_PARAMETER, errorString_ );
+    return;
+  }
+
+  port->receivers.push_back( this );
+  port_ = port;
+  inputData_.doInput = true;
+  connected_ = true;
+}
+
+void MidiInDummy :: openVirtualPort( const std::string portName )
+{
+  if ( port_ ) return;
+  port_ = dummyCreatePort( portName, true, this );
+  port_->receivers.push_back( this );
+  inputData_.doInput = true;
+}
+
+void MidiInDummy :: closePort( void )
+{
+  if ( port_ == 0 ) return;
+  if ( port_->owner == this )
+    dummyDestroyPort( port_ );
+  else
+    dummyRemove( port_->receivers, this );
+  port_ = 0;
+  inputData_.doInput = false;
+  connected_ = false;
+}
+
+unsigned int MidiInDummy :: getPortCount()
+{
+  return dummyCountPorts( false );
+}
+
+std::string MidiInDummy :: getPortName( unsigned int portNumber )
+{
+  DummyPort *port = dummyFindPort( portNumber, false );
+  if ( port == 0 ) {
+    std::ostringstream ost;
+    ost << "MidiInDummy::getPortName: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::WARNING, errorString_ );
+    return "";
+  }
+  return port->name;
+}
+
+void MidiInDummy :: receive( const std::vector<unsigned char> &message )
+{
+  if ( !inputData_.doInput || message.empty() ) return;
+
+  // Filter the same message types the other APIs do.
+  unsigned char status = message[0];
+  if ( ( status == 0xF0 && ( inputData_.ignoreFlags & 0x01 ) ) ||
+       ( ( status == 0xF1 || status == 0xF8 ) && ( inputData_.ignoreFlags & 0x02 ) ) ||
+       ( status == 0xFE && ( inputData_.ignoreFlags & 0x04 ) ) )
+    return;
+
+  if ( inputData_.usingCallback ) {
+    inputData_.message.bytes.assign( message.begin(), message.end() );
+    inputData_.message.timeStamp = 0.0;
+    RtMidiIn::RtMidiCallback callback = (RtMidiIn::RtMidiCallback) inputData_.userCallback;
+    callback( 0.0, &inputData_.message.bytes, inputData_.userData );
+  }
+  else if ( inputData_.queue.size < inputData_.queue.ringSize ) {
+    // Assign into the slot so its capacity is reused.
+    MidiMessage *slot = &inputData_.queue.ring[inputData_.queue.back++];
+    slot->bytes.assign( message.begin(), message.end() );
+    slot->timeStamp = 0.0;
+    slot->arrivalTime = 0;
+    if ( inputData_.queue.back == inputData_.queue.ringSize )
+      inputData_.queue.back = 0;
+    inputData_.queue.size++;
+    rtMidiQueued( &inputData_.stats, inputData_.queue.size );
+  }
+  else {
+    rtMidiCount( &inputData_.stats.drops );
+    rtMidiLog( "MidiInDummy: message queue limit reached!!" );
+  }
+}
+
+MidiOutDummy :: MidiOutDummy( const std::string clientName ) : MidiOutApi(), port_( 0 )
+{
+  initialize( clientName );
+}
+
+MidiOutDummy :: ~MidiOutDummy()
+{
+  closePort();
+}
+
+void MidiOutDummy :: initialize( const std::string& /*clientName*/ )
+{
+}
+
+void MidiOutDummy :: openPort( unsigned int portNumber, const std::string /*portName*/ )
+{
+  if ( connected_ ) {
+    errorString_ = "MidiOutDummy::openPort: a valid connection already exists!";
+    error( RtMidiError::WARNING, errorString_ );
+    return;
+  }
+
+  DummyPort *port = dummyFindPort( portNumber, true );
+  if ( port == 0 ) {
+    std::ostringstream ost;
+    ost << "MidiOutDummy::openPort: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::INVALID_PARAMETER, errorString_ );
+    return;
+  }
+
+  port->senders.push_back( this );
+  port_ = port;
+  connected_ = true;
+}
+
+void MidiOutDummy :: openVirtualPort( const std::string portName )
+{
+  if ( port_ ) return;
+  port_ = dummyCreatePort( portName, false, this );
+  port_->senders.push_back( this );
+}
+
+void MidiOutDummy :: closePort( void )
+{
+  if ( port_ == 0 ) return;
+  if ( port_->owner == this )
+    dummyDestroyPort( port_ );
+  else
+    dummyRemove( port_->senders, this );
+  port_ = 0;
+  connected_ = false;
+}
+
+unsigned int MidiOutDummy :: getPortCount()
+{
+  return dummyCountPorts( true );
+}
+
+std::string MidiOutDummy :: getPortName( unsigned int portNumber )
+{
+  DummyPort *port = dummyFindPort( portNumber, true );
+  if ( port == 0 ) {
+    std::ostringstream ost;
+    ost << "MidiOutDummy::getPortName: the 'portNumber' argument (" << portNumber << ") is invalid.";
+    errorString_ = ost.str();
+    error( RtMidiError::WARNING, errorString_ );
+    return "";
+  }
+  return port->name;
+}
+
+void MidiOutDummy :: sendMessage( std::vector<unsigned char> *message )
+{
+  if ( port_ == 0 ) return;
+  for ( unsigned int i=0; i<port_->receivers.size(); i++ )
+    port_->receivers[i]->receive( *message );
+}
+
+static void dummyDestroyPort( DummyPort *port )
+{
+  // Clear the owner first, so its closePort() below only detaches it.
+  port->owner = 0;
+  while ( !port->receivers.empty() )
+    port->receivers.back()->closePort();
+  while ( !port->senders.empty() )
+    port->senders.back()->closePort();
+  dummyRemove( dummyPorts, port );
+  delete port;
+}
+
+#endif  // __RTMIDI_DUMMY__
@@ -111,6 +111,69 @@ class RtMidiError : public std::exception
  */
 typedef void (*RtMidiErrorCallback)( RtMidiError::Type type, const std::string &errorText );
 
+/************************************************************************/
+/*! \struct RtMidiMessage
+    \brief A single MIDI message with its time stamp.
+
+    Messages are stored in this form in the MIDI input queue and
+    handed out in bulk by RtMidiIn::getMessages().
+*/
+/************************************************************************/
+
+struct RtMidiMessage {
+  std::vector<unsigned char> bytes; //!< The MIDI bytes of the message.
+  double timeStamp;                 //!< Delta-time in seconds since the previous message.
+  long long arrivalTime;            //!< CLOCK_MONOTONIC ns when the input thread received it, 0 if unknown.
+
+  // Default constructor.
+  RtMidiMessage()
+  :bytes(0), timeStamp(0.0), arrivalTime(0) {}
+};
+
+/************************************************************************/
+/*! \struct RtMidiInStats
+    \brief Counters kept by the input thread of an RtMidiIn instance.
+
+    The counters are updated with atomic operations by the thread that
+    receives the messages and can be read at any time from another
+    thread with RtMidiIn::getStats().
+*/
+/************************************************************************/
+
+struct RtMidiInStats {
+  unsigned long drops;         //!< Messages dropped because the input queue was full.
+  unsigned long overruns;      //!< Times the MIDI system reported lost input (ALSA only).
+  unsigned int queueHighWater; //!< Largest number of messages seen waiting in the input queue.
+  long long heartbeat;         //!< CLOCK_MONOTONIC ns the input thread last took up an event, 0 while it waits for input (ALSA only).
+  int threadId;                //!< Kernel thread id of the input thread, 0 until it runs (ALSA only).
+
+  // Default constructor.
+  RtMidiInStats()
+  :drops(0), overruns(0), queueHighWater(0), heartbeat(0), threadId(0) {}
+};
+
+/************************************************************************/
+/*! \struct RtMidiLogStats
+    \brief Counters of the RtMidi log.
+
+    Warnings raised on the MIDI threads, like a full input queue, are
+    not written by the thread that raises them.  They go to a
+    preallocated ring and a background thread writes them to
+    std::cerr, printing a message that repeats once a second at most.
+    The counters can be read with RtMidi::getLogStats().
+*/
+/************************************************************************/
+
+struct RtMidiLogStats {
+  unsigned long logged;     //!< Messages put in the log ring.
+  unsigned long suppressed; //!< Repeats of a message that were counted instead of written.
+  unsigned long dropped;    //!< Messages lost because the log ring was full.
+
+  // Default constructor.
+  RtMidiLogStats()
+  :logged(0), suppressed(0), dropped(0) {}
+};
+
 class MidiApi;
 
 class RtMidi
@@ -124,7 +187,7 @@ class RtMidi
     LINUX_ALSA,     /*!< The Advanced Linux Sound Architecture API. */
     UNIX_JACK,      /*!< The JACK Low-Latency MIDI Server API. */
     WINDOWS_MM,     /*!< The Microsoft Multimedia MIDI API. */
-    RTMIDI_DUMMY    /*!< A compilable but non-functional API. */
+    RTMIDI_DUMMY    /*!< An in-memory API connecting ports within the process. */
   };
 
   //! A static function to determine the current RtMidi version.
@@ -138,6 +201,9 @@ class RtMidi
   */
   static void getCompiledApi( std::vector<RtMidi::Api> &apis ) throw();
 
+  //! A static function to read the counters of the RtMidi log.
+  static RtMidiLogStats getLogStats( void ) throw();
+
   //! Pure virtual openPort() function.
   virtual void openPort( unsigned int portNumber = 0, const std::string portName = std::string( "RtMidi" ) ) = 0;
 
@@ -307,6 +373,19 @@ class RtMidiIn : public RtMidi
   */
   void ignoreTypes( bool midiSysex = true, bool midiTime = true, bool midiSense = true );
 
+  //! Specify whether incoming sysex messages are delivered in chunks as they arrive.
+  /*!
+    By default, the chunks of a sysex message are reassembled and
+    delivered once the terminating 0xF7 byte has arrived, so a large
+    dump is held in memory in full.  With streaming enabled, each
+    chunk is delivered as a message of its own as soon as it is
+    received: the first chunk starts with 0xF0, the last one ends
+    with 0xF7 and the chunks in between hold data bytes only.  This
+    is currently only supported by the Linux ALSA API, the other APIs
+    always deliver complete messages.
+  */
+  void setSysexStreaming( bool enable = true );
+
   //! Fill the user-provided vector with the data bytes for the next available MIDI message in the input queue and return the event delta-time in seconds.
   /*!
     This function returns immediately whether a new message is
@@ -317,6 +396,26 @@ class RtMidiIn : public RtMidi
   */
   double getMessage( std::vector<unsigned char> *message );
 
+  //! Move all messages currently in the input queue to the user-provided vector and return the number of messages moved.
+  /*!
+    This function returns immediately whether messages are available
+    or not.  The first returned number of elements of the vector hold
+    the messages, oldest first.  The vector is grown when needed but
+    never shrunk, and message bytes are swapped with the queue instead
+    of copied, so a vector that is reused between calls makes the
+    transfer free of allocations once it has warmed up.  This lets
+    the caller pay the retrieval overhead once per burst instead of
+    once per message.
+  */
+  unsigned int getMessages( std::vector<RtMidiMessage> *messages );
+
+  //! Return a snapshot of the input counters.
+  /*!
+    This function can be called from any thread.  The counters start
+    at zero when the instance is created and are never reset.
+  */
+  RtMidiInStats getStats( void );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -408,6 +507,43 @@ class RtMidiOut : public RtMidi
   */
   void sendMessage( std::vector<unsigned char> *message );
 
+  //! Retry sending messages that were held back because the output was saturated.
+  /*!
+      When the output buffer of the MIDI system is full, messages
+      passed to \e sendMessage are kept in an internal retry queue
+      instead of being dropped, as long as it has room; messages that
+      find it full are dropped and counted by \e getDrops.  What is
+      left of a sysex message is queued whole or dropped whole, and
+      one cut short is ended with an F7 so the port never stays
+      inside it.  This function tries to pass the
+      queued messages on, in order, and returns immediately whether
+      the output accepted them or not.  Call it regularly from the
+      thread that sends messages.  Only the Linux ALSA API holds
+      messages back; for the other APIs this function does nothing.
+
+      \return The number of messages still waiting to be sent.
+  */
+  unsigned int flushOutput( void );
+
+  //! Return the number of messages dropped because the retry queue was full.
+  /*!
+    This function can be called from any thread.  The count starts at
+    zero when the instance is created and is never reset.
+  */
+  unsigned long getDrops( void );
+
+  //! Delay every message sent from now on by the given number of seconds.
+  /*!
+      The messages are handed to the MIDI system straight away and
+      scheduled to leave the port \e seconds later, so devices with
+      different latencies can be lined up without the caller waiting.
+      The order of the messages is kept.  A delay of 0 sends messages
+      immediately again; messages still scheduled may then be
+      overtaken.  Only the Linux ALSA API schedules messages; the
+      other APIs issue a warning and send immediately.
+  */
+  void setOutputDelay( double seconds );
+
   //! Set an error callback function to be invoked when an error has occured.
   /*!
     The callback function will be called whenever an error has occured. It is best
@@ -451,7 +587,14 @@ class MidiApi
   void setErrorCallback( RtMidiErrorCallback errorCallback );
 
   //! A basic error reporting function for RtMidi classes.
-  void error( RtMidiError::Type type, std::string errorString );
+  void error( RtMidiError::Type type, const std::string &errorString );
+
+  //! Report a warning from a MIDI thread without blocking or allocating.
+  /*!
+    The text must be a string literal.  Without an error callback it
+    goes to the RtMidi log, with one it's passed to error() as usual.
+  */
+  void warning( const char *text );
 
 protected:
   virtual void initialize( const std::string& clientName ) = 0;
@@ -471,18 +614,14 @@ class MidiInApi : public MidiApi
   void setCallback( RtMidiIn::RtMidiCallback callback, void *userData );
   void cancelCallback( void );
   virtual void ignoreTypes( bool midiSysex, bool midiTime, bool midiSense );
+  void setSysexStreaming( bool enable );
   double getMessage( std::vector<unsigned char> *message );
+  unsigned int getMessages( std::vector<RtMidiMessage> *messages );
+  RtMidiInStats getStats( void );
 
   // A MIDI structure used internally by the class to store incoming
   // messages.  Each message represents one and only one MIDI message.
-  struct MidiMessage { 
-    std::vector<unsigned char> bytes; 
-    double timeStamp;
-
-    // Default constructor.
-  MidiMessage()
-  :bytes(0), timeStamp(0.0) {}
-  };
+  typedef RtMidiMessage MidiMessage;
 
   struct MidiQueue {
     unsigned int front;
@@ -509,12 +648,14 @@ class MidiInApi : public MidiApi
     RtMidiIn::RtMidiCallback userCallback;
     void *userData;
     bool continueSysex;
+    bool streamSysex;
+    RtMidiInStats stats;
 
     // Default constructor.
   RtMidiInData()
   : ignoreFlags(7), doInput(false), firstMessage(true),
       apiData(0), usingCallback(false), userCallback(0), userData(0),
-      continueSysex(false) {}
+      continueSysex(false), streamSysex(false) {}
   };
 
  protected:
@@ -528,6 +669,9 @@ class MidiOutApi : public MidiApi
   MidiOutApi( void );
   virtual ~MidiOutApi( void );
   virtual void sendMessage( std::vector<unsigned char> *message ) = 0;
+  virtual unsigned int flushOutput( void ) { return 0; }
+  virtual unsigned long getDrops( void ) { return 0; }
+  virtual void setOutputDelay( double seconds );
 };
 
 // **************************************************************** //
@@ -546,7 +690,10 @@ inline void RtMidiIn :: cancelCallback( void ) { ((MidiInApi *)rtapi_)->cancelCa
 inline unsigned int RtMidiIn :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiIn :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiIn :: ignoreTypes( bool midiSysex, bool midiTime, bool midiSense ) { ((MidiInApi *)rtapi_)->ignoreTypes( midiSysex, midiTime, midiSense ); }
+inline void RtMidiIn :: setSysexStreaming( bool enable ) { ((MidiInApi *)rtapi_)->setSysexStreaming( enable ); }
 inline double RtMidiIn :: getMessage( std::vector<unsigned char> *message ) { return ((MidiInApi *)rtapi_)->getMessage( message ); }
+inline unsigned int RtMidiIn :: getMessages( std::vector<RtMidiMessage> *messages ) { return ((MidiInApi *)rtapi_)->getMessages( messages ); }
+inline RtMidiInStats RtMidiIn :: getStats( void ) { return ((MidiInApi *)rtapi_)->getStats(); }
 inline void RtMidiIn :: setErrorCallback( RtMidiErrorCallback errorCallback ) { rtapi_->setErrorCallback(errorCallback); }
 
 inline RtMidi::Api RtMidiOut :: getCurrentApi( void ) throw() { return rtapi_->getCurrentApi(); }
@@ -557,6 +704,9 @@ inline bool RtMidiOut :: isPortOpen() const { return rtapi_->isPortOpen(); }
 inline unsigned int RtMidiOut :: getPortCount( void ) { return rtapi_->getPortCount(); }
 inline std::string RtMidiOut :: getPortName( unsigned int portNumber ) { return rtapi_->getPortName( portNumber ); }
 inline void RtMidiOut :: sendMessage( std::vector<unsigned char> *message ) { ((MidiOutApi *)rtapi_)->sendMessage( message ); }
+inline unsigned int RtMidiOut :: flushOutput( void ) { return ((MidiOutApi *)rtapi_)->flushOutput(); }
+inline unsigned long RtMidiOut :: getDrops( void ) { return ((MidiOutApi *)rtapi_)->getDrops(); }
+inline void RtMidiOut :: setOutputDelay( double seconds ) { ((MidiOutApi *)rtapi_)->setOutputDelay( seconds ); }
 inline void RtMidiOut :: setErrorCallback( RtMidiErrorCallback errorCallback ) { rtapi_->setErrorCallback(errorCallback); }
 
 // **************************************************************** //
@@ -679,8 +829,12 @@ class MidiOutAlsa: public MidiOutApi
   unsigned int getPortCount( void );
   std::string getPortName( unsigned int portNumber );
   void sendMessage( std::vector<unsigned char> *message );
+  unsigned int flushOutput( void );
+  unsigned long getDrops( void );
+  void setOutputDelay( double seconds );
 
  protected:
+  void sendSysex( const unsigned char *bytes, unsigned int nBytes );
   void initialize( const std::string& clientName );
 };
 
@@ -725,35 +879,51 @@ class MidiOutWinMM: public MidiOutApi
 
 #if defined(__RTMIDI_DUMMY__)
 
+// The dummy API is an in-memory MIDI bus within the process.  A
+// virtual port opened by an input can be opened by outputs, a virtual
+// port opened by an output can be opened by inputs, and sendMessage()
+// delivers straight to the connected inputs.  This makes it a stand-in
+// for real ports in tests and benchmarks.  It is not thread-safe:
+// send and receive from one thread.
+
+struct DummyPort;
+
 class MidiInDummy: public MidiInApi
 {
  public:
- MidiInDummy( const std::string /*clientName*/, unsigned int queueSizeLimit ) : MidiInApi( queueSizeLimit ) { errorString_ = "MidiInDummy: This class provides no functionality."; error( RtMidiError::WARNING, errorString_ ); }
+  MidiInDummy( const std::string clientName, unsigned int queueSizeLimit );
+  ~MidiInDummy( void );
   RtMidi::Api getCurrentApi( void ) { return RtMidi::RTMIDI_DUMMY; }
-  void openPort( unsigned int /*portNumber*/, const std::string /*portName*/ ) {}
-  void openVirtualPort( const std::string /*portName*/ ) {}
-  void closePort( void ) {}
-  unsigned int getPortCount( void ) { return 0; }
-  std::string getPortName( unsigned int portNumber ) { return ""; }
+  void openPort( unsigned int portNumber, const std::string portName );
+  void openVirtualPort( const std::string portName );
+  void closePort( void );
+  unsigned int getPortCount( void );
+  std::string getPortName( unsigned int portNumber );
+
+  // Deliver a message as if it had arrived on the port.  Time stamps are always 0.
+  void receive( const std::vector<unsigned char> &message );
 
  protected:
-  void initialize( const std::string& /*clientName*/ ) {}
+  void initialize( const std::string& clientName );
+  DummyPort *port_;
 };
 
 class MidiOutDummy: public MidiOutApi
 {
  public:
-  MidiOutDummy( const std::string /*clientName*/ ) { errorString_ = "MidiOutDummy: This class provides no functionality."; error( RtMidiError::WARNING, errorString_ ); }
+  MidiOutDummy( const std::string clientName );
+  ~MidiOutDummy( void );
   RtMidi::Api getCurrentApi( void ) { return RtMidi::RTMIDI_DUMMY; }
-  void openPort( unsigned int /*portNumber*/, const std::string /*portName*/ ) {}
-  void openVirtualPort( const std::string /*portName*/ ) {}
-  void closePort( void ) {}
-  unsigned int getPortCount( void ) { return 0; }
-  std::string getPortName( unsigned int /*portNumber*/ ) { return ""; }
-  void sendMessage( std::vector<unsigned char> * /*message*/ ) {}
+  void openPort( unsigned int portNumber, const std::string portName );
+  void openVirtualPort( const std::string portName );
+  void closePort( void );
+  unsigned int getPortCount( void );
+  std::string getPortName( unsigned int portNumber );
+  void sendMessage( std::vector<unsigned char> *message );
 
  protected:
-  void initialize( const std::string& /*clientName*/ ) {}
+  void initialize( const std::string& clientName );
+  DummyPort *port_;
 };
 
 #endif
@@ -0,0 +1,380 @@
+//************** MIDIcloro **************
+//
+// Standard MIDI File support
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <iostream>
+#include <cstring>
+#include <climits>
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "smf.h"
+
+using namespace std;
+
+static unsigned long readBigEndian(const unsigned char *pos, int nBytes) {
+  unsigned long value = 0;
+  for (int i=0; i<nBytes; i++)
+    value = (value << 8) | pos[i];
+  return value;
+}
+
+// Read a variable-length quantity. Returns false if it runs past the end.
+static bool readVarLen(const unsigned char **pos, const unsigned char *end, unsigned long *value) {
+  *value = 0;
+  for (int i=0; i<4 && *pos < end; i++) {
+    unsigned char byte = *(*pos)++;
+    *value = (*value << 7) | (byte & 0x7F);
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+SmfReader::SmfReader() : data(0), size(0), division(0) {
+}
+
+SmfReader::~SmfReader() {
+  if (data)
+    munmap(data, size);
+}
+
+bool SmfReader::open(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Couldn't open MIDI file: " << path << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 14) {
+    cerr << "Couldn't read MIDI file: " << path << endl;
+    ::close(fd);
+    return false;
+  }
+  void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    cerr << "Couldn't map MIDI file: " << path << endl;
+    return false;
+  }
+  data = (unsigned char *)map;
+  size = st.st_size;
+
+  unsigned long headerSize = readBigEndian(data + 4, 4);
+  if (memcmp(data, "MThd", 4) != 0 || headerSize < 6 || headerSize > size - 8) {
+    cerr << "Not a standard MIDI file: " << path << endl;
+    return false;
+  }
+  division = readBigEndian(data + 12, 2);
+  if (division & 0x8000 || division == 0) {
+    cerr << "SMPTE time division isn't supported: " << path << endl;
+    return false;
+  }
+
+  // Only the chunk headers are visited here, the events are decoded while playing
+  size_t offset = 8 + headerSize;
+  while (offset + 8 <= size) {
+    unsigned long chunkSize = readBigEndian(data + offset + 4, 4);
+    // A chunk running past the end is cut at the end, without adding a size that could wrap
+    bool truncated = chunkSize > size - offset - 8;
+    if (memcmp(data + offset, "MTrk", 4) == 0) {
+      Track track;
+      track.start = data + offset + 8;
+      track.end = truncated ? data + size : track.start + chunkSize;
+      tracks.push_back(track);
+    }
+    if (truncated)
+      break;
+    offset += 8 + chunkSize;
+  }
+  rewind();
+  return true;
+}
+
+void SmfReader::rewind() {
+  for (unsigned int i=0; i<tracks.size(); i++) {
+    tracks[i].pos = tracks[i].start;
+    tracks[i].tick = 0;
+    tracks[i].runningStatus = 0;
+    tracks[i].done = false;
+    readDelta(&tracks[i]);
+  }
+}
+
+bool SmfReader::readDelta(Track *track) {
+  unsigned long delta;
+  if (track->pos >= track->end || !readVarLen(&track->pos, track->end, &delta)) {
+    track->done = true;
+    return false;
+  }
+  track->tick += delta;
+  return true;
+}
+
+bool SmfReader::next(SmfEvent *event) {
+  // The track with the earliest pending event goes first
+  Track *track = 0;
+  for (unsigned int i=0; i<tracks.size(); i++) {
+    if (!tracks[i].done && (!track || tracks[i].tick < track->tick)) {
+      track = &tracks[i];
+      event->track = i;
+    }
+  }
+  if (!track)
+    return false;
+
+  event->tick = track->tick;
+  event->isMeta = false;
+  event->metaType = 0;
+  if (track->pos >= track->end) {
+    track->done = true;
+    return next(event);
+  }
+  unsigned char status = *track->pos;
+  if (status < 0x80)
+    status = track->runningStatus;
+  else
+    track->pos++;
+
+  unsigned long length;
+  if (status == 0xFF) {
+    // Meta event
+    if (track->pos >= track->end || (event->metaType = *track->pos++, !readVarLen(&track->pos, track->end, &length)) ||
+        track->pos + length > track->end) {
+      track->done = true;
+      return next(event);
+    }
+    event->isMeta = true;
+    event->bytes.assign(track->pos, track->pos + length);
+    track->pos += length;
+    if (event->metaType == 0x2F) {
+      track->done = true;
+      return true;
+    }
+  }
+  else if (status == 0xF0 || status == 0xF7) {
+    // Sysex, or an escaped sequence sent as it is
+    if (!readVarLen(&track->pos, track->end, &length) || track->pos + length > track->end) {
+      track->done = true;
+      return next(event);
+    }
+    event->bytes.clear();
+    if (status == 0xF0)
+      event->bytes.push_back(0xF0);
+    event->bytes.insert(event->bytes.end(), track->pos, track->pos + length);
+    track->pos += length;
+    track->runningStatus = 0;
+  }
+  else if (status >= 0x80) {
+    // Channel message, program change and channel pressure have one data byte
+    unsigned int nData = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+    if (track->pos + nData > track->end) {
+      track->done = true;
+      return next(event);
+    }
+    event->bytes.assign(1, status);
+    event->bytes.insert(event->bytes.end(), track->pos, track->pos + nData);
+    track->pos += nData;
+    track->runningStatus = status;
+  }
+  else {
+    // Data byte without running status, the track is corrupt
+    track->done = true;
+    return next(event);
+  }
+  readDelta(track);
+  return true;
+}
+
+SmfPlayer::SmfPlayer(SmfReader *reader)
+  : reader(reader), haveEvent(false), running(false), waitingForTick(false), position(0),
+    ticksPerClock(reader->getDivision()/24.0), lastTickTime(0), nsPerTick(0), deadline(LLONG_MAX),
+    hangingChannel(0), hangingNote(0) {
+  memset(notesOn, 0, sizeof(notesOn));
+}
+
+void SmfPlayer::start() {
+  reader->rewind();
+  fetch();
+  running = true;
+  waitingForTick = true;
+  position = 0;
+  deadline = LLONG_MAX;
+}
+
+void SmfPlayer::resume(long long clocks) {
+  reader->rewind();
+  position = clocks*ticksPerClock;
+  // Nor does the rest of a sysex split in packets that began earlier
+  do {
+    fetch();
+  } while (haveEvent && (event.tick < position || event.bytes[0] < 0x80));
+  running = haveEvent;
+  waitingForTick = true;
+  deadline = LLONG_MAX;
+}
+
+void SmfPlayer::stop() {
+  running = false;
+  deadline = LLONG_MAX;
+  hangingChannel = 0;
+  hangingNote = 0;
+}
+
+void SmfPlayer::clockTick(long long tickTime, long long clockInterval) {
+  if (!running)
+    return;
+  // The first tick after start is the beginning of the file
+  if (waitingForTick)
+    waitingForTick = false;
+  else
+    position += ticksPerClock;
+  lastTickTime = tickTime;
+  nsPerTick = clockInterval/ticksPerClock;
+  updateDeadline();
+}
+
+bool SmfPlayer::nextDue(long long now, vector<unsigned char> *message) {
+  if (now < deadline)
+    return false;
+  message->swap(event.bytes);
+
+  // Keep track of playing notes, to be able to end them on stop
+  unsigned char type = (*message)[0] & 0xF0;
+  if ((type == 0x90 || type == 0x80) && message->size() > 2)
+    notesOn[(*message)[0] & 0x0F][(*message)[1] & 0x7F] = type == 0x90 && (*message)[2] > 0;
+
+  fetch();
+  if (!haveEvent)
+    running = false;
+  updateDeadline();
+  return true;
+}
+
+bool SmfPlayer::nextHangingNoteOff(vector<unsigned char> *message) {
+  for (; hangingChannel<16; hangingChannel++, hangingNote=0) {
+    for (; hangingNote<128; hangingNote++) {
+      if (notesOn[hangingChannel][hangingNote]) {
+        notesOn[hangingChannel][hangingNote] = false;
+        message->resize(3);
+        (*message)[0] = 0x80 + hangingChannel;
+        (*message)[1] = hangingNote;
+        (*message)[2] = 0;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void SmfPlayer::fetch() {
+  // Meta events such as tempo changes don't apply, the clock sets the tempo
+  do {
+    haveEvent = reader->next(&event);
+  } while (haveEvent && (event.isMeta || event.bytes.empty()));
+}
+
+void SmfPlayer::updateDeadline() {
+  if (!running || waitingForTick || !haveEvent)
+    deadline = LLONG_MAX;
+  else
+    deadline = lastTickTime + (long long)((event.tick - position)*nsPerTick);
+}
+
+static void writeVarLen(vector<unsigned char> *out, unsigned long value) {
+  unsigned char buffer[5];
+  int n = 0;
+  buffer[n++] = value & 0x7F;
+  while ((value >>= 7) > 0)
+    buffer[n++] = (value & 0x7F) | 0x80;
+  while (n > 0)
+    out->push_back(buffer[--n]);
+}
+
+static void writeBigEndian(vector<unsigned char> *out, unsigned long value, int nBytes) {
+  for (int i=nBytes-1; i>=0; i--)
+    out->push_back((value >> (8*i)) & 0xFF);
+}
+
+SmfWriter::SmfWriter(int division) : division(division) {
+}
+
+void SmfWriter::addDelta(int track, unsigned long tick) {
+  if (track >= (int)tracks.size()) {
+    tracks.resize(track + 1);
+    lastTicks.resize(track + 1, 0);
+  }
+  writeVarLen(&tracks[track], tick - min(tick, lastTicks[track]));
+  lastTicks[track] = max(tick, lastTicks[track]);
+}
+
+void SmfWriter::addMessage(int track, unsigned long tick, const unsigned char *bytes, size_t nBytes) {
+  if (nBytes == 0)
+    return;
+  addDelta(track, tick);
+  vector<unsigned char> *out = &tracks[track];
+  if (bytes[0] == 0xF0) {
+    // Sysex, the length replaces the 0xF0
+    out->push_back(0xF0);
+    writeVarLen(out, nBytes - 1);
+    out->insert(out->end(), bytes + 1, bytes + nBytes);
+  }
+  else if (bytes[0] >= 0x80 && bytes[0] < 0xF0) {
+    out->insert(out->end(), bytes, bytes + nBytes);
+  }
+  else {
+    // Sysex continued from an earlier chunk, or a system message, sent as it is
+    out->push_back(0xF7);
+    writeVarLen(out, nBytes);
+    out->insert(out->end(), bytes, bytes + nBytes);
+  }
+}
+
+void SmfWriter::addMeta(int track, unsigned long tick, unsigned char type, const unsigned char *data, size_t nBytes) {
+  // End of track is added when saving
+  if (type == 0x2F)
+    return;
+  addDelta(track, tick);
+  vector<unsigned char> *out = &tracks[track];
+  out->push_back(0xFF);
+  out->push_back(type);
+  writeVarLen(out, nBytes);
+  out->insert(out->end(), data, data + nBytes);
+}
+
+bool SmfWriter::save(const string &path) {
+  vector<unsigned char> smf;
+  smf.insert(smf.end(), "MThd", "MThd" + 4);
+  writeBigEndian(&smf, 6, 4);
+  writeBigEndian(&smf, 1, 2);
+  writeBigEndian(&smf, max((int)tracks.size(), 1), 2);
+  writeBigEndian(&smf, division, 2);
+  if (tracks.empty())
+    tracks.resize(1);
+  const unsigned char endOfTrack[] = {0x00, 0xFF, 0x2F, 0x00};
+  for (unsigned int i=0; i<tracks.size(); i++) {
+    smf.insert(smf.end(), "MTrk", "MTrk" + 4);
+    writeBigEndian(&smf, tracks[i].size() + sizeof(endOfTrack), 4);
+    smf.insert(smf.end(), tracks[i].begin(), tracks[i].end());
+    smf.insert(smf.end(), endOfTrack, endOfTrack + sizeof(endOfTrack));
+  }
+
+  string tmpPath = path + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool written = fd >= 0 && write(fd, &smf[0], smf.size()) == (ssize_t)smf.size() && fsync(fd) == 0;
+  if (fd >= 0)
+    ::close(fd);
+  if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    cerr << "Couldn't write MIDI file: " << path << endl;
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,113 @@
+//************** MIDIcloro **************
+//
+// Standard MIDI File support. Files are memory-mapped and decoded
+// one event at a time, so opening a file costs the same whatever its
+// size and nothing is loaded up front.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_SMF_H
+#define MIDICLORO_SMF_H
+
+#include <string>
+#include <vector>
+
+// A decoded event. Sysex events get their leading 0xF0 back, so bytes
+// holds a message as it would be sent on the wire.
+struct SmfEvent {
+  unsigned long tick; // Absolute time in ticks
+  int track;
+  bool isMeta;
+  unsigned char metaType;
+  std::vector<unsigned char> bytes; // MIDI message, or meta event data
+};
+
+// Reads the events of all tracks merged in time order
+class SmfReader {
+ public:
+  SmfReader();
+  ~SmfReader();
+  bool open(const std::string &path);
+  // Ticks per quarter note
+  int getDivision() const { return division; }
+  int getTrackCount() const { return tracks.size(); }
+  // Fetch the next event. Returns false at the end of the file.
+  bool next(SmfEvent *event);
+  void rewind();
+
+ private:
+  struct Track {
+    const unsigned char *start;
+    const unsigned char *end;
+    const unsigned char *pos;
+    unsigned long tick; // Time of the event at pos
+    unsigned char runningStatus;
+    bool done;
+  };
+  bool readDelta(Track *track);
+
+  unsigned char *data;
+  size_t size;
+  int division;
+  std::vector<Track> tracks;
+};
+
+// Plays the events of a file locked to midicloro's clock: the file is
+// advanced by one 24 PPQN step for every clock tick, so the tempo of
+// the file is replaced by the clock tempo.
+class SmfPlayer {
+ public:
+  SmfPlayer(SmfReader *reader);
+  bool isRunning() const { return running; }
+  // Start from the beginning, on the next clock tick
+  void start();
+  // Continue from a song position in 24 PPQN clock ticks, on the next clock tick.
+  // Events before it are skipped, so notes that began earlier don't sound.
+  void resume(long long clocks);
+  void stop();
+  // Called for every clock tick sent, with the time it was sent and the current clock interval in ns
+  void clockTick(long long tickTime, long long clockInterval);
+  // Fetch the next message that is due at the time now. Returns false when nothing is due.
+  bool nextDue(long long now, std::vector<unsigned char> *message);
+  // Fetch a note off for a note left playing by stop(). Returns false when there are none left.
+  bool nextHangingNoteOff(std::vector<unsigned char> *message);
+
+ private:
+  void fetch();
+  void updateDeadline();
+
+  SmfReader *reader;
+  SmfEvent event; // The next event to play
+  bool haveEvent;
+  bool running;
+  bool waitingForTick;
+  double position; // File ticks at the last clock tick
+  double ticksPerClock; // File ticks per 24 PPQN clock tick
+  long long lastTickTime;
+  double nsPerTick; // Duration of a file tick at the current clock tempo
+  long long deadline; // Time when the next event is due
+  bool notesOn[16][128];
+  int hangingChannel, hangingNote;
+};
+
+// Builds a format 1 file in memory. Events must be added in time order within each track.
+class SmfWriter {
+ public:
+  SmfWriter(int division);
+  void addMessage(int track, unsigned long tick, const unsigned char *bytes, size_t nBytes);
+  void addMeta(int track, unsigned long tick, unsigned char type, const unsigned char *data, size_t nBytes);
+  int getTrackCount() const { return tracks.size(); }
+  // Write the file, through a temporary file so there's never a partly written one at path
+  bool save(const std::string &path);
+
+ private:
+  void addDelta(int track, unsigned long tick);
+
+  int division;
+  std::vector<std::vector<unsigned char> > tracks;
+  std::vector<unsigned long> lastTicks;
+};
+
+#endif
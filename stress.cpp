@@ -0,0 +1,630 @@
+//************** MIDIcloro **************
+//
+// Load generator: plays up to four MIDI devices into a running
+// MIDIcloro over virtual ALSA sequencer ports and listens to its
+// output on another one. Measures throughput, drops and end-to-end
+// latency for dense chords, CC sweeps, sysex dumps and bursts on all
+// devices at once. In clock mode it instead records every clock tick
+// at a few tempos, optionally with CPU, memory and disk load running
+// next to midicloro, and reports jitter and drift. Needs only the ALSA
+// sequencer (snd-seq), no MIDI hardware.
+//
+// This project is licensed under the terms of the MIT license
+//
+// Run:
+// ./midicloro-stress [-n devices] [-r rate] [-d seconds] [-p patterns] [-s sysex size] [-b burst size] [-i burst interval ms] [-w wait seconds]
+// ./midicloro-stress -c bpm,bpm,... [-d seconds per tempo] [-l cpu=N,mem=N,io=N] [-w wait seconds]
+//
+//***************************************
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <boost/program_options.hpp>
+#include "rtmidi/RtMidi.h"
+#include "engine.h"
+#include "timeutil.h"
+
+using namespace std;
+
+namespace po = boost::program_options;
+
+enum Pattern {
+  CHORDS,
+  SWEEP,
+  SYSEX,
+  BURST,
+  N_PATTERNS
+};
+const char *patternNames[N_PATTERNS] = {"chords", "sweep", "sysex", "burst"};
+
+// Notes of a six note chord, and the note range of bursts kept apart from the chords
+const int CHORD_INTERVALS[] = {0, 4, 7, 11, 14, 17};
+const int BURST_FIRST_NOTE = 100;
+
+// Sysex is sent with the non-commercial manufacturer id, the probe has type 0 and the dumps type 1
+const unsigned char SYSEX_ID = 0x7D;
+const unsigned char SYSEX_PROBE = 0x00;
+const unsigned char SYSEX_DUMP = 0x01;
+
+// Load threads for the clock benchmark
+enum Load {
+  LOAD_CPU,
+  LOAD_MEM,
+  LOAD_IO,
+  N_LOADS
+};
+const char *loadNames[N_LOADS] = {"cpu", "mem", "io"};
+// Bigger than the caches, so the memory load goes out to RAM
+const size_t MEM_LOAD_SIZE = 64*1024*1024;
+const size_t IO_LOAD_BLOCK = 1024*1024;
+// Time for midicloro to settle on a new tempo, longer than any tap-tempo interval
+const int TEMPO_SETTLE_SECONDS = 2;
+
+// Messages that midicloro should pass on, waiting for it to come back
+struct Pending {
+  long long time;
+  int pattern;
+};
+
+struct Device {
+  int index;
+  RtMidiOut *out;
+  bool patterns[N_PATTERNS];
+  pthread_t thread;
+};
+
+int nDevices = 4;
+int rate = 100; // Pattern steps per second on each device
+int duration = 10;
+int sysexSize = 1024;
+int burstSize = 32;
+int burstInterval = 250; // ms
+int waitSeconds = 60;
+bool enabled[N_PATTERNS] = {true, true, true, true};
+int sweepCCs[2];
+
+long long runStart;
+pthread_mutex_t pendingMutex = PTHREAD_MUTEX_INITIALIZER;
+map<unsigned int, deque<Pending> > pending;
+vector<long long> latencies[N_PATTERNS];
+unsigned long sent[N_PATTERNS];
+unsigned long received[N_PATTERNS];
+unsigned long extra = 0;
+bool probeSeen = false;
+unsigned int sysexSequence = 0;
+
+vector<int> clockBpms;
+int loadThreads[N_LOADS] = {0, 0, 0};
+bool loadRunning = false;
+bool recordingClock = false;
+vector<long long> clockTimes;
+
+void usage(void);
+bool parsePatterns(const string &list);
+bool parseBpms(const string &list);
+bool parseLoad(const string &spec);
+void pickSweepCCs(const EngineConfig &config);
+unsigned int messageKey(const vector<unsigned char> &message);
+void onMessage(double deltaTime, vector<unsigned char> *message, void *userData);
+void send(Device *device, vector<unsigned char> *message, int pattern);
+bool waitForMidicloro(Device *device);
+void *deviceThread(void *device);
+void report(long long elapsed);
+void *loadThread(void *load);
+void runClockBenchmark(Device *device, const EngineConfig &config);
+
+int main(int argc, char *argv[]) {
+  for (int i=1; i<argc; i++) {
+    string arg = argv[i];
+    if (i+1 >= argc)
+      usage();
+    else if (arg == "-n")
+      nDevices = atoi(argv[++i]);
+    else if (arg == "-r")
+      rate = atoi(argv[++i]);
+    else if (arg == "-d")
+      duration = atoi(argv[++i]);
+    else if (arg == "-p") {
+      if (!parsePatterns(argv[++i]))
+        usage();
+    }
+    else if (arg == "-s")
+      sysexSize = atoi(argv[++i]);
+    else if (arg == "-b")
+      burstSize = atoi(argv[++i]);
+    else if (arg == "-i")
+      burstInterval = atoi(argv[++i]);
+    else if (arg == "-w")
+      waitSeconds = atoi(argv[++i]);
+    else if (arg == "-c") {
+      if (!parseBpms(argv[++i]))
+        usage();
+    }
+    else if (arg == "-l") {
+      if (!parseLoad(argv[++i]))
+        usage();
+    }
+    else
+      usage();
+  }
+  // The clock is only listened to, one device sends the tempo changes
+  if (!clockBpms.empty())
+    nDevices = 1;
+  if (nDevices < 1 || nDevices > 4 || rate < 1 || duration < 1 || sysexSize < 8 || burstSize < 1 || burstInterval < 1)
+    usage();
+
+  // The control CCs of midicloro.cfg are changed or swallowed by midicloro, the sweeps avoid them
+  EngineConfig engineConfig;
+  try {
+    po::options_description desc("Options");
+    addEngineOptions(&desc, &engineConfig);
+    po::variables_map vm;
+    ifstream file("midicloro.cfg");
+    po::store(po::parse_config_file(file, desc, true), vm);
+    po::notify(vm);
+  }
+  catch (exception& e) {
+    cout << "Error occurred while reading configuration: " << e.what() << endl;
+    return 1;
+  }
+  pickSweepCCs(engineConfig);
+
+  // Every device is a client of its own, midicloro tells ports apart by client name
+  vector<Device> devices(nDevices);
+  RtMidiIn *midiin = 0;
+  try {
+    midiin = new RtMidiIn(RtMidi::LINUX_ALSA, "MIDIcloro stress in", 4096);
+    midiin->ignoreTypes(false, clockBpms.empty(), true);
+    midiin->setCallback(&onMessage);
+    midiin->openVirtualPort("in");
+    for (int i=0; i<nDevices; i++) {
+      ostringstream name;
+      name << "MIDIcloro stress " << i+1;
+      devices[i].index = i;
+      devices[i].out = new RtMidiOut(RtMidi::LINUX_ALSA, name.str());
+      devices[i].out->openVirtualPort("out");
+      for (int p=0; p<N_PATTERNS; p++)
+        devices[i].patterns[p] = false;
+    }
+  }
+  catch (RtMidiError &error) {
+    error.printMessage();
+    return 1;
+  }
+
+  // Spread the patterns over the devices, bursts come from all of them at once
+  int next = 0;
+  for (int p=0; p<N_PATTERNS; p++) {
+    if (!enabled[p])
+      continue;
+    if (p == BURST) {
+      for (int i=0; i<nDevices; i++)
+        devices[i].patterns[p] = true;
+    }
+    else
+      devices[next++ % nDevices].patterns[p] = true;
+  }
+
+  cout << "Set these ports in midicloro.cfg and start midicloro:" << endl;
+  for (int i=0; i<nDevices; i++)
+    cout << "input" << i+1 << " = MIDIcloro stress " << i+1 << endl;
+  cout << "output = MIDIcloro stress in" << endl;
+  if (!waitForMidicloro(&devices[0])) {
+    cout << "No answer from midicloro, exiting" << endl;
+    return 1;
+  }
+
+  if (!clockBpms.empty()) {
+    runClockBenchmark(&devices[0], engineConfig);
+    delete midiin;
+    delete devices[0].out;
+    return 0;
+  }
+
+  for (int p=0; p<N_PATTERNS; p++) {
+    latencies[p].reserve((size_t)rate*duration*burstSize);
+    sent[p] = received[p] = 0;
+  }
+  cout << "Running for " << duration << " s" << endl;
+  runStart = monotonicNanos();
+  for (int i=0; i<nDevices; i++) {
+    if (pthread_create(&devices[i].thread, 0, deviceThread, &devices[i]) != 0) {
+      cerr << "Couldn't start device thread" << endl;
+      return 1;
+    }
+  }
+  for (int i=0; i<nDevices; i++)
+    pthread_join(devices[i].thread, 0);
+  long long elapsed = monotonicNanos() - runStart;
+
+  // Whatever isn't back after a second is lost
+  struct timespec drain = {1, 0};
+  nanosleep(&drain, 0);
+  pthread_mutex_lock(&pendingMutex);
+  report(elapsed);
+  pthread_mutex_unlock(&pendingMutex);
+
+  delete midiin;
+  for (int i=0; i<nDevices; i++)
+    delete devices[i].out;
+  return 0;
+}
+
+void usage(void) {
+  cout << "Usage: ./midicloro-stress [-n devices] [-r rate] [-d seconds] [-p patterns] [-s sysex size] [-b burst size] [-i burst interval ms] [-w wait seconds]" << endl;
+  cout << "       ./midicloro-stress -c bpm,bpm,... [-d seconds per tempo] [-l cpu=N,mem=N,io=N] [-w wait seconds]" << endl;
+  cout << "Patterns: comma separated list of chords, sweep, sysex and burst (default all)" << endl;
+  exit(0);
+}
+
+bool parsePatterns(const string &list) {
+  for (int p=0; p<N_PATTERNS; p++)
+    enabled[p] = false;
+  stringstream stream(list);
+  string name;
+  while (getline(stream, name, ',')) {
+    int p = find(patternNames, patternNames + N_PATTERNS, name) - patternNames;
+    if (p == N_PATTERNS)
+      return false;
+    enabled[p] = true;
+  }
+  return true;
+}
+
+bool parseBpms(const string &list) {
+  stringstream stream(list);
+  string bpm;
+  while (getline(stream, bpm, ',')) {
+    if (atoi(bpm.c_str()) < 1)
+      return false;
+    clockBpms.push_back(atoi(bpm.c_str()));
+  }
+  return !clockBpms.empty();
+}
+
+bool parseLoad(const string &spec) {
+  stringstream stream(spec);
+  string item;
+  while (getline(stream, item, ',')) {
+    size_t eq = item.find('=');
+    int l = find(loadNames, loadNames + N_LOADS, item.substr(0, eq)) - loadNames;
+    if (eq == string::npos || l == N_LOADS)
+      return false;
+    loadThreads[l] = atoi(item.substr(eq + 1).c_str());
+  }
+  return true;
+}
+
+void pickSweepCCs(const EngineConfig &config) {
+  const int candidates[] = {1, 74, 71, 2, 91, 93, 16, 17, 18, 19};
+  int controls[] = {config.velocityMidiCC, config.tempoMidiCC, config.chordMidiCC, config.routeMidiCC,
+                    config.startMidiCC, config.stopMidiCC, config.loopMidiCC};
+  int n = 0;
+  for (unsigned int i=0; i<sizeof(candidates)/sizeof(candidates[0]) && n < 2; i++) {
+    if (find(controls, controls + sizeof(controls)/sizeof(controls[0]), candidates[i]) == controls + sizeof(controls)/sizeof(controls[0]))
+      sweepCCs[n++] = candidates[i];
+  }
+}
+
+// Identifies a message on its way through midicloro. The channel and velocity may be
+// changed by midicloro so they aren't part of it. Returns 0 for messages not followed.
+unsigned int messageKey(const vector<unsigned char> &message) {
+  unsigned char type = message[0] & 0xF0;
+  if (message[0] == 0xF0 && message.size() > 4 && message[1] == SYSEX_ID && message[2] == SYSEX_DUMP)
+    return 0xF00000 | (message[3] << 7) | message[4];
+  if (message.size() < 3)
+    return 0;
+  if (type == 0x90 && message[2] == 0)
+    type = 0x80;
+  if (type == 0x80 || type == 0x90)
+    return (type << 16) | (message[1] << 8);
+  if (type == 0xB0)
+    return (type << 16) | (message[1] << 8) | message[2];
+  return 0;
+}
+
+// Called from the RtMidi input thread for every message from midicloro
+void onMessage(double /*deltaTime*/, vector<unsigned char> *message, void * /*userData*/) {
+  long long now = monotonicNanos();
+  if (message->empty())
+    return;
+  if (message->size() > 2 && (*message)[0] == 0xF0 && (*message)[1] == SYSEX_ID && (*message)[2] == SYSEX_PROBE) {
+    __atomic_store_n(&probeSeen, true, __ATOMIC_RELEASE);
+    return;
+  }
+  if ((*message)[0] == 0xF8) {
+    pthread_mutex_lock(&pendingMutex);
+    if (recordingClock)
+      clockTimes.push_back(now);
+    pthread_mutex_unlock(&pendingMutex);
+    return;
+  }
+  unsigned int key = messageKey(*message);
+  pthread_mutex_lock(&pendingMutex);
+  map<unsigned int, deque<Pending> >::iterator entry = key ? pending.find(key) : pending.end();
+  // Same messages come back in the order they were sent, the oldest one is matched
+  if (entry != pending.end() && !entry->second.empty()) {
+    Pending p = entry->second.front();
+    entry->second.pop_front();
+    latencies[p.pattern].push_back(now - p.time);
+    received[p.pattern]++;
+  }
+  else
+    extra++;
+  pthread_mutex_unlock(&pendingMutex);
+}
+
+void send(Device *device, vector<unsigned char> *message, int pattern) {
+  unsigned int key = messageKey(*message);
+  pthread_mutex_lock(&pendingMutex);
+  Pending p = {monotonicNanos(), pattern};
+  pending[key].push_back(p);
+  sent[pattern]++;
+  pthread_mutex_unlock(&pendingMutex);
+  device->out->sendMessage(message);
+}
+
+// midicloro opens the ports when it starts, a probe sysex comes back once it's running
+bool waitForMidicloro(Device *device) {
+  unsigned char probeBytes[] = {0xF0, SYSEX_ID, SYSEX_PROBE, 0xF7};
+  vector<unsigned char> probe(probeBytes, probeBytes + sizeof(probeBytes));
+  struct timespec period = {0, 100000000};
+  for (int i=0; i<waitSeconds*10; i++) {
+    device->out->sendMessage(&probe);
+    nanosleep(&period, 0);
+    if (__atomic_load_n(&probeSeen, __ATOMIC_ACQUIRE))
+      return true;
+  }
+  return false;
+}
+
+void *deviceThread(void *arg) {
+  Device *device = (Device *)arg;
+  long long period = 1000000000LL/rate;
+  long long steps = (long long)rate*duration;
+  long long burstSteps = max((long long)burstInterval*rate/1000, 1LL);
+  vector<unsigned char> message(3);
+  vector<unsigned char> sysex(sysexSize);
+  int root = 36;
+
+  for (long long step=0; step<steps; step++) {
+    struct timespec due;
+    long long dueTime = runStart + step*period;
+    due.tv_sec = dueTime/1000000000LL;
+    due.tv_nsec = dueTime%1000000000LL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, 0);
+
+    // A six note chord on one step, released on the next
+    if (device->patterns[CHORDS]) {
+      if (step % 2 == 0)
+        root = 36 + (step/2*5) % 48;
+      for (int i=0; i<6; i++) {
+        message[0] = (step % 2 == 0 ? 0x90 : 0x80) | device->index;
+        message[1] = root + CHORD_INTERVALS[i];
+        message[2] = step % 2 == 0 ? 100 : 0;
+        send(device, &message, CHORDS);
+      }
+    }
+    // Two CCs sweeping up and down
+    if (device->patterns[SWEEP]) {
+      message[0] = 0xB0 | device->index;
+      message[1] = sweepCCs[0];
+      message[2] = step % 128;
+      send(device, &message, SWEEP);
+      message[1] = sweepCCs[1];
+      message[2] = 127 - step % 128;
+      send(device, &message, SWEEP);
+    }
+    // A dump a second
+    if (device->patterns[SYSEX] && step % rate == 0) {
+      unsigned int sequence = __atomic_fetch_add(&sysexSequence, 1, __ATOMIC_RELAXED) & 0x3FFF;
+      sysex[0] = 0xF0;
+      sysex[1] = SYSEX_ID;
+      sysex[2] = SYSEX_DUMP;
+      sysex[3] = sequence >> 7;
+      sysex[4] = sequence & 0x7F;
+      for (int i=5; i<sysexSize-1; i++)
+        sysex[i] = (i + sequence) & 0x7F;
+      sysex[sysexSize-1] = 0xF7;
+      send(device, &sysex, SYSEX);
+    }
+    // All devices at the same step, as fast as the port takes them
+    if (device->patterns[BURST] && step % burstSteps == 0) {
+      for (int i=0; i<burstSize; i++) {
+        message[0] = 0x90 | device->index;
+        message[1] = BURST_FIRST_NOTE + i % (128 - BURST_FIRST_NOTE);
+        message[2] = 100;
+        send(device, &message, BURST);
+        message[0] = 0x80 | device->index;
+        message[2] = 0;
+        send(device, &message, BURST);
+      }
+    }
+  }
+  return 0;
+}
+
+long long percentile(const vector<long long> &sorted, double fraction) {
+  if (sorted.empty())
+    return 0;
+  return sorted[min((size_t)(fraction*sorted.size()), sorted.size() - 1)];
+}
+
+void printLine(const string &name, unsigned long nSent, unsigned long nReceived, vector<long long> *values) {
+  sort(values->begin(), values->end());
+  cout << left << setw(8) << name << right << setw(10) << nSent << setw(10) << nReceived
+       << setw(8) << nSent - nReceived << fixed << setprecision(1)
+       << setw(10) << percentile(*values, 0.5)/1000.0 << setw(10) << percentile(*values, 0.99)/1000.0
+       << setw(10) << percentile(*values, 0.999)/1000.0
+       << setw(10) << (values->empty() ? 0 : values->back())/1000.0 << endl;
+}
+
+void report(long long elapsed) {
+  unsigned long totalSent = 0, totalReceived = 0;
+  vector<long long> all;
+  cout << left << setw(8) << "pattern" << right << setw(10) << "sent" << setw(10) << "received" << setw(8) << "dropped"
+       << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(10) << "max us" << endl;
+  for (int p=0; p<N_PATTERNS; p++) {
+    if (!enabled[p])
+      continue;
+    printLine(patternNames[p], sent[p], received[p], &latencies[p]);
+    totalSent += sent[p];
+    totalReceived += received[p];
+    all.insert(all.end(), latencies[p].begin(), latencies[p].end());
+  }
+  printLine("all", totalSent, totalReceived, &all);
+  double seconds = elapsed/1000000000.0;
+  cout << "Throughput: " << (long long)(totalSent/seconds) << " messages/s sent, "
+       << (long long)(totalReceived/seconds) << " messages/s received" << endl;
+  cout << "Extra messages from midicloro (chords, changed notes): " << extra << endl;
+}
+
+// Competes with midicloro for the CPU, the memory bus or the disk until the benchmark ends
+void *loadThread(void *arg) {
+  int load = *(int *)arg;
+  vector<char> buffer(load == LOAD_MEM ? MEM_LOAD_SIZE : IO_LOAD_BLOCK, 1);
+  int fd = -1;
+  char path[] = "/tmp/midicloro-stress-XXXXXX";
+  if (load == LOAD_IO) {
+    fd = mkstemp(path);
+    if (fd < 0) {
+      cerr << "Couldn't create file for the I/O load" << endl;
+      return 0;
+    }
+    unlink(path);
+  }
+  volatile unsigned long spins = 0;
+  while (__atomic_load_n(&loadRunning, __ATOMIC_ACQUIRE)) {
+    if (load == LOAD_CPU) {
+      for (int i=0; i<1000000; i++)
+        spins++;
+    }
+    else if (load == LOAD_MEM) {
+      // Copy one half over the other, both ways
+      size_t half = MEM_LOAD_SIZE/2;
+      memcpy(&buffer[0], &buffer[half], half);
+      memcpy(&buffer[half], &buffer[0], half);
+    }
+    else {
+      // Keep a file of 64 blocks rewritten and synced
+      for (int i=0; i<64; i++) {
+        if (pwrite(fd, &buffer[0], IO_LOAD_BLOCK, (off_t)i*IO_LOAD_BLOCK) < 0)
+          break;
+      }
+      fsync(fd);
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  return 0;
+}
+
+// Prints the spread of clock intervals around the ideal one
+void printIntervalHistogram(const vector<long long> &errors) {
+  const long long edges[] = {-1000000, -500000, -100000, -50000, -10000, 10000, 50000, 100000, 500000, 1000000};
+  const int nEdges = sizeof(edges)/sizeof(edges[0]);
+  vector<unsigned long> counts(nEdges + 1, 0);
+  for (unsigned int i=0; i<errors.size(); i++)
+    counts[upper_bound(edges, edges + nEdges, errors[i]) - edges]++;
+  for (int b=0; b<=nEdges; b++) {
+    ostringstream range;
+    if (b == 0)
+      range << "< " << edges[0]/1000;
+    else if (b == nEdges)
+      range << ">= " << edges[nEdges-1]/1000;
+    else
+      range << edges[b-1]/1000 << " .. " << edges[b]/1000;
+    cout << "  " << right << setw(14) << range.str() << " us: " << counts[b] << endl;
+  }
+}
+
+void runClockBenchmark(Device *device, const EngineConfig &config) {
+  vector<pthread_t> loads;
+  static int loadIds[N_LOADS] = {LOAD_CPU, LOAD_MEM, LOAD_IO};
+  __atomic_store_n(&loadRunning, true, __ATOMIC_RELEASE);
+  for (int l=0; l<N_LOADS; l++) {
+    for (int i=0; i<loadThreads[l]; i++) {
+      pthread_t thread;
+      if (pthread_create(&thread, 0, loadThread, &loadIds[l]) == 0)
+        loads.push_back(thread);
+      else
+        cerr << "Couldn't start " << loadNames[l] << " load thread" << endl;
+    }
+  }
+  cout << "Load threads: " << loadThreads[LOAD_CPU] << " cpu, " << loadThreads[LOAD_MEM] << " mem, "
+       << loadThreads[LOAD_IO] << " io" << endl;
+
+  vector<unsigned char> tempo(3);
+  for (unsigned int b=0; b<clockBpms.size(); b++) {
+    // Set from the tempo CC value, midicloro's tempo range is bpmOffsetForMidiCC + 0-127
+    int value = clockBpms[b] - config.bpmOffsetForMidiCC;
+    if (value < 0 || value > 127) {
+      cout << clockBpms[b] << " BPM: out of range " << config.bpmOffsetForMidiCC << "-"
+           << config.bpmOffsetForMidiCC + 127 << ", skipped" << endl;
+      continue;
+    }
+    tempo[0] = 0xB0;
+    tempo[1] = config.tempoMidiCC;
+    tempo[2] = value;
+    device->out->sendMessage(&tempo);
+    struct timespec settle = {TEMPO_SETTLE_SECONDS, 0};
+    nanosleep(&settle, 0);
+
+    pthread_mutex_lock(&pendingMutex);
+    clockTimes.clear();
+    clockTimes.reserve((size_t)clockBpms[b]*24*duration/60 + 1024);
+    recordingClock = true;
+    pthread_mutex_unlock(&pendingMutex);
+    struct timespec run = {duration, 0};
+    nanosleep(&run, 0);
+    pthread_mutex_lock(&pendingMutex);
+    recordingClock = false;
+    vector<long long> times = clockTimes;
+    pthread_mutex_unlock(&pendingMutex);
+
+    // The same interval as midicloro works out for the tempo CC
+    long long ideal = 60000000000LL/(clockBpms[b]*24);
+    cout << clockBpms[b] << " BPM: ";
+    if (times.size() < 2) {
+      cout << "no clock received" << endl;
+      continue;
+    }
+    vector<long long> errors;
+    double sum = 0, sumSquares = 0;
+    long long maxJitter = 0;
+    for (unsigned int i=1; i<times.size(); i++) {
+      long long error = times[i] - times[i-1] - ideal;
+      errors.push_back(error);
+      sum += error;
+      sumSquares += (double)error*error;
+      maxJitter = max(maxJitter, error < 0 ? -error : error);
+    }
+    double mean = sum/errors.size();
+    double stddev = sqrt(max(sumSquares/errors.size() - mean*mean, 0.0));
+    long long drift = times.back() - times.front() - (long long)(times.size() - 1)*ideal;
+    cout << times.size() << " ticks, ideal interval " << ideal/1000.0 << " us" << endl;
+    cout << "  mean error " << fixed << setprecision(1) << mean/1000.0 << " us, stddev " << stddev/1000.0
+         << " us, max jitter " << maxJitter/1000.0 << " us" << endl;
+    cout << "  drift " << drift/1000.0 << " us over " << (times.back() - times.front())/1000000000.0 << " s ("
+         << drift*1000000.0/(times.back() - times.front()) << " ppm)" << endl;
+    cout.unsetf(ios::floatfield);
+    printIntervalHistogram(errors);
+  }
+
+  __atomic_store_n(&loadRunning, false, __ATOMIC_RELEASE);
+  for (unsigned int i=0; i<loads.size(); i++)
+    pthread_join(loads[i], 0);
+}
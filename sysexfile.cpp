@@ -0,0 +1,262 @@
+//************** MIDIcloro **************
+//
+// Sysex librarian: records incoming dumps to .syx files and plays
+// .syx files to the output.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include "sysexfile.h"
+
+using namespace std;
+
+// Recorded files grow in steps of this size while a dump comes in
+const size_t RECORD_GROW_SIZE = 64*1024;
+// Room for over a second of sysex at USB speeds if the writer thread falls behind, must be a power of two
+const size_t RECORD_RING_SIZE = 1024*1024;
+// How often the writer thread wakes up to move chunks to the files
+const long RECORD_WRITER_PERIOD = 10000000;
+// Whole dumps (when sysex isn't streamed) go through the ring in pieces of at most this size
+const size_t RECORD_PIECE_SIZE = 64*1024;
+// A DIN MIDI cable carries 3125 bytes per second (31250 baud, 10 bits per byte)
+const long long WIRE_NS_PER_BYTE = 320000;
+
+SysexRecorder::SysexRecorder(const string &dir)
+  : dir(dir), threadStarted(false), stopRequested(false), ring(RECORD_RING_SIZE), ringHead(0), ringTail(0),
+    dropped(0), fd(-1), map(0), mapSize(0), used(0), fileCount(0) {
+  if (pthread_create(&thread, 0, writerThread, this) != 0)
+    cerr << "Couldn't start the sysex recorder thread, sysex recording disabled" << endl;
+  else
+    threadStarted = true;
+}
+
+SysexRecorder::~SysexRecorder() {
+  if (threadStarted) {
+    __atomic_store_n(&stopRequested, true, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+  }
+}
+
+void SysexRecorder::write(const unsigned char *bytes, size_t nBytes) {
+  if (!threadStarted)
+    return;
+  for (size_t offset=0; offset<nBytes; offset+=RECORD_PIECE_SIZE)
+    queue(bytes + offset, min(nBytes - offset, RECORD_PIECE_SIZE));
+}
+
+void SysexRecorder::queue(const unsigned char *bytes, size_t nBytes) {
+  unsigned int length = nBytes;
+  size_t recordSize = sizeof(length) + nBytes;
+  size_t head = ringHead;
+  if (RECORD_RING_SIZE - (head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE)) < recordSize) {
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  // Copy in at most two parts when the record wraps around the end of the ring
+  const unsigned char *parts[2] = {(const unsigned char *)&length, bytes};
+  size_t sizes[2] = {sizeof(length), nBytes};
+  size_t pos = head;
+  for (int p=0; p<2; p++) {
+    size_t index = pos & (RECORD_RING_SIZE-1);
+    size_t first = min(sizes[p], RECORD_RING_SIZE - index);
+    memcpy(&ring[index], parts[p], first);
+    memcpy(&ring[0], parts[p] + first, sizes[p] - first);
+    pos += sizes[p];
+  }
+  __atomic_store_n(&ringHead, head + recordSize, __ATOMIC_RELEASE);
+}
+
+void *SysexRecorder::writerThread(void *recorder) {
+  ((SysexRecorder *)recorder)->run();
+  return 0;
+}
+
+void SysexRecorder::run() {
+  // Disk writes must never compete with the MIDI threads
+  prctl(PR_SET_NAME, "cloro-sysexrec");
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  struct timespec period = {0, RECORD_WRITER_PERIOD};
+  while (true) {
+    bool stopping = __atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE);
+    drain();
+    if (stopping)
+      break;
+    nanosleep(&period, 0);
+  }
+  close();
+  unsigned long nDropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (nDropped > 0)
+    cerr << "Sysex recorder dropped " << nDropped << " chunks" << endl;
+}
+
+size_t SysexRecorder::ringRead(size_t pos, void *dest, size_t nBytes) {
+  size_t index = pos & (RECORD_RING_SIZE-1);
+  size_t first = min(nBytes, RECORD_RING_SIZE - index);
+  memcpy(dest, &ring[index], first);
+  memcpy((unsigned char *)dest + first, &ring[0], nBytes - first);
+  return pos + nBytes;
+}
+
+void SysexRecorder::drain() {
+  size_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+  size_t tail = ringTail;
+  while (tail != head) {
+    unsigned int length;
+    tail = ringRead(tail, &length, sizeof(length));
+    chunk.resize(length);
+    tail = ringRead(tail, &chunk[0], length);
+    append(&chunk[0], length);
+  }
+  __atomic_store_n(&ringTail, tail, __ATOMIC_RELEASE);
+}
+
+void SysexRecorder::append(const unsigned char *bytes, size_t nBytes) {
+  // A new message starts a new file, even if the last one never ended
+  if (bytes[0] == 0xF0) {
+    close();
+    if (!open())
+      return;
+  }
+  // Chunks without a start are from a dump that began before recording could start
+  if (fd < 0 || !reserve(nBytes))
+    return;
+  copy(bytes, bytes + nBytes, map + used);
+  used += nBytes;
+  if (bytes[nBytes-1] == 0xF7)
+    close();
+}
+
+bool SysexRecorder::open() {
+  time_t now = time(0);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  ostringstream path;
+  path << dir << "/sysex-" << stamp << "-" << setw(3) << setfill('0') << fileCount++ << ".syx";
+  fd = ::open(path.str().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    cerr << "Couldn't create sysex file: " << path.str() << endl;
+    return false;
+  }
+  cout << "Recording sysex to: " << path.str() << endl;
+  used = 0;
+  return reserve(RECORD_GROW_SIZE);
+}
+
+bool SysexRecorder::reserve(size_t nBytes) {
+  if (used + nBytes <= mapSize)
+    return true;
+  size_t newSize = ((used + nBytes)/RECORD_GROW_SIZE + 1)*RECORD_GROW_SIZE;
+  void *newMap;
+  if (ftruncate(fd, newSize) != 0)
+    newMap = MAP_FAILED;
+  else if (map)
+    newMap = mremap(map, mapSize, newSize, MREMAP_MAYMOVE);
+  else
+    newMap = mmap(0, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (newMap == MAP_FAILED) {
+    cerr << "Couldn't grow sysex file, recording stopped" << endl;
+    close();
+    return false;
+  }
+  map = (unsigned char *)newMap;
+  mapSize = newSize;
+  return true;
+}
+
+void SysexRecorder::close() {
+  if (map)
+    munmap(map, mapSize);
+  if (fd >= 0) {
+    // Cut off the unused part of the last growth step
+    if (ftruncate(fd, used) != 0)
+      cerr << "Couldn't truncate sysex file" << endl;
+    ::close(fd);
+  }
+  map = 0;
+  mapSize = 0;
+  used = 0;
+  fd = -1;
+}
+
+SysexPlayer::SysexPlayer(int chunkSize, long long messageDelay)
+  : data(0), size(0), offset(0), chunkSize(max(chunkSize, 1)), messageDelay(messageDelay),
+    nextSend(0), midMessage(false) {
+  chunk.reserve(this->chunkSize);
+}
+
+SysexPlayer::~SysexPlayer() {
+  if (data)
+    munmap(data, size);
+}
+
+bool SysexPlayer::open(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Couldn't open sysex file: " << path << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    cerr << "Couldn't read sysex file: " << path << endl;
+    ::close(fd);
+    return false;
+  }
+  void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    cerr << "Couldn't map sysex file: " << path << endl;
+    return false;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  data = (unsigned char *)map;
+  size = st.st_size;
+  offset = 0;
+  nextSend = 0;
+  midMessage = false;
+  cout << "Sending sysex file: " << path << " (" << size << " bytes)" << endl;
+  return true;
+}
+
+bool SysexPlayer::poll(RtMidiOut *out, long long now) {
+  if (offset >= size)
+    return false;
+  if (now < nextSend)
+    return true;
+
+  // Skip anything outside a sysex message, such as padding between dumps
+  if (!midMessage) {
+    while (offset < size && data[offset] != 0xF0)
+      offset++;
+    if (offset >= size)
+      return false;
+  }
+
+  // A chunk never runs past the end of a message, so the pause between messages can be kept
+  const unsigned char *start = data + offset;
+  const unsigned char *end = data + min(size, offset + chunkSize);
+  const unsigned char *eox = find(midMessage ? start : start + 1, end, (unsigned char)0xF7);
+  if (eox != end)
+    end = eox + 1;
+  chunk.assign(start, end);
+  out->sendMessage(&chunk);
+  offset += chunk.size();
+  midMessage = chunk.back() != 0xF7;
+
+  // Don't send faster than the cable can carry, and give the receiver time between messages
+  nextSend = now + chunk.size()*WIRE_NS_PER_BYTE + (midMessage ? 0 : messageDelay);
+  return offset < size;
+}
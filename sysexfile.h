@@ -0,0 +1,85 @@
+//************** MIDIcloro **************
+//
+// Sysex librarian: records incoming dumps to .syx files and plays
+// .syx files to the output. Both sides use memory-mapped files, so
+// dumps of any size stream through without being loaded into memory.
+// Recorded chunks go through a lock-free ring to a background thread,
+// which does the file work, so the main loop never waits on the disk.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_SYSEXFILE_H
+#define MIDICLORO_SYSEXFILE_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "rtmidi/RtMidi.h"
+
+// Writes every sysex message passed to it to a file of its own in a directory
+class SysexRecorder {
+ public:
+  SysexRecorder(const std::string &dir);
+  ~SysexRecorder();
+  // Queue a sysex message or a streamed chunk. F0 starts a new file, F7 completes it.
+  // Never blocks, the chunk is dropped if the ring is full. Only to be called from one thread.
+  void write(const unsigned char *bytes, size_t nBytes);
+  // Chunks dropped because the ring was full, can be read from any thread
+  unsigned long getDropped() const { return __atomic_load_n(&dropped, __ATOMIC_RELAXED); }
+
+ private:
+  void queue(const unsigned char *bytes, size_t nBytes);
+  static void *writerThread(void *recorder);
+  void run();
+  void drain();
+  size_t ringRead(size_t pos, void *dest, size_t nBytes);
+  void append(const unsigned char *bytes, size_t nBytes);
+  bool open();
+  bool reserve(size_t nBytes);
+  void close();
+
+  std::string dir;
+  pthread_t thread;
+  bool threadStarted;
+  bool stopRequested;
+
+  // Ring shared between write() and the writer thread
+  std::vector<unsigned char> ring;
+  size_t ringHead; // Written by write() only
+  size_t ringTail; // Written by the writer thread only
+  unsigned long dropped;
+
+  // File, used by the writer thread only
+  std::vector<unsigned char> chunk;
+  int fd;
+  unsigned char *map;
+  size_t mapSize;
+  size_t used;
+  int fileCount;
+};
+
+// Plays a .syx file in chunks, paced for the receiving device
+class SysexPlayer {
+ public:
+  SysexPlayer(int chunkSize, long long messageDelay);
+  ~SysexPlayer();
+  bool open(const std::string &path);
+  // True while a sysex message is partly sent (nothing else may be sent in between)
+  bool inMessage() const { return midMessage; }
+  // Send the next chunk if it is due. Returns false when the whole file has been sent.
+  bool poll(RtMidiOut *out, long long now);
+
+ private:
+  unsigned char *data;
+  size_t size;
+  size_t offset;
+  int chunkSize;
+  long long messageDelay; // Pause after each complete message in ns
+  long long nextSend;
+  bool midMessage;
+  std::vector<unsigned char> chunk;
+};
+
+#endif
@@ -0,0 +1,26 @@
+//************** MIDIcloro **************
+//
+// Monotonic time helpers
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_TIMEUTIL_H
+#define MIDICLORO_TIMEUTIL_H
+
+#include <time.h>
+
+// Nanoseconds in a timespec
+inline long long toNanos(const struct timespec &ts) {
+  return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+// Current CLOCK_MONOTONIC time in ns
+inline long long monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return toNanos(now);
+}
+
+#endif
@@ -0,0 +1,221 @@
+//************** MIDIcloro **************
+//
+// Pipeline tracing
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include "trace.h"
+
+const char *TRACE_STAGE_NAMES[TRACE_STAGES] = {
+  "receive", "drop", "pop", "handle", "output", "flush"
+};
+
+const char *TRACE_BRANCH_NAMES[TRACE_BRANCHES] = {
+  "sysex", "mono", "note", "start", "stop", "tempo-cc", "chord-cc",
+  "route-cc", "velocity-cc", "loop-cc", "start-cc", "stop-cc", "other",
+  "ignored"
+};
+
+#ifdef MIDICLORO_TRACE
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "timeutil.h"
+
+using namespace std;
+
+// Records kept per thread, must be a power of two. 32k records are a few seconds of dense MIDI.
+const unsigned long RING_RECORDS = 32768;
+// How often the dump thread checks for requests
+const long DUMP_PERIOD = 10000000;
+// A threshold dump waits this long, so the records after the slow message are in it too
+const long long DUMP_DELAY = 100000000LL;
+// Threshold dumps closer together than this are skipped
+const long long DUMP_HOLDOFF = 10000000000LL;
+
+// Each ring has one writing thread. The dump thread copies it while it's
+// written and keeps only the records that can't have been overwritten.
+struct TraceRing {
+  TraceRecord *records;
+  unsigned long head; // Records written so far
+  char name[TRACE_THREAD_NAME_SIZE];
+};
+
+static TraceRing rings[TRACE_MAX_THREADS];
+static int nRings = 0; // Rings claimed by threads
+static bool traceEnabled = false;
+static string traceDir;
+static long long traceThreshold;
+static pthread_t dumpThread;
+static bool stopRequested = false;
+static bool signalDump = false; // Set by SIGUSR1
+static long long thresholdDumpAt = 0; // When a requested threshold dump is due, 0 if none
+static long long lastThresholdDump = 0;
+static int dumpCount = 0;
+
+static __thread TraceRing *threadRing = 0;
+static __thread bool threadFull = false; // More threads than rings, this one isn't traced
+static __thread long long currentEvent = 0;
+static __thread unsigned char currentPort = TRACE_NO_PORT;
+
+static void requestSignalDump(int /*ignore*/) {
+  __atomic_store_n(&signalDump, true, __ATOMIC_RELAXED);
+}
+
+static TraceRing *claimRing() {
+  int i = __atomic_fetch_add(&nRings, 1, __ATOMIC_RELAXED);
+  if (i >= TRACE_MAX_THREADS) {
+    threadFull = true;
+    return 0;
+  }
+  pthread_getname_np(pthread_self(), rings[i].name, TRACE_THREAD_NAME_SIZE);
+  threadRing = &rings[i];
+  return threadRing;
+}
+
+void traceRecord(long long time, int stage, int port, long long eventId, int detail) {
+  if (!__atomic_load_n(&traceEnabled, __ATOMIC_RELAXED) || threadFull)
+    return;
+  TraceRing *ring = threadRing ? threadRing : claimRing();
+  if (!ring)
+    return;
+  unsigned long head = ring->head;
+  TraceRecord *record = &ring->records[head & (RING_RECORDS-1)];
+  record->time = time;
+  record->eventId = eventId;
+  record->stage = stage;
+  record->port = port;
+  record->detail = detail;
+  record->thread = ring - rings;
+  record->reserved = 0;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void traceSetEvent(long long eventId, int port) {
+  currentEvent = eventId;
+  currentPort = port;
+}
+
+void traceBranch(int branch) {
+  if (currentEvent != 0)
+    traceRecord(monotonicNanos(), TRACE_HANDLE, currentPort, currentEvent, branch);
+}
+
+void traceLatency(long long latency) {
+  if (traceThreshold <= 0 || latency < traceThreshold || __atomic_load_n(&thresholdDumpAt, __ATOMIC_RELAXED) != 0)
+    return;
+  long long now = monotonicNanos();
+  if (lastThresholdDump != 0 && now - lastThresholdDump < DUMP_HOLDOFF)
+    return;
+  lastThresholdDump = now;
+  __atomic_store_n(&thresholdDumpAt, now + DUMP_DELAY, __ATOMIC_RELAXED);
+}
+
+static bool byTime(const TraceRecord &a, const TraceRecord &b) {
+  return a.time < b.time;
+}
+
+static void writeDump(long long threshold) {
+  vector<TraceRecord> records;
+  char names[TRACE_MAX_THREADS][TRACE_THREAD_NAME_SIZE];
+  int nThreads = min(__atomic_load_n(&nRings, __ATOMIC_RELAXED), TRACE_MAX_THREADS);
+  for (int t=0; t<nThreads; t++) {
+    memcpy(names[t], rings[t].name, TRACE_THREAD_NAME_SIZE);
+    unsigned long head = __atomic_load_n(&rings[t].head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > RING_RECORDS ? head - RING_RECORDS : 0;
+    size_t start = records.size();
+    for (unsigned long i=first; i<head; i++)
+      records.push_back(rings[t].records[i & (RING_RECORDS-1)]);
+    // The writer may have gone round while we copied: drop the records it could have
+    // overwritten, including the one it may be writing now
+    unsigned long after = __atomic_load_n(&rings[t].head, __ATOMIC_ACQUIRE);
+    if (after + 1 > first + RING_RECORDS) {
+      unsigned long overwritten = min(after + 1 - RING_RECORDS - first, head - first);
+      records.erase(records.begin() + start, records.begin() + start + overwritten);
+    }
+  }
+  stable_sort(records.begin(), records.end(), byTime);
+
+  ostringstream path;
+  path << traceDir << "/trace-" << getpid() << "-" << setw(3) << setfill('0') << dumpCount++ << ".bin";
+  FILE *f = fopen(path.str().c_str(), "wb");
+  if (!f) {
+    cerr << "Couldn't write trace: " << path.str() << endl;
+    return;
+  }
+  TraceFileHeader header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.nThreads = nThreads;
+  header.nRecords = records.size();
+  header.dumpTime = monotonicNanos();
+  header.threshold = threshold;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(names, TRACE_THREAD_NAME_SIZE, nThreads, f) == (size_t)nThreads &&
+            (records.empty() || fwrite(&records[0], sizeof(TraceRecord), records.size(), f) == records.size());
+  if (fclose(f) != 0 || !ok)
+    cerr << "Couldn't write trace: " << path.str() << endl;
+  else
+    cerr << "Trace written: " << path.str() << " (" << records.size() << " records)" << endl;
+}
+
+static void *dumpThreadMain(void *) {
+  // Writing a dump must never compete with the MIDI threads
+  prctl(PR_SET_NAME, "cloro-trace");
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  struct timespec period = {0, DUMP_PERIOD};
+  while (!__atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE)) {
+    if (__atomic_exchange_n(&signalDump, false, __ATOMIC_RELAXED))
+      writeDump(0);
+    long long dueAt = __atomic_load_n(&thresholdDumpAt, __ATOMIC_RELAXED);
+    if (dueAt != 0 && monotonicNanos() >= dueAt) {
+      writeDump(traceThreshold);
+      __atomic_store_n(&thresholdDumpAt, 0, __ATOMIC_RELAXED);
+    }
+    nanosleep(&period, 0);
+  }
+  return 0;
+}
+
+void traceStart(const string &dir, long long threshold) {
+  traceDir = dir.empty() ? "." : dir;
+  traceThreshold = threshold;
+  for (int i=0; i<TRACE_MAX_THREADS; i++) {
+    rings[i].records = new TraceRecord[RING_RECORDS];
+    rings[i].head = 0;
+    rings[i].name[0] = 0;
+  }
+  if (pthread_create(&dumpThread, 0, dumpThreadMain, 0) != 0) {
+    cerr << "Couldn't start the trace thread, tracing disabled" << endl;
+    return;
+  }
+  (void) signal(SIGUSR1, requestSignalDump);
+  __atomic_store_n(&traceEnabled, true, __ATOMIC_RELEASE);
+  cout << "Tracing, send SIGUSR1 to write a trace to " << traceDir << endl;
+}
+
+void traceStop() {
+  if (!__atomic_load_n(&traceEnabled, __ATOMIC_RELAXED))
+    return;
+  __atomic_store_n(&stopRequested, true, __ATOMIC_RELEASE);
+  pthread_join(dumpThread, 0);
+  // A threshold dump that wasn't due yet is written now
+  if (__atomic_load_n(&thresholdDumpAt, __ATOMIC_RELAXED) != 0)
+    writeDump(traceThreshold);
+  __atomic_store_n(&traceEnabled, false, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,101 @@
+//************** MIDIcloro **************
+//
+// Pipeline tracing: compact binary records of each message passing the
+// stages between the ALSA input thread and the output port, kept in a
+// lock-free ring per thread and dumped to a file on SIGUSR1 or when a
+// message takes longer than a threshold. midicloro-analyze turns a dump
+// into per-stage latencies.
+//
+// Tracing is compiled in with -DMIDICLORO_TRACE (make trace), without
+// it the TRACE macros are empty and cost nothing.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_TRACE_H
+#define MIDICLORO_TRACE_H
+
+#include <string>
+
+// The detail of a record is the status byte of the message unless noted
+enum TraceStage {
+  TRACE_RECEIVE, // The ALSA input thread read the message
+  TRACE_DROP,    // The input queue was full
+  TRACE_POP,     // The main loop took the message from the input queue
+  TRACE_HANDLE,  // The engine picked a branch for it, detail is the TraceBranch
+  TRACE_OUTPUT,  // A message caused by it was sent to the output
+  TRACE_FLUSH,   // The number of messages held back by the output changed, detail is the number (max 255)
+  TRACE_STAGES
+};
+
+enum TraceBranch {
+  BRANCH_SYSEX, BRANCH_MONO, BRANCH_NOTE, BRANCH_START, BRANCH_STOP, BRANCH_TEMPO_CC, BRANCH_CHORD_CC,
+  BRANCH_ROUTE_CC, BRANCH_VELOCITY_CC, BRANCH_LOOP_CC, BRANCH_START_CC, BRANCH_STOP_CC, BRANCH_OTHER,
+  BRANCH_IGNORED,
+  TRACE_BRANCHES
+};
+
+extern const char *TRACE_STAGE_NAMES[TRACE_STAGES];
+extern const char *TRACE_BRANCH_NAMES[TRACE_BRANCHES];
+
+// A message is identified by its arrival time at the input thread, 0 for
+// messages that didn't come from an input
+struct TraceRecord {
+  long long time; // CLOCK_MONOTONIC ns
+  long long eventId;
+  unsigned char stage;
+  unsigned char port; // Input 0-3, TRACE_NO_PORT if unknown
+  unsigned char detail;
+  unsigned char thread; // Index into the thread names of the dump
+  unsigned int reserved;
+};
+
+const unsigned char TRACE_NO_PORT = 0xFF;
+const int TRACE_MAX_THREADS = 8;
+const int TRACE_THREAD_NAME_SIZE = 16;
+
+// Dump file: the header, the thread names and then the records, oldest first
+const char TRACE_MAGIC[8] = {'M','C','T','R','A','C','E','1'};
+struct TraceFileHeader {
+  char magic[8];
+  unsigned int nThreads;
+  unsigned int nRecords;
+  long long dumpTime; // CLOCK_MONOTONIC ns
+  long long threshold; // ns, 0 for a dump on SIGUSR1
+};
+
+#ifdef MIDICLORO_TRACE
+
+// Allocate the rings and start the thread that writes the dumps to dir.
+// A message slower than threshold ns from input to output triggers a dump, 0 to only dump on SIGUSR1.
+void traceStart(const std::string &dir, long long threshold);
+// Write a last dump if one was requested, and stop
+void traceStop();
+void traceRecord(long long time, int stage, int port, long long eventId, int detail);
+// The message the calling thread handles now, for records made without knowing it
+void traceSetEvent(long long eventId, int port);
+void traceBranch(int branch);
+// Input to output latency of a message, dumps if it's over the threshold
+void traceLatency(long long latency);
+
+#define TRACE_AT(time, stage, port, eventId, detail) traceRecord(time, stage, port, eventId, detail)
+#define TRACE(stage, port, eventId, detail) traceRecord(monotonicNanos(), stage, port, eventId, detail)
+#define TRACE_EVENT(eventId, port) traceSetEvent(eventId, port)
+#define TRACE_BRANCH(branch) traceBranch(branch)
+#define TRACE_LATENCY(latency) traceLatency(latency)
+
+#else
+
+inline void traceStart(const std::string &/*dir*/, long long /*threshold*/) {}
+inline void traceStop() {}
+
+#define TRACE_AT(time, stage, port, eventId, detail) ((void)0)
+#define TRACE(stage, port, eventId, detail) ((void)0)
+#define TRACE_EVENT(eventId, port) ((void)0)
+#define TRACE_BRANCH(branch) ((void)0)
+#define TRACE_LATENCY(latency) ((void)0)
+
+#endif
+
+#endif
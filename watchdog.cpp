@@ -0,0 +1,202 @@
+//************** MIDIcloro **************
+//
+// Stall watchdog
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <signal.h>
+#include <time.h>
+#include <execinfo.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "watchdog.h"
+#include "metrics.h"
+#include "timeutil.h"
+
+using namespace std;
+
+const int MAX_FRAMES = 32;
+// How long to wait for a stalled thread to take its stack. A thread in
+// uninterruptible sleep, e.g. on a page fault, only does so when it wakes up.
+const long long STACK_TIMEOUT = 100000000LL;
+
+// The stack is taken by the stalled thread itself, in the SIGUSR2 handler.
+// One request at a time: a new one waits until the thread of the last one
+// has answered.
+static void *stackFrames[MAX_FRAMES];
+static int nStackFrames = 0;
+static int stackRequest = 0; // Thread asked for its stack
+static bool stackDone = true;
+
+static void takeStack(int /*ignore*/) {
+  int savedErrno = errno;
+  if (syscall(SYS_gettid) == __atomic_load_n(&stackRequest, __ATOMIC_ACQUIRE) && !__atomic_load_n(&stackDone, __ATOMIC_ACQUIRE)) {
+    nStackFrames = backtrace(stackFrames, MAX_FRAMES);
+    __atomic_store_n(&stackDone, true, __ATOMIC_RELEASE);
+  }
+  errno = savedErrno;
+}
+
+StallWatchdog::StallWatchdog(const vector<string> &names, Overdue overdue, long long threshold)
+  : overdue(overdue), threshold(threshold), period(min(max(threshold/4, 1000000LL), 100000000LL)),
+    threadStarted(false), stopRequested(false) {
+  for (unsigned int i=0; i<names.size(); i++) {
+    Activity activity;
+    activity.name = names[i];
+    activity.stalls = 0;
+    activity.longest = 0;
+    activity.stalledFor = 0;
+    activities.push_back(activity);
+  }
+  // backtrace loads libgcc on its first call, which mustn't happen in the signal handler
+  void *frame;
+  backtrace(&frame, 1);
+  struct sigaction action;
+  action.sa_handler = takeStack;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &action, 0);
+
+  if (pthread_create(&thread, 0, watchdogThread, this) != 0)
+    cerr << "Couldn't start the watchdog thread, stalls won't be detected" << endl;
+  else
+    threadStarted = true;
+}
+
+StallWatchdog::~StallWatchdog() {
+  if (threadStarted) {
+    __atomic_store_n(&stopRequested, true, __ATOMIC_RELEASE);
+    pthread_join(thread, 0);
+  }
+}
+
+void StallWatchdog::writeMetrics(ostream &out) {
+  writeMetricHeader(out, "midicloro_stalls_total", "counter", "Times a thread fell behind by more than the stall threshold.");
+  for (unsigned int i=0; i<activities.size(); i++)
+    out << "midicloro_stalls_total{activity=\"" << metricLabel(activities[i].name) << "\"} " << readMetric(&activities[i].stalls) << "\n";
+  writeMetricHeader(out, "midicloro_stall_seconds", "gauge", "How long the current stall has lasted, 0 when there's none.");
+  for (unsigned int i=0; i<activities.size(); i++)
+    out << "midicloro_stall_seconds{activity=\"" << metricLabel(activities[i].name) << "\"} "
+        << __atomic_load_n(&activities[i].stalledFor, __ATOMIC_RELAXED)/1000000000.0 << "\n";
+  writeMetricHeader(out, "midicloro_stall_max_seconds", "gauge", "The longest stall so far.");
+  for (unsigned int i=0; i<activities.size(); i++)
+    out << "midicloro_stall_max_seconds{activity=\"" << metricLabel(activities[i].name) << "\"} "
+        << __atomic_load_n(&activities[i].longest, __ATOMIC_RELAXED)/1000000000.0 << "\n";
+}
+
+void *StallWatchdog::watchdogThread(void *watchdog) {
+  ((StallWatchdog *)watchdog)->run();
+  return 0;
+}
+
+void StallWatchdog::run() {
+  // Not niced like the other background threads: a watchdog that starves
+  // along with the MIDI threads would miss the stalls it's there for
+  prctl(PR_SET_NAME, "cloro-watchdog");
+  struct timespec wait = {0, (long)period};
+  while (!__atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE)) {
+    check(monotonicNanos());
+    nanosleep(&wait, 0);
+  }
+}
+
+void StallWatchdog::check(long long now) {
+  for (unsigned int i=0; i<activities.size(); i++) {
+    Activity &activity = activities[i];
+    int tid = 0;
+    long long late = overdue(i, now, &tid);
+    if (late > threshold) {
+      if (activity.stalledFor == 0) {
+        countMetric(&activity.stalls);
+        report(activity, late, tid);
+      }
+      __atomic_store_n(&activity.stalledFor, late, __ATOMIC_RELAXED);
+      if (late > activity.longest)
+        __atomic_store_n(&activity.longest, late, __ATOMIC_RELAXED);
+    }
+    else if (activity.stalledFor != 0) {
+      // The last check before it caught up saw the stall at most a period short of its length
+      cerr << "Stall over: " << activity.name << " was at least " << activity.stalledFor/1000000 << " ms late" << endl;
+      __atomic_store_n(&activity.stalledFor, 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void StallWatchdog::report(const Activity &activity, long long late, int tid) {
+  ostringstream text;
+  text << "Stall: " << activity.name << " is " << late/1000000 << " ms late";
+  if (tid != 0) {
+    text << ", thread " << tid << " " << threadState(tid) << endl;
+    vector<string> stack = threadStack(tid);
+    for (unsigned int i=0; i<stack.size(); i++)
+      text << "  " << stack[i] << endl;
+  }
+  else
+    text << endl;
+  cerr << text.str();
+}
+
+string StallWatchdog::threadState(int tid) {
+  ostringstream dir;
+  dir << "/proc/self/task/" << tid << "/";
+  string line, state = "?", wchan, syscallNr;
+  ifstream stat((dir.str() + "stat").c_str());
+  // The thread name is in parentheses and may hold spaces, the state follows it
+  if (getline(stat, line)) {
+    size_t open = line.find('('), close = line.rfind(')');
+    if (open != string::npos && close != string::npos && close > open && close + 2 < line.size())
+      state = line.substr(open + 1, close - open - 1) + ", state " + line[close + 2];
+  }
+  ifstream wchanFile((dir.str() + "wchan").c_str());
+  getline(wchanFile, wchan);
+  ifstream syscallFile((dir.str() + "syscall").c_str());
+  syscallFile >> syscallNr;
+  ostringstream text;
+  text << "(" << state;
+  if (!wchan.empty() && wchan != "0")
+    text << ", waiting in " << wchan;
+  if (!syscallNr.empty() && syscallNr != "running")
+    text << ", in syscall " << syscallNr;
+  text << ")";
+  return text.str();
+}
+
+vector<string> StallWatchdog::threadStack(int tid) {
+  vector<string> stack;
+  if (__atomic_load_n(&stackRequest, __ATOMIC_ACQUIRE) != 0 && !__atomic_load_n(&stackDone, __ATOMIC_ACQUIRE)) {
+    stack.push_back("no stack, an earlier stalled thread hasn't answered yet");
+    return stack;
+  }
+  __atomic_store_n(&stackDone, false, __ATOMIC_RELEASE);
+  __atomic_store_n(&stackRequest, tid, __ATOMIC_RELEASE);
+  if (syscall(SYS_tgkill, getpid(), tid, SIGUSR2) != 0) {
+    __atomic_store_n(&stackRequest, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stackDone, true, __ATOMIC_RELEASE);
+    stack.push_back("no stack, the thread is gone");
+    return stack;
+  }
+  long long giveUp = monotonicNanos() + STACK_TIMEOUT;
+  struct timespec wait = {0, 1000000};
+  while (!__atomic_load_n(&stackDone, __ATOMIC_ACQUIRE) && monotonicNanos() < giveUp)
+    nanosleep(&wait, 0);
+  if (!__atomic_load_n(&stackDone, __ATOMIC_ACQUIRE)) {
+    stack.push_back("no stack, the thread didn't answer (in uninterruptible sleep?)");
+    return stack;
+  }
+  // Frame 0 is the signal handler
+  char **symbols = backtrace_symbols(stackFrames + 1, nStackFrames - 1);
+  for (int i=0; symbols && i<nStackFrames-1; i++)
+    stack.push_back(symbols[i]);
+  free(symbols);
+  __atomic_store_n(&stackRequest, 0, __ATOMIC_RELEASE);
+  return stack;
+}
@@ -0,0 +1,58 @@
+//************** MIDIcloro **************
+//
+// Stall watchdog: a thread that checks the heartbeats of the main loop,
+// the clock and the input threads, and reports any of them that falls
+// behind by more than a threshold, with the state and the stack of the
+// stalled thread. Stalls are counted for the metrics, so an alert can
+// be raised on them.
+//
+// The stack is taken by sending SIGUSR2 to the stalled thread.
+//
+// This project is licensed under the terms of the MIT license
+//
+//***************************************
+
+#ifndef MIDICLORO_WATCHDOG_H
+#define MIDICLORO_WATCHDOG_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class StallWatchdog {
+ public:
+  // How many ns past due an activity is at now, 0 or less when it's on time or idle.
+  // tid is set to the kernel thread id it runs on, 0 if unknown.
+  typedef long long (*Overdue)(int activity, long long now, int *tid);
+
+  // Activities are numbered by their place in names, threshold in ns
+  StallWatchdog(const std::vector<std::string> &names, Overdue overdue, long long threshold);
+  ~StallWatchdog();
+  // Stalls of each activity in the Prometheus text format, from any thread
+  void writeMetrics(std::ostream &out);
+
+ private:
+  struct Activity {
+    std::string name;
+    unsigned long stalls;
+    long long longest;    // ns, the longest stall so far
+    long long stalledFor; // ns, how long the current stall has lasted, 0 if none
+  };
+  static void *watchdogThread(void *watchdog);
+  void run();
+  void check(long long now);
+  void report(const Activity &activity, long long late, int tid);
+  std::string threadState(int tid);
+  std::vector<std::string> threadStack(int tid);
+
+  std::vector<Activity> activities;
+  Overdue overdue;
+  long long threshold;
+  long long period;
+  pthread_t thread;
+  bool threadStarted;
+  bool stopRequested;
+};
+
+#endif